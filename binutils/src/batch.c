@@ -0,0 +1,197 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  batch mode
+// ================================================
+// Boots a program once, then runs a set of test cases from the point where the program
+// writes to the simulation sync register (0xE0000044). Each case runs in a forked copy of
+// the simulator, so the booted memory image is shared copy-on-write, and up to batch_jobs
+// cases run at once.
+//
+// The manifest has one case per line:
+//
+//    <name> [uart=<file>] [$<reg>=<value>] [[<addr>]=<value>] ...
+//
+// Each case writes its logs (sim_uart.log etc), its stdout and any frames (frameNNNNN.ppm)
+// into a directory <name>.
+// Blank lines and lines starting with '#' are ignored.
+
+#ifdef _WIN32
+
+void run_batch(F32Machine* m) {
+    fatal("Batch mode needs fork() - on Windows use --save-snapshot and --load-snapshot instead");
+}
+
+#else
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+typedef struct Patch {
+    int is_reg;
+    unsigned int addr;      // Register number or memory address
+    int value;
+} Patch;
+
+typedef struct BatchCase {
+    string name;
+    string uart_input;
+    Patch* patches;
+    int num_patches;
+    pid_t pid;
+    int status;
+} BatchCase;
+
+static BatchCase* cases;
+static int num_cases;
+
+// ================================================
+//                  read_manifest
+// ================================================
+
+static void parse_patch(BatchCase* c, char* tok) {
+    Patch p = {0};
+    char* end;
+    if (tok[0]=='$') {
+        p.is_reg = 1;
+        p.addr = strtoul(tok+1, &end, 10);
+        if (p.addr<1 || p.addr>31 || *end!='=')
+            fatal("Batch case '%s': bad register patch '%s'", c->name, tok);
+    } else if (tok[0]=='[') {
+        p.addr = strtoul(tok+1, &end, 0);
+        if (end[0]!=']' || end[1]!='=' || (p.addr & 3))
+            fatal("Batch case '%s': bad memory patch '%s'", c->name, tok);
+        end++;
+    } else
+        fatal("Batch case '%s': can't understand '%s'", c->name, tok);
+
+    p.value = strtoul(end+1, &end, 0);
+    if (*end)
+        fatal("Batch case '%s': bad value in '%s'", c->name, tok);
+
+    c->patches = my_realloc(c->patches, (c->num_patches+1) * sizeof(Patch));
+    c->patches[c->num_patches++] = p;
+}
+
+static void read_manifest(string filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        fatal("Can't open batch file '%s'", filename);
+
+    char line[1000];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* tok = strtok(line, " \t\r\n");
+        if (tok==0 || tok[0]=='#')
+            continue;
+
+        cases = my_realloc(cases, (num_cases+1) * sizeof(BatchCase));
+        BatchCase* c = &cases[num_cases++];
+        memset(c, 0, sizeof(BatchCase));
+        c->name = strdup(tok);
+
+        while ((tok = strtok(0, " \t\r\n")) != 0) {
+            if (strncmp(tok, "uart=", 5)==0)
+                c->uart_input = strdup(tok+5);
+            else
+                parse_patch(c, tok);
+        }
+    }
+    fclose(file);
+}
+
+// ================================================
+//                  start_case
+// ================================================
+// Runs in the child process - point the logs at the case's directory and apply its patches.
+
+static void start_case(F32Machine* m, BatchCase* c) {
+    batch_child = 1;
+    batch_file = 0;
+
+    FILE* uart_in = fopen(c->uart_input ? c->uart_input : "uart_input.hex", "r");
+    if (c->uart_input && uart_in==NULL)
+        fatal("Batch case '%s': can't open '%s'", c->name, c->uart_input);
+
+    if (mkdir(c->name, 0777) && errno!=EEXIST)
+        fatal("Batch case '%s': can't create directory", c->name);
+    if (chdir(c->name))
+        fatal("Batch case '%s': can't enter directory", c->name);
+    if (freopen("stdout.log", "w", stdout)==NULL)
+        exit(1);
+    open_logs(m, uart_in);
+    disk_private(m->disk);
+
+    for (int i=0; i<c->num_patches; i++) {
+        Patch* p = &c->patches[i];
+        if (p->is_reg)
+            f32_write_reg(m, p->addr, p->value);
+        else if (f32_mem_ptr(m, p->addr))
+            *f32_mem_ptr(m, p->addr) = p->value;
+        else
+            fatal("Batch case '%s': can't patch address %08x", c->name, p->addr);
+    }
+}
+
+// ================================================
+//                  run_batch
+// ================================================
+// Returns only in the child processes, which carry on running their case. The parent
+// waits for every case to finish, reports the results and exits.
+
+void run_batch(F32Machine* m) {
+    read_manifest(batch_file);
+    if (batch_jobs<=0)
+        batch_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    fflush(NULL);   // Don't let the children inherit buffered output
+    int next = 0, running = 0;
+    while (next<num_cases || running>0) {
+        while (next<num_cases && running<batch_jobs) {
+            BatchCase* c = &cases[next++];
+            c->pid = fork();
+            if (c->pid<0)
+                fatal("fork failed");
+            if (c->pid==0) {
+                start_case(m, c);
+                return;
+            }
+            running++;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid<0)
+            fatal("wait failed");
+        for (int i=0; i<num_cases; i++)
+            if (cases[i].pid==pid)
+                cases[i].status = status;
+        running--;
+    }
+
+    int passed = 0;
+    for (int i=0; i<num_cases; i++) {
+        int status = cases[i].status;
+        printf("%-24s ", cases[i].name);
+        if (WIFSIGNALED(status))
+            printf("killed by signal %d\n", WTERMSIG(status));
+        else if (WEXITSTATUS(status)==BATCH_TIMEOUT)
+            printf("Timeout\n");
+        else if (WEXITSTATUS(status)!=0)
+            printf("failed, exit status %d\n", WEXITSTATUS(status));
+        else {
+            printf("ok\n");
+            passed++;
+        }
+    }
+    printf("%d of %d cases passed\n", passed, num_cases);
+    exit(passed==num_cases ? 0 : 1);
+}
+
+#endif
@@ -0,0 +1,638 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BLIT_SSE2
+#endif
+
+// ================================================
+//                  blitter
+// ================================================
+// A model of the blitter (rtl/src/blit_*.sv). Commands are written to the registers at
+// 0xE0002000 - the arguments first, then the command word, which adds the command to the
+// fifo. Bitmaps are 8 bits per pixel in SDRAM.
+//
+//    E0002000  BLIT_CMD     W  Command, and its transparent color in bits 23:16
+//                           R  Number of slots free in the command fifo
+//    E0002004  BLIT_ARG1    RW
+//    E0002008  BLIT_ARG2    RW
+//    E000200C  BLIT_ARG3    RW
+//    E0002010  BLIT_STATUS  R  Bit 1 set if the command fifo has overflowed, bit 0 set while
+//                              the blitter is busy (bit 0 is simulation only)
+//
+// The blitter runs alongside the CPU on the same clock, taking one clock per instruction
+// executed. Like blit_command.sv it steps through every pixel of a command, clipped or not,
+// at a configurable number of pixels per clock, and takes 2 clocks between commands. Rather
+// than on a thread, the fifo is brought up to date whenever the CPU accesses the blitter
+// and at the end of each f32_run(), so runs are repeatable. A command draws when it
+// finishes.
+//
+// Coordinates are 16 bits, and wrap the way they do in the hardware. Pixels outside the clip
+// rectangle are not written. Whole rows are drawn at a time, using SSE2 where available.
+
+#define BLIT_NOP        0x00
+#define BLIT_SET_DEST   0x81    // arg1=bitmap addr, arg2=offset_y/x arg3=bytes per line
+#define BLIT_SET_CLIP   0x82    // arg1=y1/x1, arg2=y2/x2
+#define BLIT_SET_SRC    0x83    // arg1=bitmap addr, arg2=offset_x/y arg3=bytes per line
+#define BLIT_FONT       0x84    // arg1=font addr, arg2=Offset/BytePerChar/Height/Width
+#define BLIT_RECT       0x01    // arg1=y1/x1, arg2=y2/x2 arg3=color
+#define BLIT_LINE       0x02    // arg1=y1/x1, arg2=y2/x2 arg3=color
+#define BLIT_IMAGE      0x03    // arg1=desty/x arg2=srcy/x arg3=height/width
+#define BLIT_IMAGE_T    0x04    // arg1=desty/x arg2=srcy/x arg3=height/width     With transparent color
+#define BLIT_CHAR       0x05    // arg1=y/x, arg2=char   arg3=bgcolor/fgcolor
+#define BLIT_CHAR_T     0x06    // arg1=y/x, arg2=char   arg3=fgcolor
+
+#define NO_TRANSPARENCY 0x100
+#define PATTERN_BASE    0xF0000000  // Sources in the pattern ram, which isn't modelled
+
+static const char* command_names[] = {
+    "nop", "rect", "line", "image", "image_t", "char", "char_t"
+};
+static const char* setup_names[] = {
+    "set_dest", "set_clip", "set_src", "font"
+};
+
+struct Blitter {
+    F32Machine* m;
+    int regs[4];                        // BLIT_CMD and the three arguments
+    double rate;                        // Pixels per clock, or 0 to run commands at once
+
+    int fifo[BLIT_FIFO_SIZE][4];        // Copies of regs, the first being run
+    int head, count;
+    long long head_done;                // Time the first command in the fifo finishes
+    int overflow;
+
+    unsigned int dest_addr;
+    int dest_bpl, dest_ox, dest_oy;
+    int clip_x1, clip_y1, clip_x2, clip_y2;
+    unsigned int src_addr;
+    int src_bpl, src_ox, src_oy;
+    unsigned int font_addr;
+    int font_width, font_height, font_bpc, font_offset;
+
+    long long commands[BLIT_CHAR_T+1];  // Number of each command run
+    long long setups[4];                // and of each setup command
+    long long pixels[BLIT_CHAR_T+1];    // Pixels written by each command
+    long long unknown;
+    long long last_time;                // Time the statistics below were brought up to date
+    long long busy;                     // Clocks spent running commands
+    long long waiting;                  // Sum over time of the commands waiting in the fifo
+    int max_waiting;
+    long long overflows;                // Commands lost because the fifo was full
+};
+
+// ================================================
+//                  framebuffer access
+// ================================================
+
+// Pointer to a byte of SDRAM, and the number of bytes from there to the end of its page.
+// Bytes within a page are in address order, as the words are stored little endian.
+static unsigned char* sdram_bytes(F32Machine* m, unsigned int addr, int* avail) {
+    addr &= MEM_SIZE-1;
+    *avail = MEM_PAGE_SIZE - (addr & (MEM_PAGE_SIZE-1));
+    return (unsigned char*)mem_ptr(m, addr & ~3u) + (addr & 3);
+}
+
+static void fill_row(F32Machine* m, unsigned int addr, int n, int color) {
+    invalidate_code_range(m, addr & (MEM_SIZE-1), n);
+    while (n > 0) {
+        int avail;
+        unsigned char* p = sdram_bytes(m, addr, &avail);
+        int len = n < avail ? n : avail;
+        memset(p, color, len);
+        addr += len;
+        n -= len;
+    }
+}
+
+// Write n bytes, skipping any equal to transparent (which can be NO_TRANSPARENCY)
+static void merge_bytes(unsigned char* dest, const unsigned char* src, int n, int transparent) {
+    if (transparent==NO_TRANSPARENCY) {
+        memmove(dest, src, n);
+        return;
+    }
+    int i = 0;
+#ifdef BLIT_SSE2
+    __m128i t = _mm_set1_epi8((char)transparent);
+    for (; i+16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dest+i));
+        __m128i keep = _mm_cmpeq_epi8(s, t);
+        d = _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, s));
+        _mm_storeu_si128((__m128i*)(dest+i), d);
+    }
+#endif
+    for (; i<n; i++)
+        if (src[i] != transparent)
+            dest[i] = src[i];
+}
+
+static void write_row(F32Machine* m, unsigned int addr, const unsigned char* src, int n, int transparent) {
+    invalidate_code_range(m, addr & (MEM_SIZE-1), n);
+    while (n > 0) {
+        int avail;
+        unsigned char* p = sdram_bytes(m, addr, &avail);
+        int len = n < avail ? n : avail;
+        merge_bytes(p, src, len, transparent);
+        addr += len;
+        src += len;
+        n -= len;
+    }
+}
+
+static void read_row(F32Machine* m, unsigned int addr, unsigned char* dest, int n) {
+    if ((addr & 0xff000000)==PATTERN_BASE) {
+        memset(dest, 0, n);
+        return;
+    }
+    while (n > 0) {
+        int avail;
+        unsigned char* p = sdram_bytes(m, addr, &avail);
+        int len = n < avail ? n : avail;
+        memcpy(dest, p, len);
+        addr += len;
+        dest += len;
+        n -= len;
+    }
+}
+
+// ================================================
+//                  clipping
+// ================================================
+// The pixels (x+i)&0xffff for 0<=i<n form at most two runs once wrapped. Finds the parts of
+// them inside the clip range c1 <= x < c2, as pairs of (first i, count).
+
+static int clip_runs(int x, int n, int c1, int c2, int runs[2][2]) {
+    int num = 0;
+    int first = 0;
+    while (n > 0) {
+        int len = 0x10000 - x < n ? 0x10000 - x : n;
+        int lo = x > c1 ? x : c1;
+        int hi = x+len < c2 ? x+len : c2;
+        if (lo < hi) {
+            runs[num][0] = first + lo - x;
+            runs[num++][1] = hi - lo;
+        }
+        first += len;
+        n -= len;
+        x = 0;
+    }
+    return num;
+}
+
+static int in_clip(Blitter* b, int x, int y) {
+    return x>=b->clip_x1 && x<b->clip_x2 && y>=b->clip_y1 && y<b->clip_y2;
+}
+
+static unsigned int dest_address(Blitter* b, int x, int y) {
+    return b->dest_addr + x + (unsigned)y*b->dest_bpl;
+}
+
+// ================================================
+//                  drawing
+// ================================================
+
+// Draw width x height pixels with its top left at (x,y). Each row of the source is fetched
+// by get_row, into a buffer of width bytes.
+typedef void (*GetRow)(Blitter* b, int row, unsigned char* buf, int width, void* ctx);
+
+static long long draw(Blitter* b, int x, int y, int width, int height, int transparent, GetRow get_row, void* ctx) {
+    unsigned char* buf = my_malloc(width);
+    long long pixels = 0;
+    for (int row=0; row<height; row++) {
+        int yy = (y + row) & 0xffff;
+        if (yy < b->clip_y1 || yy >= b->clip_y2)
+            continue;
+        int runs[2][2];
+        int num = clip_runs(x, width, b->clip_x1, b->clip_x2, runs);
+        if (num==0)
+            continue;
+        get_row(b, row, buf, width, ctx);
+        for (int r=0; r<num; r++) {
+            int first = runs[r][0];
+            write_row(b->m, dest_address(b, (x+first) & 0xffff, yy), buf+first, runs[r][1], transparent);
+            pixels += runs[r][1];
+        }
+    }
+    free(buf);
+    return pixels;
+}
+
+static long long draw_rect(Blitter* b, int x, int y, int width, int height, int color) {
+    long long pixels = 0;
+    for (int row=0; row<height; row++) {
+        int yy = (y + row) & 0xffff;
+        if (yy < b->clip_y1 || yy >= b->clip_y2)
+            continue;
+        int runs[2][2];
+        int num = clip_runs(x, width, b->clip_x1, b->clip_x2, runs);
+        for (int r=0; r<num; r++) {
+            fill_row(b->m, dest_address(b, (x+runs[r][0]) & 0xffff, yy), runs[r][1], color);
+            pixels += runs[r][1];
+        }
+    }
+    return pixels;
+}
+
+typedef struct ImageSource {
+    int x, y;
+} ImageSource;
+
+static void image_row(Blitter* b, int row, unsigned char* buf, int width, void* ctx) {
+    ImageSource* s = ctx;
+    int y = (s->y + row) & 0xffff;
+    int runs[2][2];
+    int num = clip_runs(s->x, width, 0, 0x10000, runs);
+    for (int r=0; r<num; r++)
+        read_row(b->m, b->src_addr + ((s->x + runs[r][0]) & 0xffff) + (unsigned)y*b->src_bpl, buf + runs[r][0], runs[r][1]);
+}
+
+typedef struct CharSource {
+    unsigned int addr;
+    int fg, bg;
+} CharSource;
+
+// A row of a monochrome font. Bit 0 of each byte is the leftmost pixel.
+static void char_row(Blitter* b, int row, unsigned char* buf, int width, void* ctx) {
+    CharSource* s = ctx;
+    unsigned char bits[32];
+    int bytes = (width+7) / 8;
+    read_row(b->m, s->addr + row*(b->font_width>>3), bits, bytes);
+    for (int i=0; i<width; i++)
+        buf[i] = (bits[i>>3] >> (i&7)) & 1 ? s->fg : s->bg;
+}
+
+// Bresenham's algorithm, exactly as blit_command.sv does it in 16 bits
+static long long draw_line(Blitter* b, int x, int y, int end_x, int end_y, int color) {
+    short dx = x<=end_x ? end_x-x : x-end_x;
+    short dy = y<=end_y ? end_y-y : y-end_y;
+    short sx = x<=end_x ? 1 : -1;
+    short sy = y<=end_y ? 1 : -1;
+    short error = dx - dy;
+    long long pixels = 0;
+    unsigned char c = color;
+
+    for (int n=0; n<0x20000; n++) {
+        if (in_clip(b, x, y)) {
+            write_row(b->m, dest_address(b, x, y), &c, 1, NO_TRANSPARENCY);
+            pixels++;
+        }
+        if (x==end_x && y==end_y)
+            break;
+        short e2 = error * 2;
+        int step_y = e2 < dx;
+        int step_x = e2 > -dy;
+        if (step_y)
+            y = (y + sy) & 0xffff;
+        if (step_x)
+            x = (x + sx) & 0xffff;
+        error = error + (step_y ? dx : 0) + (step_x ? -dy : 0);
+    }
+    return pixels;
+}
+
+// ================================================
+//                  blit_command
+// ================================================
+
+#define LO(A)  ((A) & 0xffff)
+#define HI(A)  (((unsigned int)(A) >> 16) & 0xffff)
+
+static void blit_command(Blitter* b, const int* c) {
+    int cmd = c[0] & 0xff;
+    int arg1 = c[1], arg2 = c[2], arg3 = c[3];
+    long long pixels = 0;
+
+    switch (cmd) {
+        case BLIT_NOP:
+            break;
+
+        case BLIT_SET_DEST:
+            b->dest_addr = arg1 & (MEM_SIZE-1);
+            b->dest_ox = LO(arg2);
+            b->dest_oy = HI(arg2);
+            b->dest_bpl = LO(arg3);
+            break;
+
+        case BLIT_SET_CLIP:
+            b->clip_x1 = LO(arg1);
+            b->clip_y1 = HI(arg1);
+            b->clip_x2 = LO(arg2);
+            b->clip_y2 = HI(arg2);
+            break;
+
+        case BLIT_SET_SRC:
+            // Note the source offset is x in the top half, the other way round to the destination
+            b->src_addr = arg1;
+            b->src_ox = HI(arg2);
+            b->src_oy = LO(arg2);
+            b->src_bpl = LO(arg3);
+            break;
+
+        case BLIT_FONT:
+            b->font_addr = arg1;
+            b->font_width = arg2 & 0xff;
+            b->font_height = (arg2 >> 8) & 0xff;
+            b->font_bpc = (arg2 >> 16) & 0xff;
+            b->font_offset = (arg2 >> 24) & 0xff;
+            break;
+
+        case BLIT_RECT:
+            // Both corners are included
+            if (LO(arg1) < LO(arg2) && HI(arg1) < HI(arg2))
+                pixels = draw_rect(b, LO(LO(arg1) + b->dest_ox), LO(HI(arg1) + b->dest_oy), LO(arg2) - LO(arg1) + 1,
+                                   HI(arg2) - HI(arg1) + 1, arg3 & 0xff);
+            break;
+
+        case BLIT_LINE:
+            pixels = draw_line(b, LO(LO(arg1) + b->dest_ox), LO(HI(arg1) + b->dest_oy),
+                               LO(LO(arg2) + b->dest_ox), LO(HI(arg2) + b->dest_oy), arg3 & 0xff);
+            break;
+
+        case BLIT_IMAGE:
+        case BLIT_IMAGE_T: {
+            ImageSource s = { LO(LO(arg2) + b->src_ox), LO(HI(arg2) + b->src_oy) };
+            int width = LO(arg3) ? LO(arg3) : 0x10000;
+            int height = HI(arg3) ? HI(arg3) : 0x10000;
+            int transparent = cmd==BLIT_IMAGE_T ? (c[0] >> 16) & 0xff : NO_TRANSPARENCY;
+            pixels = draw(b, LO(LO(arg1) + b->dest_ox), LO(HI(arg1) + b->dest_oy), width, height, transparent, image_row, &s);
+            break;
+        }
+
+        case BLIT_CHAR:
+        case BLIT_CHAR_T: {
+            CharSource s;
+            s.addr = b->font_addr + ((arg2 - b->font_offset) & 0xff) * b->font_bpc;
+            s.fg = arg3 & 0xff;
+            s.bg = cmd==BLIT_CHAR ? (arg3 >> 16) & 0xff : ~arg3 & 0xff;
+            int transparent = cmd==BLIT_CHAR ? NO_TRANSPARENCY : s.bg;
+            if (b->font_width && b->font_height)
+                pixels = draw(b, LO(LO(arg1) + b->dest_ox), LO(HI(arg1) + b->dest_oy), b->font_width, b->font_height,
+                              transparent, char_row, &s);
+            break;
+        }
+
+        default:
+            printf("Unknown blit command %x\n", cmd);
+            b->unknown++;
+            return;
+    }
+
+    if (cmd & 0x80)
+        b->setups[cmd - BLIT_SET_DEST]++;
+    else {
+        b->commands[cmd]++;
+        b->pixels[cmd] += pixels;
+    }
+}
+
+// ================================================
+//                  command_clocks
+// ================================================
+// The time blit_command.sv takes over a command, given the blitter's state when it starts
+
+static long long command_clocks(Blitter* b, const int* c) {
+    int cmd = c[0] & 0xff;
+    int arg1 = c[1], arg2 = c[2], arg3 = c[3];
+    long long pixels = 0;
+    switch (cmd) {
+        case BLIT_RECT:
+            if (LO(arg1) < LO(arg2) && HI(arg1) < HI(arg2))
+                pixels = (long long)(LO(arg2) - LO(arg1) + 1) * (HI(arg2) - HI(arg1) + 1);
+            break;
+
+        case BLIT_LINE: {
+            int dx = abs(LO(arg2) - LO(arg1));
+            int dy = abs((int)HI(arg2) - (int)HI(arg1));
+            pixels = (dx > dy ? dx : dy) + 2;
+            break;
+        }
+
+        case BLIT_IMAGE:
+        case BLIT_IMAGE_T:
+            pixels = (long long)(LO(arg3) ? LO(arg3) : 0x10000) * (HI(arg3) ? HI(arg3) : 0x10000);
+            break;
+
+        case BLIT_CHAR:
+        case BLIT_CHAR_T:
+            pixels = b->font_width * b->font_height;
+            break;
+    }
+    if (b->rate==0)
+        return 0;
+    return 2 + (long long)(pixels / b->rate + 0.999);
+}
+
+// ================================================
+//                  command fifo
+// ================================================
+
+// Add the time from last_time to now to the statistics
+static void account(Blitter* b, long long now) {
+    if (now <= b->last_time)
+        return;
+    if (b->count) {
+        b->busy += now - b->last_time;
+        b->waiting += (b->count-1) * (now - b->last_time);
+    }
+    b->last_time = now;
+}
+
+static void blit_done(F32Machine* m, void* ctx);
+
+// Run the commands in the fifo that have finished by now, and schedule an event for when the
+// next one finishes
+static void update(Blitter* b, long long now) {
+    while (b->count && b->head_done <= now) {
+        account(b, b->head_done);
+        blit_command(b, b->fifo[b->head]);
+        b->head = (b->head+1) % BLIT_FIFO_SIZE;
+        b->count--;
+        if (b->count)
+            b->head_done += command_clocks(b, b->fifo[b->head]);
+    }
+    account(b, now);
+    if (b->count)
+        schedule_event(b->m, b->head_done, blit_done, b);
+    else
+        cancel_event(b->m, blit_done, b);
+}
+
+static void blit_done(F32Machine* m, void* ctx) {
+    update(ctx, machine_time(m));
+}
+
+static void enqueue(Blitter* b, long long now) {
+    update(b, now);
+    if (b->count==BLIT_FIFO_SIZE) {
+        b->overflow = 1;
+        b->overflows++;
+        return;
+    }
+    memcpy(b->fifo[(b->head + b->count) % BLIT_FIFO_SIZE], b->regs, sizeof(b->regs));
+    if (++b->count==1)
+        b->head_done = now + command_clocks(b, b->fifo[b->head]);
+    if (b->count-1 > b->max_waiting)
+        b->max_waiting = b->count-1;
+    update(b, now);
+}
+
+void blitter_update(F32Machine* m) {
+    if (m->blitter->count)
+        update(m->blitter, machine_time(m));
+}
+
+void f32_set_blit_rate(F32Machine* m, double pixels_per_clock) {
+    update(m->blitter, machine_time(m));
+    m->blitter->rate = pixels_per_clock;
+}
+
+// ================================================
+//                  registers
+// ================================================
+
+static int blit_read(void* ctx, unsigned int addr, int* value) {
+    Blitter* b = ctx;
+    int reg = (addr - BLIT_BASE) >> 2;
+    update(b, machine_time(b->m));
+    if (reg==0)
+        *value = BLIT_FIFO_SIZE-1 - (b->count ? b->count-1 : 0);
+    else if (reg<4)
+        *value = b->regs[reg];
+    else
+        *value = (b->overflow << 1) | (b->count!=0);
+    return 1;
+}
+
+static int blit_write(void* ctx, unsigned int addr, int value, int mask) {
+    Blitter* b = ctx;
+    int reg = (addr - BLIT_BASE) >> 2;
+    if (reg>=4)
+        return 0;
+    b->regs[reg] = (b->regs[reg] & ~mask) | (value & mask);
+    if (reg==0)
+        enqueue(b, machine_time(b->m));
+    return 1;
+}
+
+// ================================================
+//                  state
+// ================================================
+
+void blitter_get_state(Blitter* b, BlitterState* s) {
+    update(b, machine_time(b->m));
+    memcpy(s->regs, b->regs, sizeof(b->regs));
+    memcpy(s->fifo, b->fifo, sizeof(b->fifo));
+    s->head = b->head;
+    s->count = b->count;
+    s->head_left = b->count ? b->head_done - machine_time(b->m) : 0;
+    s->overflow = b->overflow;
+    s->dest_addr = b->dest_addr;
+    s->dest_bpl = b->dest_bpl;
+    s->dest_ox = b->dest_ox;
+    s->dest_oy = b->dest_oy;
+    s->clip_x1 = b->clip_x1;
+    s->clip_y1 = b->clip_y1;
+    s->clip_x2 = b->clip_x2;
+    s->clip_y2 = b->clip_y2;
+    s->src_addr = b->src_addr;
+    s->src_bpl = b->src_bpl;
+    s->src_ox = b->src_ox;
+    s->src_oy = b->src_oy;
+    s->font_addr = b->font_addr;
+    s->font_width = b->font_width;
+    s->font_height = b->font_height;
+    s->font_bpc = b->font_bpc;
+    s->font_offset = b->font_offset;
+}
+
+void blitter_set_state(Blitter* b, const BlitterState* s) {
+    long long now = machine_time(b->m);
+    memcpy(b->regs, s->regs, sizeof(b->regs));
+    memcpy(b->fifo, s->fifo, sizeof(b->fifo));
+    b->head = s->head % BLIT_FIFO_SIZE;
+    b->count = s->count;
+    b->head_done = now + s->head_left;
+    b->overflow = s->overflow;
+    b->dest_addr = s->dest_addr;
+    b->dest_bpl = s->dest_bpl;
+    b->dest_ox = s->dest_ox;
+    b->dest_oy = s->dest_oy;
+    b->clip_x1 = s->clip_x1;
+    b->clip_y1 = s->clip_y1;
+    b->clip_x2 = s->clip_x2;
+    b->clip_y2 = s->clip_y2;
+    b->src_addr = s->src_addr;
+    b->src_bpl = s->src_bpl;
+    b->src_ox = s->src_ox;
+    b->src_oy = s->src_oy;
+    b->font_addr = s->font_addr;
+    b->font_width = s->font_width;
+    b->font_height = s->font_height;
+    b->font_bpc = s->font_bpc;
+    b->font_offset = s->font_offset;
+    b->last_time = now;
+    if (b->count)
+        schedule_event(b->m, b->head_done, blit_done, b);
+    else
+        cancel_event(b->m, blit_done, b);
+}
+
+// ================================================
+//                  create / destroy
+// ================================================
+
+Blitter* blitter_create(F32Machine* m) {
+    Blitter* b = my_malloc(sizeof(Blitter));
+    b->m = m;
+    b->clip_x2 = 0xffff;
+    b->clip_y2 = 0xffff;
+    b->rate = F32_BLIT_RATE;
+    add_device(m, BLIT_BASE, 0x14, blit_read, blit_write, b, 1);
+    return b;
+}
+
+void blitter_destroy(Blitter* b) {
+    free(b);
+}
+
+// ================================================
+//                  f32_write_blitter
+// ================================================
+
+void f32_write_blitter(F32Machine* m, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file==NULL)
+        fatal("Can't create '%s'", filename);
+
+    Blitter* b = m->blitter;
+    long long instrs = f32_instr_count(m);
+    long long total = 0, pixels = 0;
+    fprintf(file, "    commands       pixels  per 1M instrs  command\n");
+    for (int i=1; i<=BLIT_CHAR_T; i++) {
+        fprintf(file, "%12lld %12lld %14.1f  %s\n", b->commands[i], b->pixels[i],
+                instrs ? 1e6*b->commands[i]/instrs : 0, command_names[i]);
+        total += b->commands[i];
+        pixels += b->pixels[i];
+    }
+    for (int i=0; i<4; i++) {
+        fprintf(file, "%12lld %12s %14.1f  %s\n", b->setups[i], "-", instrs ? 1e6*b->setups[i]/instrs : 0, setup_names[i]);
+        total += b->setups[i];
+    }
+    fprintf(file, "%12lld %12lld %14.1f  total in %lld instructions\n", total, pixels, instrs ? 1e6*total/instrs : 0, instrs);
+    if (b->unknown)
+        fprintf(file, "%12lld %12s %14s  unknown commands\n", b->unknown, "-", "-");
+
+    update(b, machine_time(m));
+    fprintf(file, "\nBlitter at %g pixels per clock\n", b->rate);
+    fprintf(file, "Busy           %lld clocks, %.1f%% of the time\n", b->busy, b->last_time ? 100.0*b->busy/b->last_time : 0);
+    fprintf(file, "Fifo waiting   %.2f commands on average, %d at most\n", b->last_time ? (double)b->waiting/b->last_time : 0, b->max_waiting);
+    fprintf(file, "Overflows      %lld commands lost\n", b->overflows);
+    fprintf(file, "Unfinished     %d commands\n", b->count);
+    fclose(file);
+}
@@ -0,0 +1,311 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  cache simulator
+// ================================================
+// Any number of cache configurations can be attached to a machine with f32_add_cache(). Each
+// sees either the instruction fetches or the data accesses to SDRAM, and keeps its own miss
+// counts, so one run evaluates every configuration. A configuration is given as a comma
+// separated list, for example "size=16k,line=64,ways=4,repl=lru,write=wb":-
+//
+//    size=<bytes>       Total size, with an optional k or m suffix (default 16k)
+//    line=<bytes>       Line size (default 64)
+//    ways=<n>           Associativity (default 1, direct mapped)
+//    repl=lru|fifo|random   Replacement policy (default lru)
+//    write=wb|wt        Write-back with write allocate, or write-through without (default wb)
+//    stream=d|i         Data accesses or instruction fetches (default d)
+//
+// Misses are also counted against the address of the instruction that made the access, to
+// give a breakdown by function.
+
+#define REPL_LRU    0
+#define REPL_FIFO   1
+#define REPL_RANDOM 2
+
+typedef struct CachePage {
+    long long accesses[CODE_PAGE_SIZE];
+    long long misses[CODE_PAGE_SIZE];
+} CachePage;
+
+struct Cache {
+    Cache* next;
+    string spec;
+    int instr;                  // Sees instruction fetches rather than data accesses
+    int line_bits, sets, ways, repl, write_back;
+
+    unsigned int* tags;         // Line address held in each way, sets*ways of them
+    unsigned long long* stamps; // Time of last use (lru) or fill (fifo)
+    unsigned char* flags;       // LINE_VALID, LINE_DIRTY
+    unsigned long long clock;
+    unsigned int random;
+
+    long long reads, writes, read_misses, write_misses;
+    long long fills, write_backs, write_throughs;
+    CachePage* pages[CODE_SDRAM_PAGES + CODE_ROM_PAGES];
+};
+
+#define LINE_VALID 1
+#define LINE_DIRTY 2
+
+// ================================================
+//                  f32_add_cache
+// ================================================
+
+static int parse_size(string s, int* value) {
+    char* end;
+    *value = strtol(s, &end, 10);
+    if (*end=='k' || *end=='K')
+        *value <<= 10, end++;
+    else if (*end=='m' || *end=='M')
+        *value <<= 20, end++;
+    return *end==0 && *value>0;
+}
+
+static int is_power_of_2(int n) {
+    return n>0 && (n & (n-1))==0;
+}
+
+int f32_add_cache(F32Machine* m, const char* spec) {
+    int size = 16384, line = 64, ways = 1, repl = REPL_LRU, write_back = 1, instr = 0;
+
+    char buf[200];
+    if (strlen(spec) >= sizeof(buf))
+        return 0;
+    strcpy(buf, spec);
+    for (char* tok = buf; tok; ) {
+        char* next = strchr(tok, ',');
+        if (next)
+            *next++ = 0;
+        char* value = strchr(tok, '=');
+        if (value==0)
+            return 0;
+        *value++ = 0;
+        int ok;
+        if (strcmp(tok, "size")==0)
+            ok = parse_size(value, &size);
+        else if (strcmp(tok, "line")==0)
+            ok = parse_size(value, &line);
+        else if (strcmp(tok, "ways")==0)
+            ok = parse_size(value, &ways);
+        else if (strcmp(tok, "repl")==0) {
+            repl = strcmp(value, "lru")==0 ? REPL_LRU : strcmp(value, "fifo")==0 ? REPL_FIFO :
+                   strcmp(value, "random")==0 ? REPL_RANDOM : -1;
+            ok = repl>=0;
+        } else if (strcmp(tok, "write")==0) {
+            write_back = strcmp(value, "wb")==0;
+            ok = write_back || strcmp(value, "wt")==0;
+        } else if (strcmp(tok, "stream")==0) {
+            instr = strcmp(value, "i")==0;
+            ok = instr || strcmp(value, "d")==0;
+        } else
+            ok = 0;
+        if (!ok)
+            return 0;
+        tok = next;
+    }
+
+    if (!is_power_of_2(line) || line<4 || !is_power_of_2(ways) || !is_power_of_2(size) || size < line*ways)
+        return 0;
+
+    Cache* c = my_malloc(sizeof(Cache));
+    c->spec = strdup(spec);
+    c->instr = instr;
+    c->ways = ways;
+    c->sets = size / line / ways;
+    c->repl = repl;
+    c->write_back = write_back;
+    while ((1<<c->line_bits) < line)
+        c->line_bits++;
+    c->tags = my_malloc(c->sets * ways * sizeof(unsigned int));
+    c->stamps = my_malloc(c->sets * ways * sizeof(unsigned long long));
+    c->flags = my_malloc(c->sets * ways);
+    c->random = 0x12345678;
+
+    // Keep them in the order they were added
+    Cache** p = &m->caches;
+    while (*p)
+        p = &(*p)->next;
+    *p = c;
+    return 1;
+}
+
+void cache_destroy(Cache* caches) {
+    while (caches) {
+        Cache* c = caches;
+        caches = c->next;
+        for (int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++)
+            free(c->pages[i]);
+        free((void*)c->spec);
+        free(c->tags);
+        free(c->stamps);
+        free(c->flags);
+        free(c);
+    }
+}
+
+// ================================================
+//                  cache_access
+// ================================================
+
+static int choose_victim(Cache* c, int base) {
+    for (int w=0; w<c->ways; w++)
+        if (!(c->flags[base+w] & LINE_VALID))
+            return base+w;
+
+    if (c->repl==REPL_RANDOM) {
+        c->random ^= c->random << 13;
+        c->random ^= c->random >> 17;
+        c->random ^= c->random << 5;
+        return base + c->random % c->ways;
+    }
+
+    // lru and fifo both evict the oldest stamp - they differ in when the stamp is updated
+    int victim = base;
+    for (int w=1; w<c->ways; w++)
+        if (c->stamps[base+w] < c->stamps[victim])
+            victim = base+w;
+    return victim;
+}
+
+static void cache_access(Cache* c, unsigned int addr, int write, unsigned int instr_addr) {
+    unsigned int line = addr >> c->line_bits;
+    int base = (line & (c->sets-1)) * c->ways;
+    c->clock++;
+    if (write)
+        c->writes++;
+    else
+        c->reads++;
+
+    int index = code_page_index(instr_addr);
+    CachePage* cp = 0;
+    int w = (instr_addr>>2) & (CODE_PAGE_SIZE-1);
+    if (index>=0) {
+        if (c->pages[index]==0)
+            c->pages[index] = my_malloc(sizeof(CachePage));
+        cp = c->pages[index];
+        cp->accesses[w]++;
+    }
+
+    for (int i=base; i<base+c->ways; i++)
+        if ((c->flags[i] & LINE_VALID) && c->tags[i]==line) {
+            if (c->repl==REPL_LRU)
+                c->stamps[i] = c->clock;
+            if (write && c->write_back)
+                c->flags[i] |= LINE_DIRTY;
+            else if (write)
+                c->write_throughs++;
+            return;
+        }
+
+    // A miss
+    if (cp)
+        cp->misses[w]++;
+    if (write)
+        c->write_misses++;
+    else
+        c->read_misses++;
+    if (write && !c->write_back) {
+        c->write_throughs++;
+        return;
+    }
+
+    int victim = choose_victim(c, base);
+    if (c->flags[victim] & LINE_DIRTY)
+        c->write_backs++;
+    c->tags[victim] = line;
+    c->stamps[victim] = c->clock;
+    c->flags[victim] = LINE_VALID | (write ? LINE_DIRTY : 0);
+    c->fills++;
+}
+
+// Called for every load and store, while m->pc is the address after the instruction
+void cache_data(F32Machine* m, unsigned int addr, int write) {
+    if (addr >= MEM_SIZE)
+        return;
+    for (Cache* c=m->caches; c; c=c->next)
+        if (!c->instr)
+            cache_access(c, addr, write, m->pc-4);
+}
+
+// Called after running the first `executed` instructions of a block
+void cache_block(F32Machine* m, Block* block, int executed) {
+    for (Cache* c=m->caches; c; c=c->next)
+        if (c->instr)
+            for (int i=0; i<executed; i++) {
+                unsigned int addr = block->ops[i].pc - 4;
+                if (addr < MEM_SIZE)
+                    cache_access(c, addr, 0, addr);
+            }
+}
+
+// ================================================
+//                  f32_write_caches
+// ================================================
+
+typedef struct FunctionMisses {
+    string name;
+    long long accesses, misses;
+} FunctionMisses;
+
+static int compare_function_misses(const void* a, const void* b) {
+    long long x = ((const FunctionMisses*)a)->misses;
+    long long y = ((const FunctionMisses*)b)->misses;
+    return (x<y) - (x>y);
+}
+
+static double percent(long long a, long long b) {
+    return b ? 100.0*a/b : 0;
+}
+
+void f32_write_caches(F32Machine* m, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file==NULL)
+        fatal("Can't create '%s'", filename);
+
+    fprintf(file, "   accesses     misses  miss rate  read miss  write miss  memory traffic  configuration\n");
+    for (Cache* c=m->caches; c; c=c->next) {
+        long long accesses = c->reads + c->writes;
+        long long misses = c->read_misses + c->write_misses;
+        long long traffic = ((c->fills + c->write_backs) << c->line_bits) + 4*c->write_throughs;
+        fprintf(file, "%11lld %10lld %9.2f%% %9.2f%% %10.2f%% %15lld  %s\n", accesses, misses,
+                percent(misses, accesses), percent(c->read_misses, c->reads), percent(c->write_misses, c->writes),
+                traffic, c->spec);
+    }
+
+    int num_labels;
+    ProfileLabel* labels = sort_labels(&num_labels);
+    FunctionMisses* funcs = my_malloc((num_labels+1) * sizeof(FunctionMisses));
+
+    for (Cache* c=m->caches; c; c=c->next) {
+        for (int i=0; i<=num_labels; i++) {
+            funcs[i].name = labels[i].name;
+            funcs[i].accesses = funcs[i].misses = 0;
+        }
+        for (int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++) {
+            CachePage* cp = c->pages[i];
+            if (cp==0)
+                continue;
+            for (int w=0; w<CODE_PAGE_SIZE; w++)
+                if (cp->accesses[w]) {
+                    FunctionMisses* f = &funcs[enclosing_function(labels, num_labels, code_page_address(i) + 4*w) - labels];
+                    f->accesses += cp->accesses[w];
+                    f->misses += cp->misses[w];
+                }
+        }
+        qsort(funcs, num_labels+1, sizeof(FunctionMisses), compare_function_misses);
+
+        fprintf(file, "\n%s\n", c->spec);
+        fprintf(file, "   accesses     misses  miss rate  function\n");
+        for (int i=0; i<=num_labels && funcs[i].misses; i++)
+            fprintf(file, "%11lld %10lld %9.2f%%  %s\n", funcs[i].accesses, funcs[i].misses,
+                    percent(funcs[i].misses, funcs[i].accesses), funcs[i].name);
+    }
+    free(funcs);
+    free(labels);
+    fclose(file);
+}
@@ -0,0 +1,207 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  devices
+// ================================================
+// The hardware registers occupy the 64kB from 0xE0000000. Each device model registers the
+// range of registers it handles with f32_add_device(), and device_map records which device
+// owns each word, so an access finds its device with a single table lookup. A device
+// registered later takes over any words an earlier one had, which lets a program embedding
+// the simulator replace the built in models. Accesses to words no device owns are reported
+// and ignored.
+
+// The built in devices mark themselves as steady when their reads are safe for skip_idle() to
+// repeat. Devices added through the API are assumed not to be.
+int add_device(F32Machine* m, unsigned int base, unsigned int size, F32MmioRead read, F32MmioWrite write, void* ctx, int steady) {
+    if (base < MMIO_BASE || base - MMIO_BASE + size > MMIO_SIZE || size==0 || m->num_devices==MAX_DEVICES)
+        return 0;
+
+    Device* d = &m->devices[m->num_devices++];
+    d->read = read;
+    d->write = write;
+    d->ctx = ctx;
+    d->steady = steady;
+    for (unsigned int a = base & ~3u; a < base+size; a += 4)
+        m->device_map[(a - MMIO_BASE) >> 2] = m->num_devices;
+    return 1;
+}
+
+int f32_add_device(F32Machine* m, unsigned int base, unsigned int size, F32MmioRead read, F32MmioWrite write, void* ctx) {
+    return add_device(m, base, size, read, write, ctx, 0);
+}
+
+// ================================================
+//                  device_output
+// ================================================
+// Output from the devices goes to the output callback if there is one, otherwise to the
+// uart log and to stdout. There is none while replaying, as it has been seen before. Bytes
+// the uart is holding on to go first, to keep everything in order.
+
+void device_output(F32Machine* m, string fmt, ...) {
+    va_list args;
+    if (m->replaying)
+        return;
+    uart_flush(m);
+    if (m->output) {
+        char buf[100];
+        va_start(args, fmt);
+        int len = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        m->output(m->output_ctx, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf)-1);
+        return;
+    }
+    if (m->uart_log) {
+        va_start(args, fmt);
+        vfprintf(m->uart_log, fmt, args);
+        va_end(args);
+    }
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+// ================================================
+//                  device_read / device_write
+// ================================================
+// Called for accesses in MMIO_BASE..MMIO_BASE+MMIO_SIZE. The hooks from f32_set_mmio_hooks()
+// still get the first look at every access.
+
+int device_read(F32Machine* m, unsigned int addr) {
+    int v;
+    if (m->mmio_read && m->mmio_read(m->mmio_ctx, addr, &v)) {
+        m->device_effect = 1;
+        return v;
+    }
+
+    int index = m->device_map[(addr - MMIO_BASE) >> 2];
+    Device* d = index ? &m->devices[index-1] : 0;
+    if (d && d->read && d->read(d->ctx, addr & ~3u, &v)) {
+        if (!d->steady)
+            m->device_effect = 1;
+        return v;
+    }
+    m->device_effect = 1;
+    if (!m->replaying)
+        printf("read_hwregs(%08x)\n", addr);
+    return 0xdeadbeef;
+}
+
+void device_write(F32Machine* m, unsigned int addr, int value, int mask) {
+    if (m->mmio_write && m->mmio_write(m->mmio_ctx, addr, value, mask))
+        return;
+
+    int index = m->device_map[(addr - MMIO_BASE) >> 2];
+    Device* d = index ? &m->devices[index-1] : 0;
+    if (d && d->write && d->write(d->ctx, addr & ~3u, value, mask))
+        return;
+    if (!m->replaying)
+        printf("write_hwregs(%08x, %08x)\n", addr, value);
+}
+
+// ================================================
+//                  built in devices
+// ================================================
+// Simple models of the peripherals in the RTL. The context of each is the machine. The uart,
+// blitter, vga and disk have files of their own.
+
+// 7 segment display and leds
+static int leds_write(void* ctx, unsigned int addr, int value, int mask) {
+    F32Machine* m = ctx;
+    (void)mask;
+    if (addr==0xE0000000)
+        device_output(m, "7-Segment = %06x\n", value&0xffffff);
+    else
+        device_output(m, "LEDs = %x\n", value&0x3ff);
+    return 1;
+}
+
+// The registers of the earlier blitter, which took its arguments in two latches. The blitter
+// in the RTL is only at BLIT_BASE (see blitter.c), so commands written here are reported and
+// ignored, and the free space reads from the real command queue.
+static int blitter_read(void* ctx, unsigned int addr, int* value) {
+    F32Machine* m = ctx;
+    if (addr==0xE0000034)
+        *value = device_read(m, BLIT_BASE);
+    else if (addr==0xE0000088)
+        *value = m->blit2;
+    else
+        return 0;
+    return 1;
+}
+
+static int blitter_write(void* ctx, unsigned int addr, int value, int mask) {
+    F32Machine* m = ctx;
+    if (addr==0xE0000038)
+        m->blit1 = (m->blit1 & ~mask) | (value & mask);
+    else if (addr==0xE000003C)
+        m->blit2 = (m->blit2 & ~mask) | (value & mask);
+    else
+        return 0;
+    return 1;
+}
+
+// Reads as 1 in simulations and 0 on real hardware
+static int simulation_read(void* ctx, unsigned int addr, int* value) {
+    (void)ctx;
+    (void)addr;
+    *value = 1;
+    return 1;
+}
+
+// Simulation only - a sync point, where f32_run() returns F32_SYNC
+static int sync_write(void* ctx, unsigned int addr, int value, int mask) {
+    F32Machine* m = ctx;
+    (void)addr;
+    (void)value;
+    (void)mask;
+    m->stop = F32_SYNC;
+    m->end_block = 1;
+    return 1;
+}
+
+void add_builtin_devices(F32Machine* m) {
+    add_device(m, 0xE0000000, 8, 0, leds_write, m, 1);
+    add_device(m, 0xE0000030, 4, simulation_read, 0, m, 1);
+    add_device(m, 0xE0000034, 12, blitter_read, blitter_write, m, 1);
+    add_device(m, 0xE0000044, 4, simulation_read, sync_write, m, 1);
+    add_device(m, 0xE0000088, 4, blitter_read, 0, m, 1);
+    m->uart = uart_create(m);
+    m->blitter = blitter_create(m);
+    m->vga = vga_create(m);
+    m->disk = disk_create(m);
+}
+
+// ================================================
+//                  device state
+// ================================================
+
+void get_device_state(F32Machine* m, DeviceState* state) {
+    uart_get_state(m->uart, &state->uart);
+    blitter_get_state(m->blitter, &state->blitter);
+    vga_get_state(m->vga, state->layers);
+    disk_get_state(m->disk, &state->disk);
+}
+
+void set_device_state(F32Machine* m, const DeviceState* state) {
+    uart_set_state(m->uart, &state->uart);
+    blitter_set_state(m->blitter, &state->blitter);
+    vga_set_state(m->vga, state->layers);
+    disk_set_state(m->disk, &state->disk);
+}
+
+// ================================================
+//                  device_next_event
+// ================================================
+// The earliest time at which a steady device might read differently. Other than the scan
+// line, which changes too often to be worth an event, devices only change at their events.
+
+long long device_next_event(F32Machine* m) {
+    long long row = vga_next_row(m);
+    return row < m->next_event ? row : m->next_event;
+}
@@ -164,20 +164,120 @@ static string decode_alu_name(int op, int c) {
         return alu_names[op];
 }
 
+// ================================================
+//                 label index
+// ================================================
+// load_labels() indexes all_labels two ways: a hash table on address for exact matches, and
+// an array sorted by address for finding the nearest label below an address. Where several
+// labels share an address the one first in all_labels wins, as it always has.
+
+static Token* label_hash;           // Open addressing, label_hash_size a power of 2
+static int label_hash_size;
+static Token* sorted_labels;        // Sorted by unsigned address, then all_labels order
+static int num_labels;
+
+typedef struct LabelOrder {
+    Token label;
+    int order;
+} LabelOrder;
+
+static int compare_label_order(const void* a, const void* b) {
+    const LabelOrder* x = a;
+    const LabelOrder* y = b;
+    if ((unsigned)x->label->value != (unsigned)y->label->value)
+        return (unsigned)x->label->value > (unsigned)y->label->value ? 1 : -1;
+    return x->order - y->order;
+}
+
+static unsigned int label_hash_index(int addr) {
+    return ((unsigned)addr * 2654435761u) & (label_hash_size-1);
+}
+
+static void build_label_index() {
+    free(label_hash);
+    free(sorted_labels);
+
+    num_labels = 0;
+    for (Token t = all_labels; t; t=t->next)
+        num_labels++;
+
+    label_hash_size = 16;
+    while (label_hash_size < 2*num_labels)
+        label_hash_size *= 2;
+    label_hash = my_malloc(label_hash_size * sizeof(Token));
+    for (Token t = all_labels; t; t=t->next) {
+        unsigned int h = label_hash_index(t->value);
+        while (label_hash[h] && label_hash[h]->value != t->value)
+            h = (h+1) & (label_hash_size-1);
+        if (label_hash[h]==0)
+            label_hash[h] = t;
+    }
+
+    LabelOrder* order = my_malloc((num_labels+1) * sizeof(LabelOrder));
+    int n = 0;
+    for (Token t = all_labels; t; t=t->next) {
+        order[n].label = t;
+        order[n].order = n;
+        n++;
+    }
+    qsort(order, num_labels, sizeof(LabelOrder), compare_label_order);
+    sorted_labels = my_malloc((num_labels+1) * sizeof(Token));
+    for (int i=0; i<num_labels; i++)
+        sorted_labels[i] = order[i].label;
+    free(order);
+}
+
+// Index of the first label in sorted_labels at or above addr, or above it if `above` is set
+static int search_labels(unsigned int addr, int above) {
+    int lo = 0, hi = num_labels;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        unsigned int value = sorted_labels[mid]->value;
+        if (value < addr || (above && value==addr))
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 // ================================================
 //                 find_label
 // ================================================
 
 string find_label(int addr) {
-    for(Token t = all_labels; t; t=t->next)
-        if (t->value == addr)
-            return t->text;
+    if (label_hash) {
+        unsigned int h = label_hash_index(addr);
+        for (; label_hash[h]; h = (h+1) & (label_hash_size-1))
+            if (label_hash[h]->value == addr)
+                return label_hash[h]->text;
+    }
 
     static char buf[16];
     sprintf(buf, "0x%08x", addr);
     return buf;
 }
 
+// ================================================
+//                 find_nearest_label
+// ================================================
+// Names an address relative to the label at or below it, as "func+0x1c"
+
+string find_nearest_label(int addr) {
+    int i = num_labels ? search_labels(addr, 1) : 0;
+    if (i==0)
+        return find_label(addr);
+
+    // Of several labels at that address use the first, as find_label() does
+    Token t = sorted_labels[search_labels(sorted_labels[i-1]->value, 0)];
+    if (t->value == addr)
+        return t->text;
+
+    static char buf[120];
+    snprintf(buf, sizeof(buf), "%s+0x%x", t->text, addr - t->value);
+    return buf;
+}
+
 
 // ================================================
 //                 disassemble_line
@@ -210,7 +310,8 @@ char *disassemble_line(int op, int pc) {
             if (i==1 && a==0)
                 sprintf(line, "ld %s, %d", reg_name[d], n13);
             else
-                sprintf(line, "%s %s, %s, 0x%x", decode_alu_name(i,c), reg_name[d], reg_name[a], n13); break;
+                sprintf(line, "%s %s, %s, 0x%x", decode_alu_name(i,c), reg_name[d], reg_name[a], n13);
+            break;
         case 0x12: sprintf(line, "%s %s, %s[%d]", load_names[i], reg_name[d], reg_name[a], n13); break;
         case 0x13: sprintf(line, "%s %s, %s[%d]", store_names[i], reg_name[b], reg_name[a], n13s); break;
         case 0x14: sprintf(line, "%s %s, %s, %s", bra_names[i], reg_name[a], reg_name[b], find_label(pc+4*n13s)); break;
@@ -220,13 +321,13 @@ char *disassemble_line(int op, int pc) {
             else if (d==30)
                 sprintf(line, "jsr %s", find_label(pc+4*n21));
             else
-                sprintf(line, "jmp %s, %s", reg_name[d], find_label(pc+4*n21)); break;
+                sprintf(line, "jmp %s, %s", reg_name[d], find_label(pc+4*n21));
             break;
         case 0x16: 
             if (a==30 && n13==0)
                 sprintf(line, "ret");
             else
-            sprintf(line, "jmp %s, %s[%d]", reg_name[d], reg_name[a], n13); 
+                sprintf(line, "jmp %s, %s[%d]", reg_name[d], reg_name[a], n13); 
             break;
         case 0x17: sprintf(line, "ld %s, 0x%x", reg_name[d], n21<<11); break;
         case 0x18: sprintf(line, "ldpc %s, %s", reg_name[d], find_label(pc+4*n21)); break;
@@ -243,7 +344,7 @@ char *disassemble_line(int op, int pc) {
                 sprintf(line, "sys %d", n13);
             else
                 sprintf(line, "undefined cfg %d",i);
-                break;
+            break;
         case 0x1c: sprintf(line, "%s %s, %s, %s", idx_name[i], reg_name[d], reg_name[a], reg_name[b]); break;
         default: sprintf(line, "undefined"); break;
     }
@@ -256,10 +357,11 @@ char *disassemble_line(int op, int pc) {
 
 void disassemble_program(int *program, int len) {
     int pc = 0;
+    int next_label = num_labels ? search_labels(org, 0) : 0;
     while (pc < len*4) {
-        for(Token t = all_labels; t; t=t->next)
-            if (t->value == org + pc)
-                printf("%08x:          %s:\n", t->value, t->text);
+        for (; next_label<num_labels && (unsigned)sorted_labels[next_label]->value <= (unsigned)(org + pc); next_label++)
+            if (sorted_labels[next_label]->value == org + pc)
+                printf("%08x:          %s:\n", org + pc, sorted_labels[next_label]->text);
 
         unsigned int i = program[pc/4];
         printf("%08x: %08x %s\n", org+pc, i, disassemble_line(i, org + pc+4));
@@ -293,4 +395,5 @@ void load_labels(string filename) {
     }
 
     fclose(file);
+    build_label_index();
 }
\ No newline at end of file
@@ -0,0 +1,294 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  disk
+// ================================================
+// A block device of 1kB sectors, backed by a disk image in the layout f32filesys makes
+// (sector 0 the boot sector, the bitmap from sector 1). Simulation only - on the hardware
+// falconOs reaches the disk through the host interface.
+//
+//    E0003000  DISK_SECTOR  RW  First sector to transfer
+//    E0003004  DISK_ADDR    RW  SDRAM address to transfer to or from
+//    E0003008  DISK_COUNT   RW  Number of sectors
+//    E000300C  DISK_CMD     W   DISK_READ or DISK_WRITE, starting the transfer
+//                           R   Bit 0 set while busy, bit 1 set if the last command failed
+//    E0003010  DISK_SIZE    R   Number of sectors on the disk
+//
+// The image is mapped into memory, and a transfer is a memcpy per SDRAM page. It takes
+// clocks_per_sector for each sector, and like the blitter's commands, happens all at once
+// when it finishes. A command fails if the disk is busy, or the sectors or the memory are out
+// of range.
+//
+// Writes go to the file, except in batch cases, whose writes are kept private so they don't
+// see each other's or change the image. While recording, the sectors are saved before they
+// are written, so that going back puts them back.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define DISK_READ        1      // Disk to memory
+#define DISK_WRITE       2      // Memory to disk
+
+struct Disk {
+    F32Machine* m;
+    unsigned char* image;       // The mapped disk image, or NULL
+    long long size;             // Bytes mapped
+    int num_sectors;
+    int clocks_per_sector;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#else
+    int fd;
+#endif
+
+    int sector;
+    unsigned int addr;
+    int count;
+    int command;                // Command in progress, or 0
+    int error;
+    long long done;             // Time the command finishes
+
+    long long sectors_read, sectors_written;
+    long long busy;             // Clocks spent on transfers
+};
+
+// ================================================
+//                  transfer
+// ================================================
+
+static void transfer(Disk* d) {
+    F32Machine* m = d->m;
+    unsigned char* p = disk_sectors(d, d->sector);
+    unsigned int addr = d->addr;
+    int n = d->count * DISK_SECTOR_SIZE;
+
+    if (d->command==DISK_READ) {
+        invalidate_code_range(m, addr, n);
+        d->sectors_read += d->count;
+    } else {
+        if (m->record)
+            record_disk_write(m, d->sector, d->count);
+        d->sectors_written += d->count;
+    }
+
+    while (n > 0) {
+        int len = MEM_PAGE_SIZE - (addr & (MEM_PAGE_SIZE-1));
+        if (len > n)
+            len = n;
+        int* page = m->mem_pages[addr >> MEM_PAGE_BITS];
+        unsigned char* mem = (unsigned char*)page + (addr & (MEM_PAGE_SIZE-1));
+        if (d->command==DISK_READ) {
+            if (page==0)
+                mem = (unsigned char*)alloc_mem_page(m, addr) + (addr & (MEM_PAGE_SIZE-1));
+            memcpy(mem, p, len);
+        } else if (page)
+            memcpy(p, mem, len);
+        else
+            for (int i=0; i<len; i++)     // An untouched page reads as MEM_UNTOUCHED
+                p[i] = (unsigned char)(MEM_UNTOUCHED >> (8*((addr+i) & 3)));
+        p += len;
+        addr += len;
+        n -= len;
+    }
+}
+
+static void disk_done(F32Machine* m, void* ctx) {
+    Disk* d = ctx;
+    (void)m;
+    transfer(d);
+    d->command = 0;
+}
+
+static void start(Disk* d, int command) {
+    F32Machine* m = d->m;
+    d->error = d->command!=0 || d->image==0 || (command!=DISK_READ && command!=DISK_WRITE)
+        || d->sector < 0 || d->count <= 0 || d->count > d->num_sectors - d->sector
+        || d->addr >= MEM_SIZE || d->count > (int)((MEM_SIZE - d->addr) / DISK_SECTOR_SIZE);
+    if (d->error)
+        return;
+    d->command = command;
+    long long clocks = (long long)d->count * d->clocks_per_sector;
+    d->busy += clocks;
+    d->done = machine_time(m) + clocks;
+    schedule_event(m, d->done, disk_done, d);
+}
+
+// ================================================
+//                  registers
+// ================================================
+
+static int disk_read(void* ctx, unsigned int addr, int* value) {
+    Disk* d = ctx;
+    switch (addr - DISK_BASE) {
+        case 0x00: *value = d->sector; break;
+        case 0x04: *value = (int)d->addr; break;
+        case 0x08: *value = d->count; break;
+        case 0x0C: *value = (d->command!=0) | (d->error << 1); break;
+        case 0x10: *value = d->num_sectors; break;
+        default: return 0;
+    }
+    return 1;
+}
+
+static int disk_write(void* ctx, unsigned int addr, int value, int mask) {
+    Disk* d = ctx;
+    switch (addr - DISK_BASE) {
+        case 0x00: d->sector = (d->sector & ~mask) | (value & mask); break;
+        case 0x04: d->addr = (d->addr & ~mask) | (value & mask); break;
+        case 0x08: d->count = (d->count & ~mask) | (value & mask); break;
+        case 0x0C: start(d, value & mask); break;
+        default: return 0;
+    }
+    return 1;
+}
+
+// ================================================
+//                  f32_open_disk
+// ================================================
+
+static void close_image(Disk* d) {
+    if (d->image==0)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(d->image);
+    CloseHandle(d->mapping);
+    CloseHandle(d->file);
+#else
+    munmap(d->image, (size_t)d->size);
+    close(d->fd);
+#endif
+    d->image = 0;
+    d->num_sectors = 0;
+}
+
+int f32_open_disk(F32Machine* m, const char* filename, int clocks_per_sector) {
+    Disk* d = m->disk;
+    close_image(d);
+    d->clocks_per_sector = clocks_per_sector;
+    long long size;
+#ifdef _WIN32
+    LARGE_INTEGER file_size;
+    d->file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (d->file==INVALID_HANDLE_VALUE)
+        return 0;
+    GetFileSizeEx(d->file, &file_size);
+    size = file_size.QuadPart;
+    d->mapping = size >= DISK_SECTOR_SIZE ? CreateFileMappingA(d->file, NULL, PAGE_READWRITE, 0, 0, NULL) : NULL;
+    d->image = d->mapping ? MapViewOfFile(d->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : NULL;
+    if (d->image==0) {
+        if (d->mapping)
+            CloseHandle(d->mapping);
+        CloseHandle(d->file);
+        return 0;
+    }
+#else
+    int fd = open(filename, O_RDWR);
+    struct stat st;
+    if (fd<0)
+        return 0;
+    size = fstat(fd, &st)==0 ? st.st_size : 0;
+    void* image = size >= DISK_SECTOR_SIZE ? mmap(0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (image==MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    d->image = image;
+    d->fd = fd;             // Kept for disk_private()
+#endif
+    d->size = size;
+    d->num_sectors = (int)(size / DISK_SECTOR_SIZE);
+    return 1;
+}
+
+// Map the image again copy-on-write, so that later writes only change this process's copy
+void disk_private(Disk* d) {
+    if (d->image==0)
+        return;
+#ifdef _WIN32
+    void* image = MapViewOfFile(d->mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (image==0)
+        fatal("Can't map the disk image");
+    UnmapViewOfFile(d->image);
+#else
+    void* image = mmap(0, (size_t)d->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, d->fd, 0);
+    if (image==MAP_FAILED)
+        fatal("Can't map the disk image");
+    munmap(d->image, (size_t)d->size);
+#endif
+    d->image = image;
+}
+
+unsigned char* disk_sectors(Disk* d, int sector) {
+    return d->image + (size_t)sector * DISK_SECTOR_SIZE;
+}
+
+// ================================================
+//                  f32_write_disk
+// ================================================
+
+void f32_write_disk(F32Machine* m, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file==NULL)
+        fatal("Can't create '%s'", filename);
+    Disk* d = m->disk;
+    long long instrs = f32_instr_count(m);
+    fprintf(file, "%12lld  sectors read\n", d->sectors_read);
+    fprintf(file, "%12lld  sectors written\n", d->sectors_written);
+    fprintf(file, "%12lld  clocks busy (%.1f%% of the run, %d per sector)\n", d->busy,
+            instrs ? 100.0*d->busy/instrs : 0, d->clocks_per_sector);
+    fclose(file);
+}
+
+// ================================================
+//                  state
+// ================================================
+
+void disk_get_state(Disk* d, DiskState* s) {
+    s->sector = d->sector;
+    s->addr = d->addr;
+    s->count = d->count;
+    s->command = d->command;
+    s->error = d->error;
+    s->left = d->command ? d->done - machine_time(d->m) : 0;
+}
+
+void disk_set_state(Disk* d, const DiskState* s) {
+    d->sector = s->sector;
+    d->addr = s->addr;
+    d->count = s->count;
+    d->command = s->command;
+    d->error = s->error;
+    d->done = machine_time(d->m) + s->left;
+    if (d->command)
+        schedule_event(d->m, d->done, disk_done, d);
+    else
+        cancel_event(d->m, disk_done, d);
+}
+
+// ================================================
+//                  create / destroy
+// ================================================
+
+Disk* disk_create(F32Machine* m) {
+    Disk* d = my_malloc(sizeof(Disk));
+    d->m = m;
+    d->clocks_per_sector = F32_SECTOR_CLOCKS;
+    add_device(m, DISK_BASE, 0x14, disk_read, disk_write, d, 1);
+    return d;
+}
+
+void disk_destroy(Disk* d) {
+    close_image(d);
+    free(d);
+}
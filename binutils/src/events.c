@@ -0,0 +1,105 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  events
+// ================================================
+// Things that happen at a set machine_time() rather than as the result of an instruction -
+// the timer interrupt, the blitter finishing a command, the start of a frame - are kept in a
+// min-heap ordered by time. f32_run() only has to compare the time against next_event to
+// know whether anything is due, and never runs a block across an event, so each event sees
+// the machine exactly as it was at its time.
+//
+// Each source has at most one event pending, identified by its handler and context, so
+// scheduling it again moves it rather than adding another.
+
+static void swap(Event* a, Event* b) {
+    Event t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void sift_up(Event* heap, int i) {
+    while (i > 0 && heap[(i-1)/2].time > heap[i].time) {
+        swap(&heap[(i-1)/2], &heap[i]);
+        i = (i-1)/2;
+    }
+}
+
+static void sift_down(Event* heap, int n, int i) {
+    while (1) {
+        int least = i;
+        if (2*i+1 < n && heap[2*i+1].time < heap[least].time)
+            least = 2*i+1;
+        if (2*i+2 < n && heap[2*i+2].time < heap[least].time)
+            least = 2*i+2;
+        if (least==i)
+            return;
+        swap(&heap[least], &heap[i]);
+        i = least;
+    }
+}
+
+static void remove_event(F32Machine* m, int i) {
+    m->events[i] = m->events[--m->num_events];
+    if (i < m->num_events) {
+        sift_up(m->events, i);
+        sift_down(m->events, m->num_events, i);
+    }
+}
+
+static int find_event(F32Machine* m, EventHandler handler, void* ctx) {
+    for (int i=0; i<m->num_events; i++)
+        if (m->events[i].handler==handler && m->events[i].ctx==ctx)
+            return i;
+    return -1;
+}
+
+static void update_next_event(F32Machine* m) {
+    m->next_event = m->num_events ? m->events[0].time : LLONG_MAX;
+}
+
+// ================================================
+//                  schedule_event
+// ================================================
+
+void schedule_event(F32Machine* m, long long time, EventHandler handler, void* ctx) {
+    int i = find_event(m, handler, ctx);
+    if (i>=0)
+        remove_event(m, i);
+    if (m->num_events==MAX_EVENTS)
+        fatal("Too many simulator events");
+    Event* e = &m->events[m->num_events];
+    e->time = time;
+    e->handler = handler;
+    e->ctx = ctx;
+    sift_up(m->events, m->num_events++);
+    update_next_event(m);
+}
+
+void cancel_event(F32Machine* m, EventHandler handler, void* ctx) {
+    int i = find_event(m, handler, ctx);
+    if (i>=0)
+        remove_event(m, i);
+    update_next_event(m);
+}
+
+// ================================================
+//                  run_events
+// ================================================
+// Run everything due by now, in time order. Handlers can schedule further events.
+
+void run_events(F32Machine* m) {
+    long long now = machine_time(m);
+    while (m->num_events && m->events[0].time <= now) {
+        Event e = m->events[0];
+        remove_event(m, 0);
+        update_next_event(m);
+        e.handler(m, e.ctx);
+    }
+}
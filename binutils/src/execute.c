@@ -1,21 +1,13 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include "f32.h"
+#include "sim.h"
 
-static int reg[32];  // The CPU registers
-static unsigned int pc;       // The program counter
-
-extern int* prog_mem;  // program memory
-extern int* data_mem;  // data memory
-
-static FILE* reg_log;  // log register values to this file
-static FILE* uart_log;
-extern FILE* trace_file;    
-static FILE* blit_log;
-static FILE* uart_input;
-static FILE* mem_log;
-
+// Data accesses have to go through read_memory_size() and write_memory_size() to be seen
+#define WATCH_DATA(m)  (((m)->options & F32_TIMING) || (m)->caches)
 
 // ================================================
 //                  exception registers
@@ -53,30 +45,10 @@ static FILE* mem_log;
 
 #define ICAUSE_TIMER 1
 
-#define STATUS_SUPERVISOR 0x00000001
-#define STATUS_INTERRUPT  0x00000002
-
 #define DMPU_EXECUTE 0x00000400
 #define DMPU_WRITE   0x00000200
 #define DMPU_READ    0x00000100
 
-static int epc;
-static int ecause;
-static int edata;
-static int estatus;
-static int escratch;
-static int status = STATUS_SUPERVISOR;
-static int exception;
-static int ipc;
-static int icause;
-static int istatus;
-static int intvec;
-static int int_timer;
-static int dmpu[8];   // The data memory protection registers
-
-
-extern int abort_on_exception;
-
 static string exception_names[] = {
     "",
     "Instruction Access Fault",
@@ -90,250 +62,250 @@ static string exception_names[] = {
     "Index out of range"
 };
 
-void raise_exception(int cause, int value) {
-    if (abort_on_exception) {
-        printf("EXCEPTION %s: pc=%08x: data=%08x\n", exception_names[cause], pc-4, value);
-        for(int i=1; i<=31; i++) {
-            printf("$%2d=%08x ", i, reg[i]);
-            if (i%6==0)
-                printf("\n");
+void raise_exception(F32Machine* m, int cause, int value) {
+    if (m->options & F32_ABORT_ON_EXCEPTION) {
+        if (!m->replaying) {
+            printf("EXCEPTION %s: pc=%08x: data=%08x\n", exception_names[cause], m->pc-4, value);
+            for(int i=1; i<=31; i++) {
+                printf("$%2d=%08x ", i, m->reg[i]);
+                if (i%6==0)
+                    printf("\n");
+            }
         }
-        exit(1);
+        m->exception = 1;   // Suppress the rest of the instruction
+        m->stop = F32_EXCEPTION;
     }
 
-    estatus = status;
-    ecause = cause;
-    edata = value;
-    epc = pc-4;
-    pc = 0xffff0004;
-    status |= STATUS_SUPERVISOR;
-    if (trace_file)
-        fprintf(trace_file, "EXCEPTION: %d %x\n", cause, value);
+    m->estatus = m->status;
+    m->ecause = cause;
+    m->edata = value;
+    m->epc = m->pc-4;
+    m->pc = 0xffff0004;
+    m->status |= STATUS_SUPERVISOR;
+    if (m->trace_file)
+        fprintf(m->trace_file, "EXCEPTION: %d %x\n", cause, value);
+    if (m->trace)
+        trace_write_exception(m, cause, value);
+    if (m->options & F32_CALLGRAPH)
+        profile_exception(m);
 }
 
-void raise_interrupt(int cause) {
-    istatus = status;
-    icause = cause;
-    ipc = pc;
-    pc = intvec;
-    status |= STATUS_SUPERVISOR | STATUS_INTERRUPT;
-    if (trace_file)
-        fprintf(trace_file, "INTERUPT: %d\n", cause);
+void raise_interrupt(F32Machine* m, int cause) {
+    m->istatus = m->status;
+    m->icause = cause;
+    m->ipc = m->pc;
+    m->pc = m->intvec;
+    m->status |= STATUS_SUPERVISOR | STATUS_INTERRUPT;
+    if (m->trace_file)
+        fprintf(m->trace_file, "INTERUPT: %d\n", cause);
+    if (m->trace)
+        trace_write_interrupt(m, cause);
+    if (m->options & F32_CALLGRAPH)
+        profile_interrupt(m);
 }
 
-
-
 // ================================================
-//                  set_reg
+//                  timer
 // ================================================
-
-static void set_reg(int reg_num, int value) {
-    if (exception)
-        return;
-    if (reg_num==0)
-        return;
-    reg[reg_num] = value;
-    if (reg_log)
-        fprintf(reg_log, "$%2d = %08x\n", reg_num, value);
-    if (trace_file)
-        fprintf(trace_file, "$%2d = %08x", reg_num, value);
+// The timer register counts down by one for each instruction, and the interrupt is taken just
+// before the instruction that would count it down to 0. Rather than count, we keep the time
+// the interrupt is due and schedule an event for it. Between instructions the register reads
+// as timer_due - machine_time() + 1, and an instruction sees machine_time() as the time after
+// itself, so it reads one less.
+
+static void timer_event(F32Machine* m, void* ctx) {
+    (void)ctx;
+    raise_interrupt(m, ICAUSE_TIMER);
 }
 
-// ================================================
-//                  alu operation
-// ================================================
-
-static int alu_op(int op, int a, int b, int c) {
-    switch(op) {
-        case 0: return a & b;
-        case 1: return a | b;
-        case 2: return a ^ b;
-        case 3: switch(c&3) {
-            case 0: return a << (b & 31);
-            case 1: return 0;    
-            case 2: return ((unsigned)a) >> (b & 31);
-            case 3: return ((signed)a) >> (b & 31);
-        }
-        case 4: return a + b;
-        case 5: return a - b;
-        case 6: return a < b;
-        case 7: return ((unsigned)a) < ((unsigned)b);
-        default: return 0;
-    }
+static void set_timer(F32Machine* m, int value) {
+    m->timer_due = machine_time(m) + value - 1;
+    if (value > 0)
+        schedule_event(m, m->timer_due, timer_event, 0);
+    else
+        cancel_event(m, timer_event, 0);
 }
 
-// ================================================
-//                  mul operation
-// ================================================
-
-static int mul_op(int op, int a, int b) {
-    switch(op) {
-        case 0: return a * b;
-        case 4: return (b==0) ? -1 : ((unsigned)a) / ((unsigned)b);
-        case 5: return (b==0) ? -1 : ((signed)a) / ((signed)b);
-        case 6: return (b==0) ? a  : ((unsigned)a) % ((unsigned)b);
-        case 7: return (b==0) ? a  : ((signed)a) % ((signed)b);
-        default: return 0;
-    }
+static int read_timer(F32Machine* m) {
+    return (int)(m->timer_due - machine_time(m) + 1);
 }
 
-// ================================================
-//                  branch operation
-// ================================================
 
-static int branch_op(int op, int a, int b) {
-    switch(op) {
-        case 0: return a == b;
-        case 1: return a != b;
-        case 2: return a < b;
-        case 3: return a >= b;
-        case 4: return ((unsigned)a) < ((unsigned)b);
-        case 5: return ((unsigned)a) >= ((unsigned)b);
-        default: return 1;
-    }
-}
 
 // ================================================
-//                  index operation
+//                  machine state
 // ================================================
 
-static int idx_op(int op, int a, int b) {
-    if ((unsigned)a >= (unsigned)b)
-        raise_exception(CAUSE_INDEX_OVERFLOW, a);
-
-    switch(op) {
-        case 0: return a;
-        case 1: return a * 2;
-        case 2: return a * 4;
-        default: return 0;
-    }
+void get_cpu_state(F32Machine* m, CpuState* state) {
+    memcpy(state->reg, m->reg, sizeof(m->reg));
+    state->pc = m->pc;
+    state->epc = m->epc;
+    state->ecause = m->ecause;
+    state->edata = m->edata;
+    state->estatus = m->estatus;
+    state->escratch = m->escratch;
+    state->status = m->status;
+    state->ipc = m->ipc;
+    state->icause = m->icause;
+    state->istatus = m->istatus;
+    state->intvec = m->intvec;
+    state->int_timer = read_timer(m);
+    memcpy(state->dmpu, m->dmpu, sizeof(m->dmpu));
+    state->blit1 = m->blit1;
+    state->blit2 = m->blit2;
 }
 
+void set_cpu_state(F32Machine* m, const CpuState* state) {
+    memcpy(m->reg, state->reg, sizeof(m->reg));
+    m->reg[0] = 0;
+    m->pc = state->pc;
+    m->epc = state->epc;
+    m->ecause = state->ecause;
+    m->edata = state->edata;
+    m->estatus = state->estatus;
+    m->escratch = state->escratch;
+    m->status = state->status;
+    m->ipc = state->ipc;
+    m->icause = state->icause;
+    m->istatus = state->istatus;
+    m->intvec = state->intvec;
+    set_timer(m, state->int_timer);
+    memcpy(m->dmpu, state->dmpu, sizeof(m->dmpu));
+    m->blit1 = state->blit1;
+    m->blit2 = state->blit2;
+}
 
 // ================================================
-//                  blitter
+//                  set_reg
 // ================================================
 
-static void blit_op(int op, int a1, int a2) {
-    fprintf(uart_log, "Blit Cmd %x: %x, %x\n", op, a1, a2);
-    printf("Blit Cmd %x: %x, %x\n", op, a1, a2);
+static void set_reg(F32Machine* m, int reg_num, int value) {
+    if (m->exception)
+        return;
+    if (reg_num==0)
+        return;
+    m->reg[reg_num] = value;
+    if (m->reg_log)
+        fprintf(m->reg_log, "$%2d = %08x\n", reg_num, value);
+    if (m->trace_file)
+        fprintf(m->trace_file, "$%2d = %08x", reg_num, value);
+    if (m->trace)
+        trace_write_reg(m, reg_num, value);
 }
 
-
-
 // ================================================
-//                  write_hwregs
+//                  check_dmpu
 // ================================================
+// Test to see if a given memory access is allowed
 
-static int blit1,blit2;
-
-static void write_hwregs(unsigned int addr, int value, int mask) {
-
-    switch(addr & 0xFFFFFFFC) {
-        case 0xE0000000:
-            fprintf(uart_log, "7-Segment = %06x\n", value&0xffffff);
-            printf("7-Segment = %06x\n", value&0xffffff);
-            break;
-
-        case 0xE0000004:
-            fprintf(uart_log, "LEDs = %x\n", value&0x3ff);
-            printf("LEDs = %x\n", value&0x3ff);
-            break;
-
-        case 0xE0000010:
-            fprintf(uart_log, "%c", value);
-            printf("%c", value);
-            break;
-
-        case 0xE0000034:
-            blit_op(value, blit1, blit2);
-            break;
-
-        case 0xE0000038:
-            blit1 = (blit1 & ~mask) | (value & mask);
-            break;
-
-        case 0xE000003C:
-            blit2 = (blit2 & ~mask) | (value & mask);
-            break;
+static int check_dmpu(F32Machine* m, int access, int address) {
+    if (m->status & STATUS_SUPERVISOR)
+        return 1;       // Supervisor mode allows all accesses
 
-        default:
-            printf("write_hwregs(%08x, %08x)\n", addr, value);
-        break;
+    for(int i=0; i<8; i++) {
+        if (!(m->dmpu[i] & access))
+            continue;   // Skip entries that don't match the access type
+        int size = m->dmpu[i] & 0x0f;
+        int mask = 0xFFFFF000 << size;
+        if ((address & mask) == (m->dmpu[i] & mask))
+            return 1;   // Match
     }
+    return 0;
 }
 
-// ================================================
-//                  read_hwregs
-// ================================================
-
-static int read_hwregs(unsigned int addr) {
-    int v;
-
-    switch(addr & 0xFFFFFFFC) {
-        case 0xE0000010:   // UART TX
-            return 0x3ff;  // Report the space in the fifo - fake it to always be empty
-
-        case 0xE0000014:   // UART RX
-            fscanf(uart_input,"%x\n", &v);
-            return v;
-
-        case 0xE0000030:   // Simulation flag
-            return 1;      // Returns 1 in simulations, zero on real hardware
-
-        case 0xE0000028:   // VGA_Y pos
-            return 480;
 
-        case 0xE0000034:    // Fake the blitter queue - say there is always space
-            return 255;
 
-        case 0xE0000044:   // Indicate we are in simulation mode
-            return 1;
+// ================================================
+//                  translated code cache
+// ================================================
+// Code is translated a basic block at a time into arrays of micro-ops (see translate_block
+// below). Translated blocks are kept in code pages of 1024 words (4kB), allocated the first
+// time code is fetched from them. Pages 0..16383 cover the SDRAM, and the last 16 pages
+// cover the boot ROM at 0xFFFF0000.
+//
+// Each page keeps a bitmap of the words covered by translated blocks. A store to one of those
+// words flushes every block in the page. Pages that keep getting flushed by self-modifying 
+// code are given up on, and executed by the single step interpreter instead.
+
+#define SMC_FLUSH_LIMIT  16
+
+static void flush_code_page(F32Machine* m, CodePage* cp) {
+    for(int i=0; i<CODE_PAGE_SIZE; i++)
+        if (cp->blocks[i]) {
+            cp->blocks[i]->next = m->retired_blocks;
+            m->retired_blocks = cp->blocks[i];
+            cp->blocks[i] = 0;
+        }
+    memset(cp->code_map, 0, sizeof(cp->code_map));
+    cp->flush_count++;
+    m->end_block = 1;
+}
 
-        case 0xE0000088:
-            return blit2;
+static void free_retired_blocks(F32Machine* m) {
+    while (m->retired_blocks) {
+        Block* b = m->retired_blocks;
+        m->retired_blocks = b->next;
+        free(b);
+    }
+}
 
-        default:
-            printf("read_hwregs(%08x)\n", addr);
-            return 0xdeadbeef;
+// Called on every store to SDRAM or ROM, to catch self-modifying code
+static void invalidate_code(F32Machine* m, unsigned int addr) {
+    if (m->trace)
+        trace_invalidate(m, addr);
+    CodePage* cp = m->code_pages[code_page_index(addr)];
+    if (cp==0)
+        return;
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    if (cp->code_map[w>>5] & (1u<<(w&31)))
+        flush_code_page(m, cp);
+}
 
-        break;
+// Called when a device, rather than a store, writes to a range of SDRAM
+void invalidate_code_range(F32Machine* m, unsigned int addr, int len) {
+    unsigned int end = addr + len;
+    if (m->record)
+        for (unsigned int a = addr & ~(MEM_PAGE_SIZE-1u); a < end; a += MEM_PAGE_SIZE)
+            record_write(m, a);
+    for (unsigned int a = addr & ~3u; a < end; ) {
+        unsigned int page_end = (a | (CODE_PAGE_SIZE*4-1)) + 1;
+        if (page_end > end)
+            page_end = end;
+        if (m->code_pages[code_page_index(a)] || m->trace)
+            for (; a < page_end; a += 4)
+                invalidate_code(m, a);
+        else
+            a = page_end;
     }
 }
 
 // ================================================
-//                  check_dmpu
+//                  guest memory
 // ================================================
-// Test to see if a given memory access is allowed
-
-static int check_dmpu(int access, int address) {
-    if (status & STATUS_SUPERVISOR)
-        return 1;       // Supervisor mode allows all accesses
-
-    for(int i=0; i<8; i++) {
-        if (!(dmpu[i] & access))
-            continue;   // Skip entries that don't match the access type
-        int size = dmpu[i] & 0x0f;
-        int mask = 0xFFFFF000 << size;
-        if ((address & mask) == (dmpu[i] & mask))
-            return 1;   // Match
-    }
-    return 0;
+// The SDRAM is allocated a page at a time, the first time each page is written to.
+// Pages are filled with 0xBAADF00D when allocated, and untouched pages read as that.
+
+int* alloc_mem_page(F32Machine* m, unsigned int addr) {
+    int* page = my_malloc(MEM_PAGE_SIZE);
+    for(int i=0; i<MEM_PAGE_SIZE/4; i++)
+        page[i] = MEM_UNTOUCHED;
+    m->mem_pages[addr >> MEM_PAGE_BITS] = page;
+    if (!m->num_watches || !page_watched(m, addr >> MEM_PAGE_BITS))
+        m->fast_pages[addr >> MEM_PAGE_BITS] = page;
+    return page;
 }
 
-
-
 // ================================================
 //                  read_memory
 // ================================================
 
-static int read_memory(unsigned int addr) {
+static int read_memory(F32Machine* m, unsigned int addr) {
     if (addr < 0x4000000)
-        return data_mem[addr>>2];
-    else if (addr>=0xE0000000 && addr<0xE0001000)
-        return read_hwregs(addr);
+        return mem_read(m, addr);
+    else if (addr - MMIO_BASE < MMIO_SIZE)
+        return device_read(m, addr);
     else if (addr>=0xffff0000)
-        return prog_mem[(addr & 0xffff)>>2];
+        return m->prog_mem[(addr & 0xffff)>>2];
     else
         return 0xBAADF00D;
 }
@@ -343,23 +315,32 @@ static int read_memory(unsigned int addr) {
 //                  write_memory
 // ================================================
 
-static void write_memory(unsigned int addr, int value, int mask) {
-    if (exception)
+static void write_memory(F32Machine* m, unsigned int addr, int value, int mask) {
+    if (m->exception)
         return;
     if (addr < 0x4000000) {
-        int a = addr >> 2;
-        data_mem[a] = (data_mem[a] & ~mask) | (value & mask);
-        if (trace_file)
-            fprintf(trace_file, "[%08x] = %08x", addr, data_mem[a]);
-        fprintf(mem_log, "[%08x]=%08x %x\n", addr, value, 
+        if (m->record)
+            record_write(m, addr);
+        int* p = mem_ptr(m, addr);
+        *p = (*p & ~mask) | (value & mask);
+        invalidate_code(m, addr);
+        if (m->trace_file)
+            fprintf(m->trace_file, "[%08x] = %08x", addr, *p);
+        if (m->trace)
+            trace_write_mem(m, addr, *p);
+        if (m->mem_log)
+            fprintf(m->mem_log, "[%08x]=%08x %x\n", addr, value, 
             ((mask&0x01000000)>>21) | ((mask&0x00010000)>>14) | ((mask&0x00000100)>>7) | (mask&0x00000001));
-    } else if (addr>=0xE0000000 && addr<0xE000FFFF) {
-        write_hwregs(addr, value, mask);
-        if (trace_file)
-            fprintf(trace_file, "[%08x] = %08x", addr, value);
+    } else if (addr - MMIO_BASE < MMIO_SIZE) {
+        device_write(m, addr, value, mask);
+        if (m->trace_file)
+            fprintf(m->trace_file, "[%08x] = %08x", addr, value);
+        if (m->trace)
+            trace_write_mem(m, addr, value);
     } else if (addr>=0xffff0000) {
         int a = (addr & 0xffff) >> 2;
-        prog_mem[a] = (prog_mem[a] & ~mask) | (value & mask);
+        m->prog_mem[a] = (m->prog_mem[a] & ~mask) | (value & mask);
+        invalidate_code(m, addr);
     }
 }
 
@@ -367,9 +348,13 @@ static void write_memory(unsigned int addr, int value, int mask) {
 //                  write_memory_size
 // ================================================
 
-static void write_memory_size(unsigned int addr, int value, int size) {
-    if (!check_dmpu(DMPU_WRITE, addr)) {
-        raise_exception(CAUSE_STORE_ACCESS_FAULT, addr);
+static void write_memory_size(F32Machine* m, unsigned int addr, int value, int size) {
+    if (m->options & F32_TIMING)
+        timing_data(m, addr, 1);
+    if (m->caches)
+        cache_data(m, addr, 1);
+    if (!check_dmpu(m, DMPU_WRITE, addr)) {
+        raise_exception(m, CAUSE_STORE_ACCESS_FAULT, addr);
         return;
     }
 
@@ -384,7 +369,7 @@ static void write_memory_size(unsigned int addr, int value, int size) {
         case 1: 
             // Halfword
             if (addr & 1)
-                raise_exception(CAUSE_STORE_ADDRESS_MISALIGNED, addr);
+                raise_exception(m, CAUSE_STORE_ADDRESS_MISALIGNED, addr);
             mask = 0xffff << shift;
             value = (value & 0xffff) << shift;
             break;
@@ -392,7 +377,7 @@ static void write_memory_size(unsigned int addr, int value, int size) {
         case 2: 
             // Word
             if (addr & 3)
-                raise_exception(CAUSE_STORE_ADDRESS_MISALIGNED, addr);
+                raise_exception(m, CAUSE_STORE_ADDRESS_MISALIGNED, addr);
             mask = 0xffffffff; 
             break;
 
@@ -400,19 +385,25 @@ static void write_memory_size(unsigned int addr, int value, int size) {
             fatal("write_memory_size: invalid size %d", size);
     }
 
-    write_memory(addr, value, mask);
+    write_memory(m, addr, value, mask);
+    if (m->num_watches)
+        check_watch(m, addr, 1<<size, (int)((unsigned)value >> shift), F32_WATCH_WRITE);
 }
 
 // ================================================
 //                  read_memory_size
 // ================================================
 
-static int read_memory_size(unsigned int addr, int size) {
-    if (!check_dmpu(DMPU_READ, addr)) {
-        raise_exception(CAUSE_LOAD_ACCESS_FAULT, addr);
+static int read_memory_size(F32Machine* m, unsigned int addr, int size) {
+    if (m->options & F32_TIMING)
+        timing_data(m, addr, 0);
+    if (m->caches)
+        cache_data(m, addr, 0);
+    if (!check_dmpu(m, DMPU_READ, addr)) {
+        raise_exception(m, CAUSE_LOAD_ACCESS_FAULT, addr);
     }
 
-    int value = read_memory(addr& 0xfffffffc);;
+    int value = read_memory(m, addr& 0xfffffffc);;
     int shift = (addr & 3) * 8;
     switch(size) {
         case 0:
@@ -424,7 +415,7 @@ static int read_memory_size(unsigned int addr, int size) {
         case 1:
             // Halfword
             if (addr & 1)
-                raise_exception(CAUSE_LOAD_ADDRESS_MISALIGNED, addr);
+                raise_exception(m, CAUSE_LOAD_ADDRESS_MISALIGNED, addr);
             value = (value >> shift) & 0xffff;
             if (value & 0x8000)
                 value = value | 0xffff0000;
@@ -433,12 +424,14 @@ static int read_memory_size(unsigned int addr, int size) {
         case 2:
             // Word
             if (addr & 3)
-                raise_exception(CAUSE_LOAD_ADDRESS_MISALIGNED, addr);
+                raise_exception(m, CAUSE_LOAD_ADDRESS_MISALIGNED, addr);
             break;
 
         default:
             fatal("read_memory_size: invalid size %d", size);
     }
+    if (m->num_watches)
+        check_watch(m, addr, 1<<size, value, F32_WATCH_READ);
     return value;
 }
 
@@ -446,28 +439,28 @@ static int read_memory_size(unsigned int addr, int size) {
 //                  read_cfg
 // ================================================
 
-static int read_cfg(int cfg_reg) {
+static int read_cfg(F32Machine* m, int cfg_reg) {
     int ret;
     switch(cfg_reg) {
-        case CFG_REG_EPC:      ret = epc; break;
-        case CFG_REG_ECAUSE:   ret = ecause; break;
-        case CFG_REG_EDATA:    ret = edata; break;
-        case CFG_REG_ESTATUS:  ret = estatus; break;
-        case CFG_REG_ESCRATCH: ret = escratch; break;
-        case CFG_REG_STATUS:   ret = status; break;
-        case CFG_REG_IPC:      ret = ipc; break;
-        case CFG_REG_ICAUSE:   ret = icause; break;
-        case CFG_REG_ISTATUS:  ret = istatus; break;
-        case CFG_REG_INTVEC:   ret = intvec; break;
-        case CFG_REG_TIMER:    ret = int_timer; break;
-        case CFG_REG_DMPU0:    ret = dmpu[0]; break;
-        case CFG_REG_DMPU1:    ret = dmpu[1]; break;
-        case CFG_REG_DMPU2:    ret = dmpu[2]; break;
-        case CFG_REG_DMPU3:    ret = dmpu[3]; break;
-        case CFG_REG_DMPU4:    ret = dmpu[4]; break;
-        case CFG_REG_DMPU5:    ret = dmpu[5]; break;
-        case CFG_REG_DMPU6:    ret = dmpu[6]; break;
-        case CFG_REG_DMPU7:    ret = dmpu[7]; break;
+        case CFG_REG_EPC:      ret = m->epc; break;
+        case CFG_REG_ECAUSE:   ret = m->ecause; break;
+        case CFG_REG_EDATA:    ret = m->edata; break;
+        case CFG_REG_ESTATUS:  ret = m->estatus; break;
+        case CFG_REG_ESCRATCH: ret = m->escratch; break;
+        case CFG_REG_STATUS:   ret = m->status; break;
+        case CFG_REG_IPC:      ret = m->ipc; break;
+        case CFG_REG_ICAUSE:   ret = m->icause; break;
+        case CFG_REG_ISTATUS:  ret = m->istatus; break;
+        case CFG_REG_INTVEC:   ret = m->intvec; break;
+        case CFG_REG_TIMER:    ret = read_timer(m); break;
+        case CFG_REG_DMPU0:    ret = m->dmpu[0]; break;
+        case CFG_REG_DMPU1:    ret = m->dmpu[1]; break;
+        case CFG_REG_DMPU2:    ret = m->dmpu[2]; break;
+        case CFG_REG_DMPU3:    ret = m->dmpu[3]; break;
+        case CFG_REG_DMPU4:    ret = m->dmpu[4]; break;
+        case CFG_REG_DMPU5:    ret = m->dmpu[5]; break;
+        case CFG_REG_DMPU6:    ret = m->dmpu[6]; break;
+        case CFG_REG_DMPU7:    ret = m->dmpu[7]; break;
         default: ret = 0;
     }
     return ret;
@@ -477,41 +470,61 @@ static int read_cfg(int cfg_reg) {
 //                  write_cfg
 // ================================================
 
-static void write_cfg(int cfg_reg, int value) {
+static void write_cfg(F32Machine* m, int cfg_reg, int value) {
     switch(cfg_reg) {
-        case CFG_REG_EPC:      epc      = value;            break;
-        case CFG_REG_ECAUSE:   ecause   = value & 0xFF;     break;
-        case CFG_REG_EDATA:    edata    = value;            break;
-        case CFG_REG_ESTATUS:  estatus  = value & 0xFF;     break;
-        case CFG_REG_ESCRATCH: escratch = value;            break;
-        case CFG_REG_STATUS:   status   = value & 0xFF;     break;
-        case CFG_REG_IPC:      ipc = value; break;
-        case CFG_REG_ICAUSE:   icause = value & 0xFF; break;
-        case CFG_REG_ISTATUS:  istatus = value & 0xFF; break;
-        case CFG_REG_INTVEC:   intvec = value; break;
-        case CFG_REG_TIMER:    int_timer = value; break;
-        case CFG_REG_DMPU0:    dmpu[0] = value; break; // printf("DMPU[0] = %08x\n", value);
-        case CFG_REG_DMPU1:    dmpu[1] = value; break; // printf("DMPU[1] = %08x\n", value);
-        case CFG_REG_DMPU2:    dmpu[2] = value; break; // printf("DMPU[2] = %08x\n", value);
-        case CFG_REG_DMPU3:    dmpu[3] = value; break; // printf("DMPU[3] = %08x\n", value);
-        case CFG_REG_DMPU4:    dmpu[4] = value; break; // printf("DMPU[4] = %08x\n", value);
-        case CFG_REG_DMPU5:    dmpu[5] = value; break; // printf("DMPU[5] = %08x\n", value);
-        case CFG_REG_DMPU6:    dmpu[6] = value; break; // printf("DMPU[6] = %08x\n", value);
-        case CFG_REG_DMPU7:    dmpu[7] = value; break; // printf("DMPU[7] = %08x\n", value);
+        case CFG_REG_EPC:      m->epc      = value;            break;
+        case CFG_REG_ECAUSE:   m->ecause   = value & 0xFF;     break;
+        case CFG_REG_EDATA:    m->edata    = value;            break;
+        case CFG_REG_ESTATUS:  m->estatus  = value & 0xFF;     break;
+        case CFG_REG_ESCRATCH: m->escratch = value;            break;
+        case CFG_REG_STATUS:   m->status   = value & 0xFF;     break;
+        case CFG_REG_IPC:      m->ipc = value; break;
+        case CFG_REG_ICAUSE:   m->icause = value & 0xFF; break;
+        case CFG_REG_ISTATUS:  m->istatus = value & 0xFF; break;
+        case CFG_REG_INTVEC:   m->intvec = value; break;
+        case CFG_REG_TIMER:    set_timer(m, value); break;
+        case CFG_REG_DMPU0:    m->dmpu[0] = value; break; // printf("DMPU[0] = %08x\n", value);
+        case CFG_REG_DMPU1:    m->dmpu[1] = value; break; // printf("DMPU[1] = %08x\n", value);
+        case CFG_REG_DMPU2:    m->dmpu[2] = value; break; // printf("DMPU[2] = %08x\n", value);
+        case CFG_REG_DMPU3:    m->dmpu[3] = value; break; // printf("DMPU[3] = %08x\n", value);
+        case CFG_REG_DMPU4:    m->dmpu[4] = value; break; // printf("DMPU[4] = %08x\n", value);
+        case CFG_REG_DMPU5:    m->dmpu[5] = value; break; // printf("DMPU[5] = %08x\n", value);
+        case CFG_REG_DMPU6:    m->dmpu[6] = value; break; // printf("DMPU[6] = %08x\n", value);
+        case CFG_REG_DMPU7:    m->dmpu[7] = value; break; // printf("DMPU[7] = %08x\n", value);
 
     }
 }
 
 // ================================================
-//                  execute_instruction
+//                  micro-ops
 // ================================================
+// Each instruction is translated into a micro-op specialized on its operation and operand
+// kinds, so the dispatch loop does no further decoding. Ops are dispatched by computed
+// goto from run_block(), which supplies the handler address stored in each op.
+
+static const unsigned char alu_ops[8]  = {OP_AND, OP_OR, OP_XOR, OP_LSL, OP_ADD, OP_SUB, OP_CLT, OP_CLTU};
+static const unsigned char alui_ops[8] = {OP_ANDI, OP_ORI, OP_XORI, OP_LSLI, OP_ADDI, OP_SUBI, OP_CLTI, OP_CLTUI};
+static const unsigned char mul_ops[8]  = {OP_MUL, OP_LDI, OP_LDI, OP_LDI, OP_DIVU, OP_DIVS, OP_MODU, OP_MODS};
+static const unsigned char muli_ops[8] = {OP_MULI, OP_LDI, OP_LDI, OP_LDI, OP_DIVUI, OP_DIVSI, OP_MODUI, OP_MODSI};
+static const unsigned char shift_ops[4]  = {OP_LSL, OP_LDI, OP_LSR, OP_ASR};
+static const unsigned char shifti_ops[4] = {OP_LSLI, OP_LDI, OP_LSRI, OP_ASRI};
+static const unsigned char ld_ops[8]   = {OP_LDB, OP_LDH, OP_LDW, OP_LDX, OP_LDX, OP_LDX, OP_LDX, OP_LDX};
+static const unsigned char st_ops[8]   = {OP_STB, OP_STH, OP_STW, OP_STX, OP_STX, OP_STX, OP_STX, OP_STX};
+static const unsigned char idx_ops[8]  = {OP_IDX1, OP_IDX2, OP_IDX4, OP_IDXX, OP_IDXX, OP_IDXX, OP_IDXX, OP_IDXX};
+static const unsigned char bra_ops[8]  = {OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU, OP_BRA, OP_BRA};
 
-static void execute_instruction(int instr) {
+// ================================================
+//                  translate_instruction
+// ================================================
+// Translate one instruction into a micro-op. pc is the address of the following instruction.
+// Returns 1 if the instruction ends a basic block.
+
+static int translate_instruction(F32Machine* m, MicroOp* op, int instr, unsigned int pc) {
     int k = (instr >> 26) & 0x3f;
     int i =  (instr >> 23) & 0x7;
     int d = (instr >> 18) & 0x1f;
     int a = (instr >> 13) & 0x1f;
-    int c = (instr >> 5) & 0xff; 
+    int c = (instr >> 5) & 0xff;
     if (c&0x80)
         c = c | 0xffffff00; // sign extend
     int b = (instr >> 0) & 0x1f;
@@ -519,93 +532,642 @@ static void execute_instruction(int instr) {
     int n13  = (c<<5) | b;
     int n13s = (c<<5) | d;
     int n21 = (c<<13) | (i<<10) | (a<<5) | b;
-    int tmp;
+
+    int kind;
+    int imm = 0;
+    int end = 0;
 
     switch (k) {
-        case KIND_ALU:  set_reg(d, alu_op(i, reg[a], reg[b], c));  break;
-        case KIND_ALUI: set_reg(d, alu_op(i, reg[a], n13, c)); break;
-        case KIND_BRA:  if (branch_op(i, reg[a], reg[b])) {
-                            pc = pc + n13s * 4;
-                            if (trace_file)
-                                fprintf(trace_file, "-> %s", find_label(pc));
-                        }
-                        break;
-        case KIND_LD:   set_reg(d, read_memory_size(reg[a] + n13, i)); break;
-        case KIND_ST:   write_memory_size(reg[a] + n13s, reg[b], i); break;
-        case KIND_JMP:  set_reg(d,pc); 
-                        pc += n21*4; 
-                        if (trace_file)
-                            fprintf(trace_file, "-> %s", find_label(pc));
-                        break;
-        case KIND_JMPR: tmp = pc;
-                        pc = reg[a] + 4*n13; 
-                        set_reg(d,tmp);
-                        if (trace_file)
-                            fprintf(trace_file, "-> %s", find_label(pc));                        
+        case KIND_ALU:  kind = (i==3) ? shift_ops[c&3] : alu_ops[i]; break;
+        case KIND_ALUI: kind = (i==3) ? shifti_ops[c&3] : alui_ops[i];
+                        imm = (i==3) ? (n13 & 31) : n13;
+                        if (kind==OP_LDI)
+                            imm = 0;
+                        if (i==1 && a==0)
+                            kind = OP_LDI;
                         break;
-        case KIND_LDU:  set_reg(d, n21<<11); break;
-        case KIND_LDPC: set_reg(d, pc + n21*4); break;
-        case KIND_MUL:  set_reg(d, mul_op(i, reg[a],  reg[b])); break;
-        case KIND_MULI: set_reg(d, mul_op(i, reg[a],  n13)); break;
-        case KIND_CFG:  int tmp = read_cfg(n13);
-                        if (i==1)
-                            write_cfg(n13, reg[a]);
-                        if (i==0 || i==1)
-                            set_reg(d,tmp);
-                        if (i==2) {  // RTE
-                            if (n13 & 1) {
-                                // RTI
-                                status = istatus;
-                                pc = ipc;
-                            } else {
-                                // RTE
-                                status = estatus;
-                                pc = epc;
-                            }
-                            if (trace_file)
-                                fprintf(trace_file, "-> %s", find_label(pc));                        
-                        } 
-                        if (i==3) {  // SYS
-                            raise_exception(CAUSE_SYSTEM_CALL, n13);
-                        }
+        case KIND_BRA:  kind = bra_ops[i]; imm = pc + n13s*4; end = 1; break;
+        case KIND_LD:   kind = ld_ops[i]; imm = n13; break;
+        case KIND_ST:   kind = st_ops[i]; imm = n13s; break;
+        case KIND_JMP:  kind = OP_JMP; imm = pc + n21*4; end = 1; break;
+        case KIND_JMPR: kind = OP_JMPR; imm = 4*n13; end = 1; break;
+        case KIND_LDU:  kind = OP_LDI; imm = n21<<11; break;
+        case KIND_LDPC: kind = OP_LDI; imm = pc + n21*4; break;
+        case KIND_MUL:  kind = mul_ops[i]; break;
+        case KIND_MULI: kind = muli_ops[i]; imm = (kind==OP_LDI) ? 0 : n13; break;
+        case KIND_CFG:  kind = (i==0) ? OP_CFGR : (i==1) ? OP_CFGW : (i==2) ? ((n13&1) ? OP_RTI : OP_RTE) :
+                               (i==3) ? OP_SYS : OP_CFGX;
+                        imm = n13;
+                        end = 1;
                         break;
-        case KIND_IDX:  set_reg(d, idx_op(i, reg[a], reg[b])); break;
-        default: raise_exception(CAUSE_ILLEGAAL_INSTRUCTION, instr);
+        case KIND_IDX:  kind = idx_ops[i]; break;
+        default:        kind = OP_ILLEGAL; imm = instr; end = 1; break;
     }
+
+    // Data accesses are watched in read_memory_size(), which op_ldw bypasses
+    if (kind==OP_LDW && WATCH_DATA(m))
+        kind = OP_LDX;
+
+    // Ops with no side effects other than writing to $0 do nothing
+    if (d==0 && kind>=OP_LDI && kind<=OP_MODSI)
+        kind = OP_NOP;
+
+    op->handler = m->op_handlers[kind];
+    op->kind = kind;
+    op->d = d;
+    op->a = a;
+    op->b = b;
+    op->i = i;
+    op->imm = imm;
+    op->pc = pc;
+    return end;
+}
+
+// ================================================
+//                  translate_block
+// ================================================
+// Translate the basic block starting at addr. Blocks end at a control flow instruction,
+// at the end of the code page, or after MAX_BLOCK_INSTR instructions.
+
+static Block* translate_block(F32Machine* m, CodePage* cp, unsigned int addr) {
+    MicroOp ops[MAX_BLOCK_INSTR];
+    int n = 0;
+    int end = 0;
+
+    while (!end && n<MAX_BLOCK_INSTR) {
+        unsigned int a = addr + 4*n;
+        int w = (a>>2) & (CODE_PAGE_SIZE-1);
+        if (n>0 && (w==0 || (cp->break_map[w>>5] & (1u<<(w&31)))))
+            break;      // Don't run onto the next page, or over a breakpoint
+        end = translate_instruction(m, &ops[n++], read_memory(m, a), a+4);
+        cp->code_map[w>>5] |= 1u<<(w&31);
+    }
+
+    Block* block = my_malloc(sizeof(Block) + (n+1)*sizeof(MicroOp));
+    block->num_instr = n;
+    memcpy(block->ops, ops, n*sizeof(MicroOp));
+    block->ops[n].handler = m->op_handlers[OP_END];
+    block->ops[n].kind = OP_END;
+    block->ops[n].pc = addr + 4*n;
+
+    // A loop that only loads and computes may be polling a device
+    MicroOp* last = &ops[n-1];
+    block->poll_loop = last->kind>=OP_BEQ && last->kind<=OP_JMP && (unsigned)last->imm==addr;
+    for (int i=0; i<n-1; i++)
+        if (ops[i].kind>OP_LDX && (ops[i].kind<OP_IDX1 || ops[i].kind>OP_IDXX))
+            block->poll_loop = 0;
+    return block;
 }
 
 // ================================================
-//                  execute
+//                  find_block
 // ================================================
+// Find the translated block starting at addr, translating it if needed.
+// Returns NULL if the code there has to be run by the single step interpreter.
+
+static Block* find_block(F32Machine* m, unsigned int addr) {
+    int index = code_page_index(addr);
+    if (index<0 || (addr&3))
+        return 0;
+
+    CodePage* cp = m->code_pages[index];
+    if (cp==0)
+        cp = m->code_pages[index] = my_malloc(sizeof(CodePage));
+    if (cp->flush_count > SMC_FLUSH_LIMIT)
+        return 0;
+
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    if (cp->blocks[w]==0) {
+        if (cp->break_map[w>>5] & (1u<<(w&31)))
+            return 0;   // Leave breakpoints to the single step interpreter
+        cp->blocks[w] = translate_block(m, cp, addr);
+    }
+    return cp->blocks[w];
+}
 
-void execute() {
-    for(int i=0; i<0x1000000; i++)
-        data_mem[i] = 0xBAADF00D;
-    uart_input = fopen("uart_input.hex", "r");
+// ================================================
+//                  breakpoints
+// ================================================
+// Breakpoints are kept in a bitmap in each code page. Blocks are never translated starting at
+// or running over a breakpoint, so the translated code doesn't need to look for them - only
+// the single step interpreter does.
+
+static int at_breakpoint(F32Machine* m, unsigned int addr) {
+    int index = code_page_index(addr);
+    CodePage* cp = index>=0 ? m->code_pages[index] : 0;
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    return cp && (cp->break_map[w>>5] & (1u<<(w&31)));
+}
 
-    pc = 0xffff0000;
-    int timeout = 1000000;
-    reg[31] = 0x4000000;
-    reg_log = fopen("sim_reg.log", "w");
-    uart_log = fopen("sim_uart.log", "wb");
-    blit_log = fopen("sim_blit.log", "wb");
-    mem_log = fopen("sim_mem.log", "wb");
+// Does f32_run() stop before the instruction at the pc? Watches on instruction fetches use
+// breakpoints, but only stop with F32_WATCH_STOP. With can_stop clear the instruction is about
+// to be run anyway, so only the watches that print are seen.
+int breakpoint_here(F32Machine* m, int can_stop) {
+    if (!at_breakpoint(m, m->pc))
+        return 0;
+    int run_on = m->num_watches && watch_exec(m, can_stop);
+    return can_stop && !run_on;
+}
 
-    while (timeout>0 && pc!=0) {
-        exception = 0;
+int f32_set_breakpoint(F32Machine* m, unsigned int addr, int set) {
+    int index = code_page_index(addr);
+    if (index<0 || (addr&3))
+        return 0;
+    CodePage* cp = m->code_pages[index];
+    if (cp==0)
+        cp = m->code_pages[index] = my_malloc(sizeof(CodePage));
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    if (set)
+        cp->break_map[w>>5] |= 1u<<(w&31);
+    else
+        cp->break_map[w>>5] &= ~(1u<<(w&31));
 
-        if (--int_timer == 0)
-            raise_interrupt(ICAUSE_TIMER);
+    // Blocks covering the address have to be translated again. This isn't self-modifying
+    // code, so don't count it as such.
+    if (cp->code_map[w>>5] & (1u<<(w&31))) {
+        flush_code_page(m, cp);
+        cp->flush_count--;
+    }
+    return 1;
+}
 
-        int instr = read_memory(pc);
-        if (trace_file) 
-            fprintf(trace_file, "%08x: %-40s", pc, disassemble_line(instr,pc+4));
-        pc += 4;
-        execute_instruction(instr);
-        if (trace_file) 
-            fprintf(trace_file, "\n");
-        timeout--;    
+// ================================================
+//                  run_block
+// ================================================
+// Execute the ops of a block from op number start, dispatching with computed gotos. The caller
+// accounts for the block's instructions before calling. If an exception or a flush of the
+// block's code page stops the block early, returns the number of instructions not executed.
+//
+// Called with NULL to set up op_handlers.
+
+#define NEXT      op++; goto *op->handler
+#define RA        m->reg[op->a]
+#define RB        m->reg[op->b]
+#define EXIT_IF_EXCEPTION   if (m->pc != op->pc) goto exit_early
+
+static int run_block(F32Machine* m, Block* block, int start) {
+    static void* labels[NUM_OPS] = {
+        [OP_END]  = &&op_end,  [OP_NOP]  = &&op_nop,  [OP_LDI]  = &&op_ldi,
+        [OP_AND]  = &&op_and,  [OP_OR]   = &&op_or,   [OP_XOR]  = &&op_xor,  [OP_LSL]  = &&op_lsl,
+        [OP_LSR]  = &&op_lsr,  [OP_ASR]  = &&op_asr,  [OP_ADD]  = &&op_add,  [OP_SUB]  = &&op_sub,
+        [OP_CLT]  = &&op_clt,  [OP_CLTU] = &&op_cltu,
+        [OP_ANDI] = &&op_andi, [OP_ORI]  = &&op_ori,  [OP_XORI] = &&op_xori, [OP_LSLI] = &&op_lsli,
+        [OP_LSRI] = &&op_lsri, [OP_ASRI] = &&op_asri, [OP_ADDI] = &&op_addi, [OP_SUBI] = &&op_subi,
+        [OP_CLTI] = &&op_clti, [OP_CLTUI]= &&op_cltui,
+        [OP_MUL]  = &&op_mul,  [OP_DIVU] = &&op_divu, [OP_DIVS] = &&op_divs, [OP_MODU] = &&op_modu,
+        [OP_MODS] = &&op_mods,
+        [OP_MULI] = &&op_muli, [OP_DIVUI]= &&op_divui,[OP_DIVSI]= &&op_divsi,[OP_MODUI]= &&op_modui,
+        [OP_MODSI]= &&op_modsi,
+        [OP_LDB]  = &&op_ldb,  [OP_LDH]  = &&op_ldh,  [OP_LDW]  = &&op_ldw,  [OP_LDX]  = &&op_ldx,
+        [OP_STB]  = &&op_stb,  [OP_STH]  = &&op_sth,  [OP_STW]  = &&op_stw,  [OP_STX]  = &&op_stx,
+        [OP_IDX1] = &&op_idx1, [OP_IDX2] = &&op_idx2, [OP_IDX4] = &&op_idx4, [OP_IDXX] = &&op_idxx,
+        [OP_BEQ]  = &&op_beq,  [OP_BNE]  = &&op_bne,  [OP_BLT]  = &&op_blt,  [OP_BGE]  = &&op_bge,
+        [OP_BLTU] = &&op_bltu, [OP_BGEU] = &&op_bgeu, [OP_BRA]  = &&op_bra,
+        [OP_JMP]  = &&op_jmp,  [OP_JMPR] = &&op_jmpr,
+        [OP_CFGR] = &&op_cfgr, [OP_CFGW] = &&op_cfgw, [OP_RTE]  = &&op_rte,  [OP_RTI]  = &&op_rti,
+        [OP_SYS]  = &&op_sys,  [OP_CFGX] = &&op_cfgx,
+        [OP_ILLEGAL] = &&op_illegal,
+    };
+
+    if (block==0) {
+        m->op_handlers = labels;
+        return 0;
     }
-    if (timeout==0)
-        printf("Timeout\n");
+
+    MicroOp* op = &block->ops[start];
+    unsigned int addr;
+    int tmp;
+    int* page;
+    goto *op->handler;
+
+    op_nop:   NEXT;
+    op_ldi:   set_reg(m, op->d, op->imm); NEXT;
+
+    op_and:   set_reg(m, op->d, RA & RB); NEXT;
+    op_or:    set_reg(m, op->d, RA | RB); NEXT;
+    op_xor:   set_reg(m, op->d, RA ^ RB); NEXT;
+    op_lsl:   set_reg(m, op->d, RA << (RB & 31)); NEXT;
+    op_lsr:   set_reg(m, op->d, ((unsigned)RA) >> (RB & 31)); NEXT;
+    op_asr:   set_reg(m, op->d, RA >> (RB & 31)); NEXT;
+    op_add:   set_reg(m, op->d, RA + RB); NEXT;
+    op_sub:   set_reg(m, op->d, RA - RB); NEXT;
+    op_clt:   set_reg(m, op->d, RA < RB); NEXT;
+    op_cltu:  set_reg(m, op->d, ((unsigned)RA) < ((unsigned)RB)); NEXT;
+
+    op_andi:  set_reg(m, op->d, RA & op->imm); NEXT;
+    op_ori:   set_reg(m, op->d, RA | op->imm); NEXT;
+    op_xori:  set_reg(m, op->d, RA ^ op->imm); NEXT;
+    op_lsli:  set_reg(m, op->d, RA << op->imm); NEXT;
+    op_lsri:  set_reg(m, op->d, ((unsigned)RA) >> op->imm); NEXT;
+    op_asri:  set_reg(m, op->d, RA >> op->imm); NEXT;
+    op_addi:  set_reg(m, op->d, RA + op->imm); NEXT;
+    op_subi:  set_reg(m, op->d, RA - op->imm); NEXT;
+    op_clti:  set_reg(m, op->d, RA < op->imm); NEXT;
+    op_cltui: set_reg(m, op->d, ((unsigned)RA) < ((unsigned)op->imm)); NEXT;
+
+    op_mul:   set_reg(m, op->d, RA * RB); NEXT;
+    op_divu:  set_reg(m, op->d, (RB==0) ? -1 : (int)((unsigned)RA / (unsigned)RB)); NEXT;
+    op_divs:  set_reg(m, op->d, (RB==0) ? -1 : RA / RB); NEXT;
+    op_modu:  set_reg(m, op->d, (RB==0) ? RA : (int)((unsigned)RA % (unsigned)RB)); NEXT;
+    op_mods:  set_reg(m, op->d, (RB==0) ? RA : RA % RB); NEXT;
+
+    op_muli:  set_reg(m, op->d, RA * op->imm); NEXT;
+    op_divui: set_reg(m, op->d, (op->imm==0) ? -1 : (int)((unsigned)RA / (unsigned)op->imm)); NEXT;
+    op_divsi: set_reg(m, op->d, (op->imm==0) ? -1 : RA / op->imm); NEXT;
+    op_modui: set_reg(m, op->d, (op->imm==0) ? RA : (int)((unsigned)RA % (unsigned)op->imm)); NEXT;
+    op_modsi: set_reg(m, op->d, (op->imm==0) ? RA : RA % op->imm); NEXT;
+
+    // Loads and stores can raise exceptions, so need the pc to be correct. A watchpoint can
+    // also stop the block after one.
+    op_ldb:   m->pc = op->pc; set_reg(m, op->d, read_memory_size(m, RA + op->imm, 0)); goto check_access;
+    op_ldh:   m->pc = op->pc; set_reg(m, op->d, read_memory_size(m, RA + op->imm, 1)); goto check_access;
+    op_ldx:   m->pc = op->pc; set_reg(m, op->d, read_memory_size(m, RA + op->imm, op->i)); goto check_access;
+    op_ldw:
+        addr = RA + op->imm;
+        m->pc = op->pc;
+        if (addr<0x4000000 && (addr&3)==0 && (m->status & STATUS_SUPERVISOR) && (page = m->fast_pages[addr >> MEM_PAGE_BITS]))
+            set_reg(m, op->d, page[(addr & (MEM_PAGE_SIZE-1)) >> 2]);
+        else {
+            set_reg(m, op->d, read_memory_size(m, addr, 2));
+            goto check_access;
+        }
+        NEXT;
+
+    op_stb:   m->pc = op->pc; write_memory_size(m, RA + op->imm, RB, 0); goto check_access;
+    op_sth:   m->pc = op->pc; write_memory_size(m, RA + op->imm, RB, 1); goto check_access;
+    op_stw:   m->pc = op->pc; write_memory_size(m, RA + op->imm, RB, 2); goto check_access;
+    op_stx:   m->pc = op->pc; write_memory_size(m, RA + op->imm, RB, op->i); goto check_access;
+    check_access:
+        if (m->end_block) {
+            m->end_block = 0;
+            goto exit_early;
+        }
+        EXIT_IF_EXCEPTION;
+        NEXT;
+
+    op_idx1:  m->pc = op->pc; if ((unsigned)RA >= (unsigned)RB) raise_exception(m, CAUSE_INDEX_OVERFLOW, RA);
+              set_reg(m, op->d, RA);   EXIT_IF_EXCEPTION; NEXT;
+    op_idx2:  m->pc = op->pc; if ((unsigned)RA >= (unsigned)RB) raise_exception(m, CAUSE_INDEX_OVERFLOW, RA);
+              set_reg(m, op->d, RA*2); EXIT_IF_EXCEPTION; NEXT;
+    op_idx4:  m->pc = op->pc; if ((unsigned)RA >= (unsigned)RB) raise_exception(m, CAUSE_INDEX_OVERFLOW, RA);
+              set_reg(m, op->d, RA*4); EXIT_IF_EXCEPTION; NEXT;
+    op_idxx:  m->pc = op->pc; if ((unsigned)RA >= (unsigned)RB) raise_exception(m, CAUSE_INDEX_OVERFLOW, RA);
+              set_reg(m, op->d, 0);    EXIT_IF_EXCEPTION; NEXT;
+
+    // Control flow ops end the block
+    op_beq:   if (RA == RB) goto take_branch; goto op_end;
+    op_bne:   if (RA != RB) goto take_branch; goto op_end;
+    op_blt:   if (RA < RB)  goto take_branch; goto op_end;
+    op_bge:   if (RA >= RB) goto take_branch; goto op_end;
+    op_bltu:  if ((unsigned)RA <  (unsigned)RB) goto take_branch; goto op_end;
+    op_bgeu:  if ((unsigned)RA >= (unsigned)RB) goto take_branch; goto op_end;
+    op_bra:   goto take_branch;
+    take_branch:
+        m->pc = op->imm;
+        goto trace_jump;
+
+    op_jmp:
+        set_reg(m, op->d, op->pc);
+        m->pc = op->imm;
+        goto trace_jump;
+
+    op_jmpr:
+        m->pc = RA + op->imm;
+        set_reg(m, op->d, op->pc);
+        goto trace_jump;
+
+    op_cfgr:
+        m->pc = op->pc;
+        set_reg(m, op->d, read_cfg(m, op->imm));
+        return 0;
+
+    op_cfgw:
+        m->pc = op->pc;
+        tmp = read_cfg(m, op->imm);
+        write_cfg(m, op->imm, RA);
+        set_reg(m, op->d, tmp);
+        return 0;
+
+    op_rte:
+        m->status = m->estatus;
+        m->pc = m->epc;
+        goto trace_jump;
+
+    op_rti:
+        m->status = m->istatus;
+        m->pc = m->ipc;
+        goto trace_jump;
+
+    op_sys:
+        m->pc = op->pc;
+        raise_exception(m, CAUSE_SYSTEM_CALL, op->imm);
+        return 0;
+
+    op_illegal:
+        m->pc = op->pc;
+        raise_exception(m, CAUSE_ILLEGAAL_INSTRUCTION, op->imm);
+        return 0;
+
+    trace_jump:
+        if (m->trace_file)
+            fprintf(m->trace_file, "-> %s", find_nearest_label(m->pc));
+        if (m->trace)
+            trace_write_jump(m, m->pc);
+        return 0;
+
+    op_cfgx:
+    op_end:
+        m->pc = op->pc;
+        return 0;
+
+    exit_early:
+        return block->num_instr - (op - block->ops) - 1;
+}
+
+// ================================================
+//                  step
+// ================================================
+// Execute a single instruction without using the translated code cache. Used when tracing,
+// when an event is due, and for code that can't be cached.
+
+static void step(F32Machine* m) {
+    m->exception = 0;
+
+    int instr = read_memory(m, m->pc);
+    if (m->trace_file)
+        fprintf(m->trace_file, "%08x: %-40s", m->pc, disassemble_line(instr,m->pc+4));
+    if (m->trace)
+        trace_write_instr(m, m->pc, instr);
+    translate_instruction(m, &m->step_block->ops[0], instr, m->pc+4);
+    m->step_block->ops[1].handler = m->op_handlers[OP_END];
+    m->step_block->ops[1].kind = OP_END;
+    m->step_block->ops[1].pc = m->pc+4;
+    m->pc += 4;
+    m->timeout--;       // Count the instruction first, so it sees the same time as in a block
+    run_block(m, m->step_block, 0);
+    if (m->options & (F32_PROFILE | F32_CALLGRAPH))
+        profile_block(m, m->step_block, 1);
+    if (m->options & F32_TIMING)
+        timing_block(m, m->step_block, 1);
+    if (m->caches)
+        cache_block(m, m->step_block, 1);
+    if (m->trace_file)
+        fprintf(m->trace_file, "\n");
+}
+
+// ================================================
+//                  run_native
+// ================================================
+// Run the compiled code for a block. Anything the compiled code can't handle leaves it
+// through a side exit, and the rest of the block is run by run_block().
+
+static int run_native(F32Machine* m, Block* block) {
+    int resume = block->native();
+    if (resume<0)
+        return 0;
+    return run_block(m, block, resume);
+}
+
+// ================================================
+//                  f32_create
+// ================================================
+
+F32Machine* f32_create(void) {
+    F32Machine* m = my_malloc(sizeof(F32Machine));
+    m->prog_mem = my_malloc(ROM_SIZE);
+    m->pc = ROM_BASE;
+    m->reg[31] = MEM_SIZE;
+    m->status = STATUS_SUPERVISOR;
+    m->timer_due = -1;          // The timer starts at 0, which never interrupts
+    m->next_event = LLONG_MAX;
+    run_block(m, 0, 0);
+    m->step_block = my_malloc(sizeof(Block) + 2*sizeof(MicroOp));
+    m->step_block->num_instr = 1;
+    add_builtin_devices(m);
+    return m;
+}
+
+void f32_destroy(F32Machine* m) {
+    for(int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++)
+        if (m->code_pages[i]) {
+            for(int j=0; j<CODE_PAGE_SIZE; j++)
+                free(m->code_pages[i]->blocks[j]);
+            free(m->code_pages[i]);
+        }
+    free_retired_blocks(m);
+    record_destroy(m);
+    for(int i=0; i<MEM_NUM_PAGES; i++)
+        free(m->mem_pages[i]);
+    if (m->jit)
+        jit_destroy(m->jit);
+    if (m->profile)
+        profile_destroy(m->profile);
+    if (m->timing)
+        timing_destroy(m->timing);
+    f32_close_trace(m);
+    cache_destroy(m->caches);
+    uart_destroy(m);
+    blitter_destroy(m->blitter);
+    vga_destroy(m->vga);
+    disk_destroy(m->disk);
+    free(m->step_block);
+    free(m->prog_mem);
+    free(m);
+}
+
+// ================================================
+//                  f32_load
+// ================================================
+
+int f32_load(F32Machine* m, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        return 0;
+
+    char line[100];
+    int program_size = 0;
+    while (fgets(line, sizeof(line), file) != NULL && program_size < ROM_SIZE/4)
+        m->prog_mem[program_size++] = strtoul(line,0,16);
+    fclose(file);
+    return 1;
+}
+
+// ================================================
+//                  machine setup
+// ================================================
+
+void f32_set_options(F32Machine* m, int options) {
+    m->options = options;
+}
+
+void f32_set_files(F32Machine* m, FILE* uart_input, FILE* uart_log, FILE* reg_log, FILE* mem_log, FILE* trace) {
+    if (uart_input != m->uart_input) {
+        m->uart_input = uart_input;
+        uart_new_input(m);
+    }
+    m->uart_log = uart_log;
+    m->reg_log = reg_log;
+    m->mem_log = mem_log;
+    m->trace_file = trace;
+}
+
+void f32_set_mmio_hooks(F32Machine* m, F32MmioRead read, F32MmioWrite write, void* ctx) {
+    m->mmio_read = read;
+    m->mmio_write = write;
+    m->mmio_ctx = ctx;
+}
+
+void f32_set_output(F32Machine* m, F32Output output, void* ctx) {
+    m->output = output;
+    m->output_ctx = ctx;
+}
+
+// ================================================
+//                  machine state access
+// ================================================
+
+int f32_read_reg(F32Machine* m, int reg_num) {
+    return m->reg[reg_num & 31];
+}
+
+void f32_write_reg(F32Machine* m, int reg_num, int value) {
+    if (reg_num>0 && reg_num<32)
+        m->reg[reg_num] = value;
+}
+
+unsigned int f32_read_pc(F32Machine* m) {
+    return m->pc;
+}
+
+void f32_write_pc(F32Machine* m, unsigned int pc) {
+    m->pc = pc;
+}
+
+long long f32_instr_count(F32Machine* m) {
+    return m->instr_count;
+}
+
+long long f32_idle_count(F32Machine* m) {
+    return m->idle_instrs;
+}
+
+int* f32_mem_ptr(F32Machine* m, unsigned int addr) {
+    int* p;
+    if (addr < MEM_SIZE) {
+        if (m->record)
+            record_write(m, addr);
+        p = mem_ptr(m, addr);
+    }
+    else if (addr >= ROM_BASE)
+        p = &m->prog_mem[(addr - ROM_BASE)>>2];
+    else
+        return 0;
+    invalidate_code(m, addr);
+    return p;
+}
+
+// ================================================
+//                  skip_idle
+// ================================================
+// A program waiting for a device usually sits in a tight loop reading a register. If one pass
+// round a poll_loop block leaves every register as it was, and its device reads had no side
+// effects, then every later pass will do exactly the same until a device changes. Memory
+// can't change either, as the loop doesn't store, and the devices that write to memory (the
+// blitter and the disk) only do so at their events. So we can skip the passes up to the next
+// event or the end of the run, leaving the machine as if they had been run. Not while anything
+// is watched, as the skipped passes would have to report their accesses.
+
+static int can_skip_idle(F32Machine* m) {
+    return (m->options & F32_SKIP_IDLE) && !(m->options & (F32_PROFILE | F32_CALLGRAPH | F32_TIMING))
+        && !m->caches && !m->reg_log && !m->trace_file && !m->trace && !m->num_watches;
+}
+
+static void skip_idle(F32Machine* m, Block* block) {
+    // Passes are counted from the end of the one just run. Device reads see the time at the end
+    // of a pass, so only passes ending before the event can be skipped.
+    long long n = block->num_instr;
+    long long passes = (device_next_event(m) - machine_time(m) - 1) / n;
+    if (passes > (m->timeout - 1) / n)          // Leave the last pass to finish the run
+        passes = (m->timeout - 1) / n;
+    if (passes <= 0)
+        return;
+    m->timeout -= passes*n;
+    m->idle_instrs += passes*n;
+}
+
+// ================================================
+//                  f32_run
+// ================================================
+
+int f32_run(F32Machine* m, int n_instrs) {
+    // The compiled code doesn't write the logs, watch memory accesses or save pages for
+    // checkpoints, so leave everything to the interpreter if they are wanted. That includes
+    // blocks compiled before they were turned on.
+    int use_jit = (m->options & F32_USE_JIT) && !WATCH_DATA(m) && !m->reg_log && !m->mem_log && !m->trace_file && !m->trace && !m->record;
+    if (use_jit && m->jit==0 && (m->jit = jit_create(m))==0) {
+        m->options &= ~F32_USE_JIT;
+        use_jit = 0;
+    }
+
+    int skip = can_skip_idle(m);
+    int regs[32];
+
+    unsigned int resume_pc = m->pc;     // Don't stop at a breakpoint we start at
+
+    m->timeout = n_instrs;
+    m->counted_timeout = n_instrs;
+    m->stop = 0;
+    while (m->timeout>0 && m->pc!=0 && !m->stop) {
+        if (m->retired_blocks)
+            free_retired_blocks(m);
+
+        long long now = machine_time(m);
+        if (now >= m->next_event) {
+            run_events(m);
+            continue;
+        }
+
+        // Run a whole block when we know that no event or timeout falls inside it
+        Block* block = (m->trace_file || m->trace) ? 0 : find_block(m, m->pc);
+        if (block && block->num_instr<=m->timeout && now + block->num_instr <= m->next_event) {
+            m->exception = 0;
+            m->end_block = 0;
+            m->timeout -= block->num_instr;
+            int polling = skip && block->poll_loop;
+            if (polling) {
+                memcpy(regs, m->reg, sizeof(regs));
+                m->device_effect = 0;
+            }
+            int skipped;
+            if (use_jit && block->native)
+                skipped = run_native(m, block);
+            else {
+                if (use_jit && ++block->exec_count==JIT_THRESHOLD)
+                    block->native = jit_compile(m->jit, block);
+                skipped = run_block(m, block, 0);
+            }
+            m->timeout += skipped;
+            if (m->options & (F32_PROFILE | F32_CALLGRAPH))
+                profile_block(m, block, block->num_instr - skipped);
+            if (m->options & F32_TIMING)
+                timing_block(m, block, block->num_instr - skipped);
+            if (m->caches)
+                cache_block(m, block, block->num_instr - skipped);
+            if (polling && m->pc==block->ops[0].pc-4 && !skipped && !m->exception && !m->device_effect
+                && memcmp(regs, m->reg, sizeof(regs))==0)
+                skip_idle(m, block);
+        } else if (breakpoint_here(m, m->pc!=resume_pc)) {
+            m->stop = F32_BREAKPOINT;
+        } else
+            step(m);
+        resume_pc = 1;      // Not an instruction address, so later visits stop
+    }
+
+    m->instr_count += n_instrs - m->timeout;
+    m->counted_timeout = m->timeout;
+    blitter_update(m);
+    uart_flush(m);
+    if (m->stop)
+        return m->stop;
+    return m->pc==0 ? F32_FINISHED : F32_RUNNING;
 }
@@ -2,6 +2,11 @@ typedef const char * string;
 typedef struct Token* Token;
 typedef struct Reference Reference;
 
+// The Microsoft names for POSIX functions
+#ifndef _WIN32
+#define _strdup strdup
+#endif
+
 #define KIND_ALU   0x10
 #define KIND_ALUI  0x11
 #define KIND_LD    0x12
@@ -63,18 +68,14 @@ void output_result(string filename, int format);
 //                        disassemble.c
 // ----------------------------------------------------
 
+extern Token all_labels;
+
 void load_labels(string filename);
 string find_label(int addr);
+string find_nearest_label(int addr);
 char *disassemble_line(int op, int pc);
 void disassemble_program(int *program, int len);
 
-// ----------------------------------------------------
-//                        execute.c
-// ----------------------------------------------------
-
-void execute();
-
-
 // ----------------------------------------------------
 //                        util.c
 // ----------------------------------------------------
@@ -0,0 +1,310 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "libf32sim.h"
+
+// *****************************************************************
+//                        f32run
+// *****************************************************************
+// Runs a set of test programs concurrently, one simulated machine per test, and compares
+// each test's uart output against the expected output in memory.
+//
+// The manifest has one test per line:
+//
+//    <program.hex> <uart input | -> <expected uart output | -> [instruction budget]
+//
+// Blank lines and lines starting with '#' are ignored. A test passes if the program returns
+// to address 0 within its budget, and its output matches the expected output (if given). A
+// test fails at its first exception, unless --handle-exceptions is given for programs that
+// handle their own.
+//
+// Each worker thread takes the next test from a shared counter, so the threads keep busy
+// until the whole manifest has been run.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
+int line_number;
+
+#define DEFAULT_BUDGET 1000000
+#define MAX_THREADS    256
+
+typedef struct Test {
+    string program;
+    string uart_input;
+    string expected;
+    int budget;
+
+    char* output;           // Captured device output
+    int output_len;
+    int output_size;
+
+    int result;             // F32_xxx from f32_run(), or -1 if it didn't run
+    string message;
+    long long instrs;
+    double seconds;
+} Test;
+
+static Test* tests;
+static int num_tests;
+static int use_jit;
+static int skip_idle = 1;
+static int handle_exceptions;
+
+// ================================================
+//                  os portability
+// ================================================
+
+#ifdef _WIN32
+
+static volatile LONG next_test;
+
+static int take_test() {
+    return InterlockedIncrement(&next_test) - 1;
+}
+
+static double now() {
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / freq.QuadPart;
+}
+
+static int num_cpus() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+#else
+
+static int next_test;
+
+static int take_test() {
+    return __atomic_fetch_add(&next_test, 1, __ATOMIC_RELAXED);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int num_cpus() {
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+#endif
+
+// ================================================
+//                  read_manifest
+// ================================================
+
+static string optional_file(string name) {
+    return strcmp(name, "-")==0 ? 0 : strdup(name);
+}
+
+static void read_manifest(string filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+        fatal("Can't open manifest '%s'", filename);
+
+    char line[1000];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char* program = strtok(line, " \t\r\n");
+        if (program==0 || program[0]=='#')
+            continue;
+        char* uart_input = strtok(0, " \t\r\n");
+        char* expected = strtok(0, " \t\r\n");
+        char* budget = strtok(0, " \t\r\n");
+        if (expected==0)
+            fatal("%s line %d: expected <program> <uart input> <expected output> [budget]", filename, line_number);
+
+        tests = my_realloc(tests, (num_tests+1) * sizeof(Test));
+        Test* t = &tests[num_tests++];
+        memset(t, 0, sizeof(Test));
+        t->program = strdup(program);
+        t->uart_input = optional_file(uart_input);
+        t->expected = optional_file(expected);
+        t->budget = budget ? atoi(budget) : DEFAULT_BUDGET;
+        t->result = -1;
+    }
+    fclose(file);
+}
+
+// ================================================
+//                  run_test
+// ================================================
+
+static void capture_output(void* ctx, const char* text, int len) {
+    Test* t = ctx;
+    if (t->output_len + len > t->output_size) {
+        t->output_size = 2*t->output_size + len + 256;
+        t->output = my_realloc(t->output, t->output_size);
+    }
+    memcpy(t->output + t->output_len, text, len);
+    t->output_len += len;
+}
+
+// Compare the captured output against the expected output file
+static int check_output(Test* t) {
+    FILE* file = fopen(t->expected, "rb");
+    if (file==0) {
+        t->message = "can't open expected output";
+        return 0;
+    }
+    int pos = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (pos >= t->output_len || t->output[pos] != c)
+            break;
+        pos++;
+    }
+    fclose(file);
+    if (c != EOF || pos != t->output_len) {
+        t->message = "output differs";
+        return 0;
+    }
+    return 1;
+}
+
+static void run_test(Test* t) {
+    F32Machine* m = f32_create();
+    if (!f32_load(m, t->program)) {
+        t->message = "can't open program";
+        f32_destroy(m);
+        return;
+    }
+
+    FILE* uart_input = t->uart_input ? fopen(t->uart_input, "r") : 0;
+    if (t->uart_input && uart_input==0) {
+        t->message = "can't open uart input";
+        f32_destroy(m);
+        return;
+    }
+
+    // Stop at the first exception, rather than leaving the program to run into its budget
+    f32_set_options(m, (handle_exceptions ? 0 : F32_ABORT_ON_EXCEPTION) | (use_jit ? F32_USE_JIT : 0)
+                       | (skip_idle ? F32_SKIP_IDLE : 0));
+    f32_set_files(m, uart_input, 0, 0, 0, 0);
+    f32_set_output(m, capture_output, t);
+
+    // The sync register just marks a point of interest - keep going through it
+    double start = now();
+    do
+        t->result = f32_run(m, t->budget - (int)f32_instr_count(m));
+    while (t->result==F32_SYNC);
+    t->seconds = now() - start;
+    t->instrs = f32_instr_count(m);
+
+    if (t->result==F32_RUNNING)
+        t->message = "timeout";
+    else if (t->result==F32_EXCEPTION)
+        t->message = "exception";
+    else if (t->expected)
+        check_output(t);
+
+    if (uart_input)
+        fclose(uart_input);
+    f32_destroy(m);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker(void* arg) {
+#else
+static void* worker(void* arg) {
+#endif
+    int i;
+    (void)arg;
+    while ((i = take_test()) < num_tests)
+        run_test(&tests[i]);
+    return 0;
+}
+
+// ================================================
+//                  main
+// ================================================
+
+int main(int argc, char** argv) {
+    string manifest = 0;
+    int num_threads = 0;
+
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-j")==0 && i+1<argc)
+            num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-jit")==0)
+            use_jit = 1;
+        else if (strcmp(argv[i], "--no-skip-idle")==0)
+            skip_idle = 0;
+        else if (strcmp(argv[i], "--handle-exceptions")==0)
+            handle_exceptions = 1;
+        else if (strcmp(argv[i], "-h")==0)
+            printf("Usage: %s [-j <threads>] [-jit] [--no-skip-idle] [--handle-exceptions] <manifest>\n", argv[0]);
+        else if (argv[i][0] == '-')
+            fatal("unknown option '%s'", argv[i]);
+        else if (manifest==0)
+            manifest = argv[i];
+        else
+            fatal("too many arguments");
+    }
+
+    if (manifest==0)
+        fatal("no manifest specified");
+    read_manifest(manifest);
+
+    if (num_threads<=0)
+        num_threads = num_cpus();
+    if (num_threads>num_tests)
+        num_threads = num_tests;
+    if (num_threads>MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    double start = now();
+#ifdef _WIN32
+    HANDLE threads[MAX_THREADS];
+    for (int i=0; i<num_threads; i++)
+        threads[i] = CreateThread(NULL, 0, worker, NULL, 0, NULL);
+    // WaitForMultipleObjects() takes at most MAXIMUM_WAIT_OBJECTS handles at a time
+    for (int i=0; i<num_threads; i += MAXIMUM_WAIT_OBJECTS) {
+        int n = num_threads-i < MAXIMUM_WAIT_OBJECTS ? num_threads-i : MAXIMUM_WAIT_OBJECTS;
+        WaitForMultipleObjects(n, &threads[i], TRUE, INFINITE);
+    }
+    for (int i=0; i<num_threads; i++)
+        CloseHandle(threads[i]);
+#else
+    pthread_t threads[MAX_THREADS];
+    for (int i=0; i<num_threads; i++)
+        if (pthread_create(&threads[i], NULL, worker, NULL))
+            fatal("Can't create thread");
+    for (int i=0; i<num_threads; i++)
+        pthread_join(threads[i], NULL);
+#endif
+    double elapsed = now() - start;
+
+    // Report the results in manifest order
+    int passed = 0;
+    long long total_instrs = 0;
+    for (int i=0; i<num_tests; i++) {
+        Test* t = &tests[i];
+        double mips = t->seconds>0 ? t->instrs / t->seconds / 1e6 : 0;
+        if (t->message)
+            printf("%-40s FAIL %-20s", t->program, t->message);
+        else {
+            printf("%-40s PASS %-20s", t->program, "");
+            passed++;
+        }
+        printf(" %10lld instrs %8.1f MIPS\n", t->instrs, mips);
+        total_instrs += t->instrs;
+    }
+    printf("%d of %d tests passed, %lld instructions in %.2fs on %d threads\n",
+           passed, num_tests, total_instrs, elapsed, num_threads);
+    return passed==num_tests ? 0 : 1;
+}
@@ -1,43 +1,197 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 #include "f32.h"
+#include "sim.h"
 
 int line_number;
-int* prog_mem;
-unsigned int* data_mem;
 
-int abort_on_exception = 0;
+#define MAX_INSTRS 1000000  // Default number of instructions to run before giving up
 
-FILE* trace_file  = NULL;
+static int options = F32_SKIP_IDLE;
+static long long max_instrs = MAX_INSTRS;
+static int write_logs = 1;
+static int trace = 0;
+static int binary_trace = 0;     // 1 = sim_trace.bin, 2 = compressed
+static string save_snapshot_file = 0;
+static int sdram_latency = F32_SDRAM_LATENCY;
+static int div_latency = F32_DIV_LATENCY;
+static int branch_penalty = F32_BRANCH_PENALTY;
+static double blit_rate = F32_BLIT_RATE;
+static string gdb_port = 0;
+static int record_interval = 0;
+static string uart_spec = 0;
+static string disk_file = 0;
+static int sector_clocks = F32_SECTOR_CLOCKS;
+static string frames_prefix = 0;
+static string screen_file = 0;
+static string caches[16];
+static int num_caches;
+static string watches[16];
+static int num_watches;
+static int watch_stop = 0;
 
-static void load_program(string filename) {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL)
-        fatal("Can't open file '%s'", filename);
+string batch_file;
+int batch_jobs;
+int batch_child;
+
+// ================================================
+//                  open_logs
+// ================================================
+// Open the log files in the current directory, closing any previous ones
 
-    char line[100];
-    int program_size = 0;
-    while (fgets(line, sizeof(line), file) != NULL)
-        prog_mem[program_size++] = strtoul(line,0,16);
-    fclose(file);
+void open_logs(F32Machine* m, FILE* uart_input) {
+    static FILE* files[6];
+    for (int i=0; i<6; i++)
+        if (files[i])
+            fclose(files[i]);
+
+    files[0] = uart_input;
+    files[1] = fopen("sim_uart.log", "wb");
+    files[3] = write_logs ? fopen("sim_reg.log", "w") : 0;
+    files[4] = write_logs ? fopen("sim_mem.log", "wb") : 0;
+    files[5] = trace ? fopen("sim_traace.log", "w") : 0;
+    f32_set_files(m, files[0], files[1], files[3], files[4], files[5]);
 }
 
+// ================================================
+//                  add_watch
+// ================================================
+// Parse a --watch addr[:len][:rwx] option. The length defaults to 4 bytes and the access to
+// rw. Numbers can be decimal or hex with 0x.
 
-int main(int argc, char** argv) {
-    prog_mem = my_malloc(65536);
-    data_mem = my_malloc(64*1024*1024);
+static void add_watch(F32Machine* m, string spec) {
+    char* p;
+    unsigned int addr = strtoul(spec, &p, 0);
+    unsigned int len = 4;
+    int flags = 0;
+    if (p==spec)
+        fatal("bad watch '%s'", spec);
+    if (*p==':' && p[1]>='0' && p[1]<='9')
+        len = strtoul(p+1, &p, 0);
+    if (*p==':') {
+        for (p++; *p; p++)
+            if (*p=='r')
+                flags |= F32_WATCH_READ;
+            else if (*p=='w')
+                flags |= F32_WATCH_WRITE;
+            else if (*p=='x')
+                flags |= F32_WATCH_EXEC;
+            else
+                fatal("bad watch '%s'", spec);
+    }
+    if (*p)
+        fatal("bad watch '%s'", spec);
+    if (flags==0)
+        flags = F32_WATCH_READ | F32_WATCH_WRITE;
+    if (!f32_add_watch(m, addr, len, flags | (watch_stop ? F32_WATCH_STOP : 0)))
+        fatal("can't watch '%s'", spec);
+}
+
+// ================================================
+//                  run
+// ================================================
+// Run the program to completion, stopping at sync points to take a snapshot or fork batch cases
 
+static int run(F32Machine* m) {
+    long long end = f32_instr_count(m) + max_instrs;
+    while (1) {
+        long long left = end - f32_instr_count(m);
+        int result = f32_run(m, left > 0x40000000 ? 0x40000000 : (int)left);
+        if (result==F32_RUNNING && f32_instr_count(m) < end)
+            continue;
+        if (result!=F32_SYNC)
+            return result;
+        if (save_snapshot_file) {
+            f32_save_snapshot(m, save_snapshot_file);
+            save_snapshot_file = 0;
+        }
+        if (batch_file) {
+            // The frame writer thread doesn't survive fork(), so each case starts its own,
+            // writing frames into the case's directory
+            if (frames_prefix)
+                f32_set_frames(m, 0);
+            run_batch(m);       // Only returns in the child processes, which run with a new budget
+            if (frames_prefix)
+                f32_set_frames(m, "frame");
+            end = f32_instr_count(m) + max_instrs;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
     string filename=0;
+    string snapshot=0;
 
     for (int i=1; i<argc; i++) {
         if (strcmp(argv[i], "-a")==0)
-            abort_on_exception = 1;
+            options |= F32_ABORT_ON_EXCEPTION;
         else if (strcmp(argv[i], "-t")==0)
-            trace_file = fopen("sim_traace.log", "w");
+            trace = 1;
+        else if (strcmp(argv[i], "-tb")==0)
+            binary_trace = 1;
+        else if (strcmp(argv[i], "-tz")==0)
+            binary_trace = 2;
+        else if (strcmp(argv[i], "-q")==0)
+            write_logs = 0;
+        else if (strcmp(argv[i], "-jit")==0)
+            options |= F32_USE_JIT;
+        else if (strcmp(argv[i], "-p")==0)
+            options |= F32_PROFILE;
+        else if (strcmp(argv[i], "-g")==0)
+            options |= F32_CALLGRAPH;
+        else if (strcmp(argv[i], "--timing")==0)
+            options |= F32_TIMING;
+        else if (strcmp(argv[i], "--sdram-latency")==0 && i+1<argc)
+            sdram_latency = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--div-latency")==0 && i+1<argc)
+            div_latency = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--branch-penalty")==0 && i+1<argc)
+            branch_penalty = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--blit-rate")==0 && i+1<argc)
+            blit_rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--frames")==0 && i+1<argc)
+            frames_prefix = argv[++i];
+        else if (strcmp(argv[i], "--screen")==0 && i+1<argc)
+            screen_file = argv[++i];
+        else if (strcmp(argv[i], "--gdb")==0 && i+1<argc)
+            gdb_port = argv[++i];
+        else if (strcmp(argv[i], "--disk")==0 && i+1<argc)
+            disk_file = argv[++i];
+        else if (strcmp(argv[i], "--sector-clocks")==0 && i+1<argc)
+            sector_clocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--uart")==0 && i+1<argc)
+            uart_spec = argv[++i];
+        else if (strcmp(argv[i], "--record")==0 && i+1<argc)
+            record_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-instrs")==0 && i+1<argc)
+            max_instrs = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--no-skip-idle")==0)
+            options &= ~F32_SKIP_IDLE;
+        else if (strcmp(argv[i], "--cache")==0 && i+1<argc) {
+            if (num_caches==16)
+                fatal("too many cache configurations");
+            caches[num_caches++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--watch")==0 && i+1<argc) {
+            if (num_watches==16)
+                fatal("too many watches");
+            watches[num_watches++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--watch-stop")==0)
+            watch_stop = 1;
+        else if (strcmp(argv[i], "--save-snapshot")==0 && i+1<argc)
+            save_snapshot_file = argv[++i];
+        else if (strcmp(argv[i], "--load-snapshot")==0 && i+1<argc)
+            snapshot = argv[++i];
+        else if (strcmp(argv[i], "--batch")==0 && i+1<argc)
+            batch_file = argv[++i];
+        else if (strcmp(argv[i], "-j")==0 && i+1<argc)
+            batch_jobs = atoi(argv[++i]);
         else if (strcmp(argv[i], "-h")==0)
-            printf("Usage: %s [-a] [-t] <filename>\n", argv[0]);
+            printf("Usage: %s [-a] [-t] [-tb] [-tz] [-q] [-jit] [-p] [-g] [--timing] [--sdram-latency <n>] [--div-latency <n>] [--branch-penalty <n>] [--blit-rate <pixels per clock>] [--frames <prefix>] [--screen <file>] [--gdb <port>] [--uart raw:<file>|pty|unix:<path>] [--disk <image>] [--sector-clocks <n>] [--record <interval>] [--max-instrs <n>] [--no-skip-idle] [--cache <config>]... [--watch <addr>[:<len>][:rwx]]... [--watch-stop] [--save-snapshot <file>] [--load-snapshot <file>] [--batch <file>] [-j <jobs>] <filename>\n", argv[0]);
         else if (argv[i][0] == '-')
             fatal("unknown option '%s'", argv[i]);
         else if (filename==0)
@@ -46,12 +200,76 @@ int main(int argc, char** argv) {
             fatal("too many arguments");
     }
 
-    if (filename==0)
+    if (filename==0 && snapshot==0)
         fatal("no filename specified");
 
-    load_program(filename);
+    F32Machine* m = f32_create();
+    if (filename && !f32_load(m, filename))
+        fatal("Can't open file '%s'", filename);
+    if (snapshot)
+        f32_load_snapshot(m, snapshot);
     load_labels("asm.labels");
-    execute();
+
+    if (binary_trace && batch_file)
+        fatal("can't write a binary trace in batch mode");
+    if ((options & F32_USE_JIT) && (write_logs || trace || binary_trace))
+        printf("JIT disabled when logging registers or tracing\n");
+    f32_set_options(m, options);
+    if (options & F32_TIMING)
+        f32_set_latencies(m, sdram_latency, div_latency, branch_penalty);
+    f32_set_blit_rate(m, blit_rate);
+    if (frames_prefix)
+        f32_set_frames(m, frames_prefix);
+    for (int i=0; i<num_caches; i++)
+        if (!f32_add_cache(m, caches[i]))
+            fatal("bad cache configuration '%s'", caches[i]);
+    for (int i=0; i<num_watches; i++)
+        add_watch(m, watches[i]);
+    open_logs(m, fopen("uart_input.hex", "r"));
+    if (disk_file && !f32_open_disk(m, disk_file, sector_clocks))
+        fatal("Can't open disk image '%s'", disk_file);
+    if (uart_spec && !f32_set_uart(m, uart_spec))
+        fatal("Can't connect the uart to '%s'", uart_spec);
+    if (binary_trace && !f32_open_trace(m, "sim_trace.bin", binary_trace==2))
+        fatal("Can't create 'sim_trace.bin'");
+
+    if (gdb_port && batch_file)
+        fatal("can't debug in batch mode");
+    if (record_interval)
+        f32_record(m, record_interval);
+    int result = gdb_port ? gdb_serve(m, gdb_port, max_instrs) : run(m);
+    f32_close_trace(m);
+    if (options & F32_PROFILE)
+        f32_write_profile(m, "sim_profile.log");
+    if (options & F32_CALLGRAPH)
+        f32_write_callgraph(m, "sim_callgraph.folded", "sim_callgraph.log");
+    if (options & F32_TIMING)
+        f32_write_timing(m, "sim_timing.log");
+    if (num_caches)
+        f32_write_caches(m, "sim_cache.log");
+    f32_write_blitter(m, "sim_blit.log");
+    if (disk_file)
+        f32_write_disk(m, "sim_disk.log");
+    if (frames_prefix)
+        f32_set_frames(m, 0);       // Wait for the last frames to be written
+    if (screen_file && !f32_write_screen(m, screen_file))
+        printf("Can't create '%s'\n", screen_file);
+    if (result==F32_WATCHPOINT && !gdb_port) {
+        unsigned int addr;
+        int kind = f32_watch_hit(m, &addr);
+        printf("Stopped by watch: %s [%08x] at pc=%08x\n", kind==F32_WATCH_READ ? "read" : "write", addr, f32_read_pc(m)-4);
+    } else if (result==F32_BREAKPOINT && !gdb_port)
+        printf("Stopped by watch: exec at pc=%08x\n", f32_read_pc(m));
+    if (result==F32_EXCEPTION || ((result==F32_WATCHPOINT || result==F32_BREAKPOINT) && !gdb_port))
+        exit(1);
+    if (result==F32_RUNNING && !gdb_port)
+        printf("Timeout\n");
+    if (save_snapshot_file)
+        f32_save_snapshot(m, save_snapshot_file);
+    if (batch_file)
+        fatal("Program finished without reaching the batch fork point");
+    if (batch_child)
+        exit(result==F32_RUNNING ? BATCH_TIMEOUT : 0);
 
     return 0;
 }
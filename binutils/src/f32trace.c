@@ -0,0 +1,231 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// *****************************************************************
+//                        f32trace
+// *****************************************************************
+// Decodes a binary trace written by f32sim -tb or -tz into the same text as f32sim -t,
+// optionally showing only the instructions in an address range or a function.
+
+int line_number;
+
+static unsigned int from = 0;           // Range of addresses to show
+static unsigned int to = 0xffffffff;
+static FILE* out;
+
+static int line_open;                   // An instruction line has been started
+static int showing;                     // The current instruction is in range
+static int pending_interrupt = -1;      // Interrupt to print before the next instruction shown
+
+static unsigned int get32(const unsigned char* p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24);
+}
+
+// ================================================
+//                  find_function
+// ================================================
+// The range of a function runs from its label up to the next label that isn't one of its
+// local labels (<function>.<name>)
+
+static void find_function(string name) {
+    Token label = 0;
+    for (Token t = all_labels; t; t=t->next)
+        if (strcmp(t->text, name)==0)
+            label = t;
+    if (label==0)
+        fatal("Label '%s' not found", name);
+
+    from = label->value;
+    to = 0xffffffff;
+    int len = strlen(name);
+    for (Token t = all_labels; t; t=t->next) {
+        int local = strncmp(t->text, name, len)==0 && t->text[len]=='.';
+        if ((unsigned)t->value > from && (unsigned)t->value < to && !local)
+            to = t->value;
+    }
+}
+
+// ================================================
+//                  decode_chunk
+// ================================================
+
+// The instruction words seen are kept by code page, like the encoder's bitmaps of the words
+// it has written
+static unsigned int pc;                 // Address of the current instruction
+static int* words[CODE_SDRAM_PAGES + CODE_ROM_PAGES];
+static unsigned int* known[CODE_SDRAM_PAGES + CODE_ROM_PAGES];  // Bitmaps of the words seen
+
+static void remember_word(unsigned int addr, int instr) {
+    int index = code_page_index(addr);
+    if (index<0)
+        return;                         // Always sent with the instruction
+    if (words[index]==0) {
+        words[index] = my_malloc(CODE_PAGE_SIZE*sizeof(int));
+        known[index] = my_malloc(CODE_PAGE_SIZE/8);
+    }
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    words[index][w] = instr;
+    known[index][w>>5] |= 1u<<(w&31);
+}
+
+static int lookup_word(unsigned int addr);
+
+static void end_line() {
+    if (line_open && showing)
+        fprintf(out, "\n");
+    line_open = 0;
+}
+
+static void start_instr(unsigned int addr, int instr) {
+    end_line();
+    pc = addr;
+    showing = pc>=from && pc<to;
+    if (showing) {
+        if (pending_interrupt>=0)
+            fprintf(out, "INTERUPT: %d\n", pending_interrupt);
+        fprintf(out, "%08x: %-40s", pc, disassemble_line(instr, pc+4));
+    }
+    pending_interrupt = -1;
+    line_open = 1;
+}
+
+static void decode_chunk(const unsigned char* p, int n) {
+    const unsigned char* end = p+n;
+    while (p < end) {
+        int instr;
+        switch (*p) {
+            case TR_INSTR:
+                start_instr(pc+4, lookup_word(pc+4));
+                p += 1;
+                break;
+            case TR_INSTR_WORD:
+                remember_word(pc+4, get32(p+1));
+                start_instr(pc+4, get32(p+1));
+                p += 5;
+                break;
+            case TR_INSTR_PC:
+                start_instr(get32(p+1), lookup_word(get32(p+1)));
+                p += 5;
+                break;
+            case TR_INSTR_PC_WORD:
+                instr = get32(p+5);
+                remember_word(get32(p+1), instr);
+                start_instr(get32(p+1), instr);
+                p += 9;
+                break;
+            case TR_REG:
+                if (showing)
+                    fprintf(out, "$%2d = %08x", p[1], get32(p+2));
+                p += 6;
+                break;
+            case TR_MEM:
+                if (showing)
+                    fprintf(out, "[%08x] = %08x", get32(p+1), get32(p+5));
+                p += 9;
+                break;
+            case TR_JUMP:
+                if (showing)
+                    fprintf(out, "-> %s", find_nearest_label(get32(p+1)));
+                pc = get32(p+1) - 4;
+                p += 5;
+                break;
+            case TR_EXCEPTION:
+                if (showing)
+                    fprintf(out, "EXCEPTION: %d %x\n", p[1], get32(p+2));
+                p += 6;
+                break;
+            case TR_INTERRUPT:
+                end_line();
+                pending_interrupt = p[1];
+                p += 2;
+                break;
+            default:
+                fatal("Corrupt trace: unknown record %d", *p);
+        }
+    }
+}
+
+// An instruction word is only in the trace the first time its address is traced, so it must
+// have been seen
+static int lookup_word(unsigned int addr) {
+    int index = code_page_index(addr);
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    if (index<0 || known[index]==0 || !(known[index][w>>5] & (1u<<(w&31))))
+        fatal("Corrupt trace: no instruction word for %08x", addr);
+    return words[index][w];
+}
+
+// ================================================
+//                  main
+// ================================================
+
+int main(int argc, char** argv) {
+    string filename = 0;
+    string labels = "asm.labels";
+    string function = 0;
+    string output = 0;
+
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-l")==0 && i+1<argc)
+            labels = argv[++i];
+        else if (strcmp(argv[i], "-o")==0 && i+1<argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "--from")==0 && i+1<argc)
+            from = strtoul(argv[++i], 0, 16);
+        else if (strcmp(argv[i], "--to")==0 && i+1<argc)
+            to = strtoul(argv[++i], 0, 16);
+        else if (strcmp(argv[i], "--label")==0 && i+1<argc)
+            function = argv[++i];
+        else if (strcmp(argv[i], "-h")==0)
+            printf("Usage: %s [-l <labels>] [-o <output>] [--from <addr>] [--to <addr>] [--label <label>] <trace>\n", argv[0]);
+        else if (argv[i][0] == '-')
+            fatal("unknown option '%s'", argv[i]);
+        else if (filename==0)
+            filename = argv[i];
+        else
+            fatal("too many arguments");
+    }
+    if (filename==0)
+        fatal("no trace file specified");
+
+    load_labels(labels);
+    if (function)
+        find_function(function);
+
+    FILE* file = fopen(filename, "rb");
+    if (file==NULL)
+        fatal("Can't open trace file '%s'", filename);
+    out = stdout;
+    if (output && (out = fopen(output, "w"))==NULL)
+        fatal("Can't create '%s'", output);
+
+    unsigned char header[8];
+    if (fread(header, 1, 8, file)!=8 || get32(header)!=TRACE_MAGIC)
+        fatal("'%s' is not an f32 trace file", filename);
+    pc = get32(header+4) - 4;
+
+    unsigned char* stored = my_malloc(TRACE_CHUNK_SIZE);
+    unsigned char* chunk = my_malloc(TRACE_CHUNK_SIZE);
+    while (fread(header, 1, 8, file)==8) {
+        int length = get32(header);
+        int stored_length = get32(header+4);
+        if (length>TRACE_CHUNK_SIZE || stored_length>length || fread(stored, 1, stored_length, file)!=(size_t)stored_length)
+            fatal("Corrupt trace: bad chunk");
+        if (stored_length==length)
+            decode_chunk(stored, length);
+        else if (trace_decompress(stored, stored_length, chunk, TRACE_CHUNK_SIZE)!=length)
+            fatal("Corrupt trace: bad compressed chunk");
+        else
+            decode_chunk(chunk, length);
+    }
+    end_line();
+
+    fclose(file);
+    if (out!=stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,464 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  gdb stub
+// ================================================
+// Lets gdb (or any other client of its remote serial protocol) control the simulator, with
+// f32sim --gdb <port>. The port is a TCP port on localhost, or on systems other than Windows
+// it can be the path of a unix socket.
+//
+// Registers are numbered 0-31 for $0-$31, then 32 for the pc, each sent as 32 bits little
+// endian. Memory can be read and written in SDRAM and the boot rom - the hardware registers
+// are left alone, as reading them can change them. Watchpoints stop after the access.
+// With --record, gdb can also run backwards (reverse-step, reverse-continue).
+
+#ifdef _WIN32
+#include <winsock2.h>
+typedef SOCKET Socket;
+#define close_socket closesocket
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+typedef int Socket;
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#endif
+
+#define GDB_PACKET_SIZE 0x4000
+#define GDB_RUN_SLICE   100000  // Instructions to run between checks for a ^C from gdb
+#define GDB_SIGINT      2       // Signal numbers for the stop replies
+#define GDB_SIGTRAP     5
+#define GDB_SIGSEGV     11
+
+static Socket gdb;
+static char packet[GDB_PACKET_SIZE+1];
+static char reply[GDB_PACKET_SIZE+1];
+
+// ================================================
+//                  connection
+// ================================================
+
+static Socket listen_and_accept(string port) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa)!=0)
+        fatal("Can't start winsock");
+#endif
+    Socket s;
+    char* end;
+    long number = strtol(port, &end, 10);
+    if (*end==0) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)number);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        int yes = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+        if (s==INVALID_SOCKET || bind(s, (struct sockaddr*)&addr, sizeof(addr))!=0)
+            fatal("Can't listen on port %s", port);
+    } else {
+#ifdef _WIN32
+        fatal("Bad port '%s'", port);
+#else
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(port) >= sizeof(addr.sun_path))
+            fatal("Socket path too long '%s'", port);
+        strcpy(addr.sun_path, port);
+        unlink(port);
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s==INVALID_SOCKET || bind(s, (struct sockaddr*)&addr, sizeof(addr))!=0)
+            fatal("Can't listen on '%s'", port);
+#endif
+    }
+    listen(s, 1);
+    printf("Waiting for gdb on %s\n", port);
+    fflush(stdout);
+    Socket c = accept(s, 0, 0);
+    close_socket(s);
+    if (c==INVALID_SOCKET)
+        fatal("Can't accept the connection from gdb");
+    int yes = 1;
+    setsockopt(c, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+    return c;
+}
+
+// Returns the next character from gdb, or -1 if the connection has closed
+static int get_char() {
+    unsigned char c;
+    return recv(gdb, (char*)&c, 1, 0)==1 ? c : -1;
+}
+
+// Has gdb sent a ^C, asking us to stop?
+static int interrupt_requested() {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(gdb, &fds);
+    struct timeval zero = {0, 0};
+    if (select((int)gdb+1, &fds, 0, 0, &zero) <= 0)
+        return 0;
+    return get_char()==0x03;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(int c) {
+    if (c>='0' && c<='9') return c-'0';
+    if (c>='a' && c<='f') return c-'a'+10;
+    if (c>='A' && c<='F') return c-'A'+10;
+    return -1;
+}
+
+// Read a packet ($<data>#<checksum>) into packet[], acknowledging it. Returns 0 if the
+// connection has closed.
+static int get_packet() {
+    while (1) {
+        int c;
+        while ((c = get_char()) != '$')
+            if (c<0)
+                return 0;
+        int len = 0, sum = 0;
+        while ((c = get_char()) != '#') {
+            if (c<0)
+                return 0;
+            if (len < GDB_PACKET_SIZE)
+                packet[len++] = (char)c;
+            sum += c;
+        }
+        int c1 = get_char(), c2 = get_char();
+        packet[len] = 0;
+        if (c1<0 || c2<0)
+            return 0;
+        if (hex_value(c1)*16 + hex_value(c2) == (sum & 0xff)) {
+            send(gdb, "+", 1, 0);
+            return 1;
+        }
+        send(gdb, "-", 1, 0);
+    }
+}
+
+static void put_packet(const char* data) {
+    static char buf[GDB_PACKET_SIZE+5];
+    int len = (int)strlen(data), sum = 0;
+    buf[0] = '$';
+    for (int i=0; i<len; i++)
+        sum += (unsigned char)data[i];
+    memcpy(buf+1, data, len);
+    buf[len+1] = '#';
+    buf[len+2] = hex_digits[(sum>>4) & 15];
+    buf[len+3] = hex_digits[sum & 15];
+    // Resend until acknowledged
+    do
+        send(gdb, buf, len+4, 0);
+    while (get_char()=='-');
+}
+
+// Send text for gdb to print, as the output of a monitor command
+static void put_console(const char* text) {
+    char* p = reply;
+    *p++ = 'O';
+    for (; *text && p < reply + GDB_PACKET_SIZE - 2; text++) {
+        *p++ = hex_digits[(*text >> 4) & 15];
+        *p++ = hex_digits[*text & 15];
+    }
+    *p = 0;
+    put_packet(reply);
+}
+
+// ================================================
+//                  registers and memory
+// ================================================
+
+static void put_hex32(char* p, unsigned int value) {
+    for (int i=0; i<4; i++) {
+        p[2*i] = hex_digits[(value >> (8*i+4)) & 15];
+        p[2*i+1] = hex_digits[(value >> (8*i)) & 15];
+    }
+}
+
+// Parse 8 hex digits of a little endian word
+static unsigned int get_hex32(const char* p) {
+    unsigned int value = 0;
+    for (int i=0; i<4; i++)
+        value |= (unsigned int)(hex_value(p[2*i])*16 + hex_value(p[2*i+1])) << (8*i);
+    return value;
+}
+
+static unsigned int read_gdb_reg(F32Machine* m, int n) {
+    return n==32 ? f32_read_pc(m) : (unsigned int)f32_read_reg(m, n);
+}
+
+static void write_gdb_reg(F32Machine* m, int n, unsigned int value) {
+    if (n==32)
+        f32_write_pc(m, value);
+    else
+        f32_write_reg(m, n, value);
+}
+
+// Reads don't go through f32_mem_ptr(), as that would discard any code translated from the word
+static int read_byte(F32Machine* m, unsigned int addr, int* value) {
+    int word;
+    if (addr < MEM_SIZE)
+        word = mem_read(m, addr & ~3u);
+    else if (addr >= ROM_BASE)
+        word = m->prog_mem[(addr - ROM_BASE) >> 2];
+    else
+        return 0;
+    *value = (word >> (8*(addr&3))) & 0xff;
+    return 1;
+}
+
+static int write_byte(F32Machine* m, unsigned int addr, int value) {
+    int* p = f32_mem_ptr(m, addr & ~3u);
+    if (p==0)
+        return 0;
+    int shift = 8*(addr&3);
+    *p = (*p & ~(0xff << shift)) | ((value & 0xff) << shift);
+    return 1;
+}
+
+// ================================================
+//                  run
+// ================================================
+// Run until a breakpoint, the end of the program, or a ^C from gdb, and set the stop reply
+
+static void stop_reply(F32Machine* m, int result, int signal) {
+    unsigned int addr;
+    int kind;
+    if (result==F32_FINISHED)
+        strcpy(reply, "W00");
+    else if (result==F32_WATCHPOINT) {
+        kind = f32_watch_hit(m, &addr);
+        sprintf(reply, "T%02x%swatch:%x;", GDB_SIGTRAP, kind==F32_WATCH_READ ? "r" : "", addr);
+    }
+    else if (result==F32_HISTORY_START)
+        sprintf(reply, "T%02xreplaylog:begin;", GDB_SIGTRAP);
+    else if (result==F32_EXCEPTION)
+        sprintf(reply, "S%02x", GDB_SIGSEGV);
+    else
+        sprintf(reply, "S%02x", signal);
+}
+
+static void run(F32Machine* m, int single_step, int* result) {
+    int signal = GDB_SIGTRAP;
+    if (single_step)
+        *result = f32_run(m, 1);
+    else
+        while (1) {
+            *result = f32_run(m, GDB_RUN_SLICE);
+            if (*result!=F32_RUNNING && *result!=F32_SYNC)
+                break;
+            if (interrupt_requested()) {
+                signal = GDB_SIGINT;
+                break;
+            }
+        }
+    stop_reply(m, *result, signal);
+}
+
+// Run backwards, when recording with --record
+static void reverse(F32Machine* m, int single_step, int* result) {
+    if (single_step)
+        *result = f32_goto(m, f32_instr_count(m)-1) ? F32_RUNNING : F32_HISTORY_START;
+    else
+        *result = f32_reverse_continue(m);
+    stop_reply(m, *result, GDB_SIGTRAP);
+}
+
+// ================================================
+//                  monitor commands
+// ================================================
+// "monitor icount" prints the number of instructions run, and "monitor goto <n>" goes to the
+// point after n instructions, backwards or forwards.
+
+static void monitor(F32Machine* m, const char* hex) {
+    char command[256], text[100];
+    int len = 0;
+    for (; hex[0] && hex[1] && len < (int)sizeof(command)-1; hex += 2)
+        command[len++] = (char)(hex_value(hex[0])*16 + hex_value(hex[1]));
+    command[len] = 0;
+
+    if (strcmp(command, "icount")==0) {
+        sprintf(text, "%lld\n", f32_instr_count(m));
+        put_console(text);
+    } else if (strncmp(command, "goto ", 5)==0) {
+        if (!f32_goto(m, atoll(command+5)))
+            put_console("Can't go there\n");
+        sprintf(text, "At %lld, pc=%08x\n", f32_instr_count(m), f32_read_pc(m));
+        put_console(text);
+    } else {
+        reply[0] = 0;       // Not supported
+        return;
+    }
+    strcpy(reply, "OK");
+}
+
+// ================================================
+//                  gdb_serve
+// ================================================
+// Serve gdb until it kills the program or closes the connection. If it detaches, run the
+// program to the end, or for at most max_instrs more. Returns the last result of f32_run().
+
+int gdb_serve(F32Machine* m, string port, long long max_instrs) {
+    gdb = listen_and_accept(port);
+    int result = F32_RUNNING;
+    long long end;
+
+    while (get_packet()) {
+        char* p = packet+1;
+        unsigned int addr, len;
+        int n, value;
+        reply[0] = 0;
+
+        switch (packet[0]) {
+            case '?':
+                sprintf(reply, "S%02x", GDB_SIGTRAP);
+                break;
+
+            case 'g':
+                for (int i=0; i<33; i++)
+                    put_hex32(reply + 8*i, read_gdb_reg(m, i));
+                reply[8*33] = 0;
+                break;
+
+            case 'G':
+                for (int i=0; i<33 && strlen(p) >= (size_t)8*(i+1); i++)
+                    write_gdb_reg(m, i, get_hex32(p + 8*i));
+                strcpy(reply, "OK");
+                break;
+
+            case 'p':
+                n = (int)strtoul(p, 0, 16);
+                if (n>32)
+                    strcpy(reply, "E01");
+                else {
+                    put_hex32(reply, read_gdb_reg(m, n));
+                    reply[8] = 0;
+                }
+                break;
+
+            case 'P':
+                n = (int)strtoul(p, &p, 16);
+                if (n>32 || *p!='=' || strlen(p+1)<8)
+                    strcpy(reply, "E01");
+                else {
+                    write_gdb_reg(m, n, get_hex32(p+1));
+                    strcpy(reply, "OK");
+                }
+                break;
+
+            case 'm':
+                addr = strtoul(p, &p, 16);
+                len = strtoul(p+1, 0, 16);
+                if (len > GDB_PACKET_SIZE/2)
+                    len = GDB_PACKET_SIZE/2;
+                for (unsigned int i=0; i<len; i++) {
+                    if (!read_byte(m, addr+i, &value)) {
+                        if (i==0)
+                            strcpy(reply, "E01");
+                        break;
+                    }
+                    reply[2*i] = hex_digits[value>>4];
+                    reply[2*i+1] = hex_digits[value&15];
+                    reply[2*i+2] = 0;
+                }
+                break;
+
+            case 'M':
+                addr = strtoul(p, &p, 16);
+                len = strtoul(p+1, &p, 16);
+                strcpy(reply, "OK");
+                for (unsigned int i=0; i<len && p[1+2*i] && p[2+2*i]; i++)
+                    if (!write_byte(m, addr+i, hex_value(p[1+2*i])*16 + hex_value(p[2+2*i]))) {
+                        strcpy(reply, "E01");
+                        break;
+                    }
+                break;
+
+            case 'c':
+            case 's':
+                if (*p)
+                    f32_write_pc(m, strtoul(p, 0, 16));
+                run(m, packet[0]=='s', &result);
+                break;
+
+            case 'b':
+                if (m->record && (packet[1]=='s' || packet[1]=='c'))
+                    reverse(m, packet[1]=='s', &result);
+                else
+                    strcpy(reply, "E01");
+                break;
+
+            case 'Z':
+            case 'z':
+                // Software and hardware breakpoints are the same to us
+                if ((packet[1]=='0' || packet[1]=='1') && packet[2]==',') {
+                    addr = strtoul(packet+3, 0, 16);
+                    strcpy(reply, f32_set_breakpoint(m, addr, packet[0]=='Z') ? "OK" : "E01");
+                } else if (packet[1]>='2' && packet[1]<='4' && packet[2]==',') {
+                    // Write, read and access watchpoints
+                    static const int watch_flags[] = {F32_WATCH_WRITE, F32_WATCH_READ, F32_WATCH_READ | F32_WATCH_WRITE};
+                    n = watch_flags[packet[1]-'2'] | F32_WATCH_STOP;
+                    addr = strtoul(packet+3, &p, 16);
+                    len = strtoul(p+1, 0, 16);
+                    strcpy(reply, "OK");
+                    if (packet[0]=='z')
+                        f32_remove_watch(m, addr, len, n);
+                    else if (!f32_add_watch(m, addr, len, n))
+                        strcpy(reply, "E01");
+                }
+                break;
+
+            case 'q':
+                if (strncmp(packet, "qSupported", 10)==0)
+                    sprintf(reply, "PacketSize=%x%s", GDB_PACKET_SIZE, m->record ? ";ReverseStep+;ReverseContinue+" : "");
+                else if (strncmp(packet, "qRcmd,", 6)==0)
+                    monitor(m, packet+6);
+                else if (strcmp(packet, "qAttached")==0)
+                    strcpy(reply, "1");
+                else if (strcmp(packet, "qC")==0)
+                    strcpy(reply, "QC1");
+                else if (strcmp(packet, "qfThreadInfo")==0)
+                    strcpy(reply, "m1");
+                else if (strcmp(packet, "qsThreadInfo")==0)
+                    strcpy(reply, "l");
+                break;
+
+            case 'H':
+            case 'T':
+                strcpy(reply, "OK");
+                break;
+
+            case 'D':
+                put_packet("OK");
+                close_socket(gdb);
+                end = f32_instr_count(m) + max_instrs;
+                do {
+                    long long left = end - f32_instr_count(m);
+                    result = f32_run(m, left > GDB_RUN_SLICE ? GDB_RUN_SLICE : (int)left);
+                } while ((result==F32_RUNNING || result==F32_SYNC || result==F32_BREAKPOINT || result==F32_WATCHPOINT)
+                         && f32_instr_count(m) < end);
+                return result==F32_FINISHED || result==F32_EXCEPTION ? result : F32_RUNNING;
+
+            case 'k':
+                close_socket(gdb);
+                return result;
+        }
+        put_packet(reply);
+    }
+    close_socket(gdb);
+    return result;
+}
@@ -0,0 +1,484 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "f32.h"
+#include "sim.h"
+
+// *****************************************************************
+//                        JIT compiler
+// *****************************************************************
+// Compiles translated blocks that have run JIT_THRESHOLD times into native x86-64 code.
+//
+// The F32 registers stay in the machine's reg[] in memory, addressed from a pinned base
+// pointer. The compiled code handles ALU ops, multiply/divide, branches and jumps, and loads/stores
+// that hit the SDRAM in supervisor mode. Anything else (MMIO, DMPU checks in user mode,
+// watched pages, exceptions, cfg instructions) leaves the compiled code through a side exit, which
+// returns the number of the op to continue from in the interpreter.
+//
+// Host registers while running compiled code:
+//     rbx = &m->reg[0]   r12 = m->fast_pages   r13 = &m->status
+//     r14 = &m->pc       r15 = m->code_pages
+//     eax, ecx, edx are scratch
+// These are callee saved in both the Windows and System V calling conventions.
+//
+// Each machine has its own code buffer, and the compiled code has the addresses of that
+// machine's state built in. Compiled code is only freed along with the machine - code for
+// blocks flushed by self-modifying code is just abandoned. Once the code buffer is full no
+// more blocks get compiled.
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#define JIT_BUFFER_SIZE  (8*1024*1024)
+#define MAX_OP_SIZE      64        // Upper bound on the code for one op
+#define MAX_FIXUPS       (4*(MAX_BLOCK_INSTR+1))
+
+struct Jit {
+    F32Machine* m;
+    unsigned char* buffer;
+    unsigned char* end;
+    unsigned char* p;               // Current emit position
+
+    // Conditional jumps to side exits, patched once the exit stubs are placed
+    struct {
+        unsigned char* rel;         // Address of the rel32 field of the jump
+        int op;                     // Op to resume at
+    } fixups[MAX_FIXUPS];
+    int num_fixups;
+};
+
+// ================================================
+//                  code emission
+// ================================================
+
+static void emit1(Jit* j, int b) {
+    *j->p++ = b;
+}
+
+static void emit2(Jit* j, int b1, int b2) {
+    *j->p++ = b1;
+    *j->p++ = b2;
+}
+
+static void emit3(Jit* j, int b1, int b2, int b3) {
+    *j->p++ = b1;
+    *j->p++ = b2;
+    *j->p++ = b3;
+}
+
+static void emit4(Jit* j, int b1, int b2, int b3, int b4) {
+    *j->p++ = b1;
+    *j->p++ = b2;
+    *j->p++ = b3;
+    *j->p++ = b4;
+}
+
+static void emit_imm32(Jit* j, int v) {
+    *j->p++ = v;
+    *j->p++ = v>>8;
+    *j->p++ = v>>16;
+    *j->p++ = v>>24;
+}
+
+static void emit_imm64(Jit* j, uint64_t v) {
+    emit_imm32(j, (int)v);
+    emit_imm32(j, (int)(v>>32));
+}
+
+// Operand field for [rbx + 4*r], with the x86 register in the reg field
+#define REG_EAX 0
+#define REG_ECX 1
+#define REG_EDX 2
+#define MODRM_F32REG(x86reg)  (0x43 | ((x86reg)<<3))
+
+// mov x86reg, reg[r]
+static void emit_load_reg(Jit* j, int x86reg, int r) {
+    emit3(j, 0x8B, MODRM_F32REG(x86reg), 4*r);
+}
+
+// mov reg[r], x86reg
+static void emit_store_reg(Jit* j, int r, int x86reg) {
+    emit3(j, 0x89, MODRM_F32REG(x86reg), 4*r);
+}
+
+// op eax, reg[r]   where opcode is the x86 'r32, r/m32' opcode
+static void emit_op_reg(Jit* j, int opcode, int r) {
+    emit3(j, opcode, MODRM_F32REG(REG_EAX), 4*r);
+}
+
+// op eax, imm32    where opcode is the x86 short form 'eax, imm32' opcode
+static void emit_op_imm(Jit* j, int opcode, int imm) {
+    emit1(j, opcode);
+    emit_imm32(j, imm);
+}
+
+// mov dword reg[r], imm32
+static void emit_store_reg_imm(Jit* j, int r, int imm) {
+    emit3(j, 0xC7, 0x43, 4*r);
+    emit_imm32(j, imm);
+}
+
+// mov dword [r14], imm32   (set the pc)
+static void emit_set_pc_imm(Jit* j, unsigned int value) {
+    emit3(j, 0x41, 0xC7, 0x06);
+    emit_imm32(j, value);
+}
+
+// mov [r14], ecx
+static void emit_set_pc_ecx(Jit* j) {
+    emit3(j, 0x41, 0x89, 0x0E);
+}
+
+// mov eax, imm32
+static void emit_mov_eax_imm(Jit* j, int imm) {
+    emit1(j, 0xB8);
+    emit_imm32(j, imm);
+}
+
+// Conditional jump (0F 8x rel32) to the side exit for op
+static void emit_jcc_exit(Jit* j, int cc, int op) {
+    emit2(j, 0x0F, 0x80 | cc);
+    j->fixups[j->num_fixups].rel = j->p;
+    j->fixups[j->num_fixups].op = op;
+    j->num_fixups++;
+    emit_imm32(j, 0);
+}
+
+#define CC_B   0x2
+#define CC_AE  0x3
+#define CC_E   0x4
+#define CC_NE  0x5
+#define CC_L   0xC
+#define CC_GE  0xD
+
+// ================================================
+//                  memory access fast path
+// ================================================
+// Compute the address into eax, and branch to the side exit unless we are in supervisor
+// mode and the address is an aligned SDRAM address. Accesses to SDRAM pages that haven't
+// been allocated yet also go to the interpreter.
+
+static void emit_address_check(Jit* j, MicroOp* op, int index, int align_mask) {
+    emit_load_reg(j, REG_EAX, op->a);
+    if (op->imm)
+        emit_op_imm(j, 0x05, op->imm);                 // add eax, imm32
+    emit4(j, 0x41, 0xF6, 0x45, 0x00);                  // test byte [r13], STATUS_SUPERVISOR
+    emit1(j, STATUS_SUPERVISOR);
+    emit_jcc_exit(j, CC_E, index);
+    emit_op_imm(j, 0x3D, 0x4000000);                   // cmp eax, 0x4000000
+    emit_jcc_exit(j, CC_AE, index);
+    if (align_mask) {
+        emit2(j, 0xA8, align_mask);                    // test al, align_mask
+        emit_jcc_exit(j, CC_NE, index);
+    }
+}
+
+// Look up the page for the address in eax. Leaves rcx pointing at the page and eax = offset in the page
+static void emit_page_lookup(Jit* j, int index) {
+    emit4(j, 0x49, 0x8B, 0x0C, 0xCC);                  // mov rcx, [r12+rcx*8]
+    emit3(j, 0x48, 0x85, 0xC9);                        // test rcx, rcx
+    emit_jcc_exit(j, CC_E, index);
+    emit_op_imm(j, 0x25, MEM_PAGE_SIZE-1);             // and eax, MEM_PAGE_SIZE-1
+}
+
+static void emit_load(Jit* j, MicroOp* op, int index) {
+    emit_address_check(j, op, index, op->kind==OP_LDW ? 3 : op->kind==OP_LDH ? 1 : 0);
+    emit2(j, 0x89, 0xC1);                              // mov ecx, eax
+    emit3(j, 0xC1, 0xE9, MEM_PAGE_BITS);               // shr ecx, MEM_PAGE_BITS
+    emit_page_lookup(j, index);
+    switch(op->kind) {
+        case OP_LDB: emit4(j, 0x0F, 0xBE, 0x04, 0x01); break;                 // movsx eax, byte [rcx+rax]
+        case OP_LDH: emit4(j, 0x0F, 0xBF, 0x04, 0x01); break;                 // movsx eax, word [rcx+rax]
+        case OP_LDW: emit3(j, 0x8B, 0x04, 0x01); break;                       // mov eax, [rcx+rax]
+    }
+    if (op->d)
+        emit_store_reg(j, op->d, REG_EAX);
+}
+
+// Stores also need to go to the interpreter if there is translated code in the page
+// being written to, so it can check for self-modifying code.
+
+static void emit_store(Jit* j, MicroOp* op, int index) {
+    emit_address_check(j, op, index, op->kind==OP_STW ? 3 : op->kind==OP_STH ? 1 : 0);
+    emit2(j, 0x89, 0xC1);                              // mov ecx, eax
+    emit3(j, 0xC1, 0xE9, MEM_PAGE_BITS);               // shr ecx, MEM_PAGE_BITS   (same as the code page number)
+    emit4(j, 0x49, 0x83, 0x3C, 0xCF); emit1(j, 0x00);     // cmp qword [r15+rcx*8], 0
+    emit_jcc_exit(j, CC_NE, index);
+    emit_page_lookup(j, index);
+    emit_load_reg(j, REG_EDX, op->b);
+    switch(op->kind) {
+        case OP_STB: emit3(j, 0x88, 0x14, 0x01); break;                       // mov [rcx+rax], dl
+        case OP_STH: emit4(j, 0x66, 0x89, 0x14, 0x01); break;                 // mov [rcx+rax], dx
+        case OP_STW: emit3(j, 0x89, 0x14, 0x01); break;                       // mov [rcx+rax], edx
+    }
+}
+
+// ================================================
+//                  divide
+// ================================================
+// Division by zero is left to the interpreter
+
+static void emit_divide(Jit* j, MicroOp* op, int index, int is_signed, int want_remainder, int immediate) {
+    emit_load_reg(j, REG_EAX, op->a);
+    if (immediate) {
+        emit1(j, 0xB9);                                // mov ecx, imm32
+        emit_imm32(j, op->imm);
+    } else {
+        emit_load_reg(j, REG_ECX, op->b);
+        emit2(j, 0x85, 0xC9);                          // test ecx, ecx
+        emit_jcc_exit(j, CC_E, index);
+    }
+    if (is_signed) {
+        emit1(j, 0x99);                                // cdq
+        emit2(j, 0xF7, 0xF9);                          // idiv ecx
+    } else {
+        emit2(j, 0x31, 0xD2);                          // xor edx, edx
+        emit2(j, 0xF7, 0xF1);                          // div ecx
+    }
+    emit_store_reg(j, op->d, want_remainder ? REG_EDX : REG_EAX);
+}
+
+// ================================================
+//                  branch
+// ================================================
+// pc = condition ? target : fall through
+
+static void emit_branch(Jit* j, MicroOp* op, int cc) {
+    emit_load_reg(j, REG_EAX, op->a);
+    emit_op_reg(j, 0x3B, op->b);                       // cmp eax, reg[b]
+    emit1(j, 0xB9);                                    // mov ecx, fall through
+    emit_imm32(j, op->pc);
+    emit1(j, 0xBA);                                    // mov edx, target
+    emit_imm32(j, op->imm);
+    emit3(j, 0x0F, 0x40 | cc, 0xCA);                   // cmovcc ecx, edx
+    emit_set_pc_ecx(j);
+}
+
+// ================================================
+//                  compile_op
+// ================================================
+// Emit the code for one op. Returns 0 if the op ends the compiled code, with the value
+// to return in eax.
+
+static int compile_op(Jit* j, MicroOp* op, int index) {
+    switch(op->kind) {
+        case OP_NOP:   break;
+        case OP_LDI:   emit_store_reg_imm(j, op->d, op->imm); break;
+
+        case OP_AND:   emit_load_reg(j, REG_EAX, op->a); emit_op_reg(j, 0x23, op->b); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_OR:    emit_load_reg(j, REG_EAX, op->a); emit_op_reg(j, 0x0B, op->b); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_XOR:   emit_load_reg(j, REG_EAX, op->a); emit_op_reg(j, 0x33, op->b); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_ADD:   emit_load_reg(j, REG_EAX, op->a); emit_op_reg(j, 0x03, op->b); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_SUB:   emit_load_reg(j, REG_EAX, op->a); emit_op_reg(j, 0x2B, op->b); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_MUL:   emit_load_reg(j, REG_EAX, op->a); emit3(j, 0x0F, 0xAF, MODRM_F32REG(REG_EAX)); emit1(j, 4*op->b);
+                       emit_store_reg(j, op->d, REG_EAX); break;
+
+        case OP_LSL:
+        case OP_LSR:
+        case OP_ASR:
+            emit_load_reg(j, REG_EAX, op->a);
+            emit_load_reg(j, REG_ECX, op->b);
+            emit2(j, 0xD3, op->kind==OP_LSL ? 0xE0 : op->kind==OP_LSR ? 0xE8 : 0xF8);     // shl/shr/sar eax, cl
+            emit_store_reg(j, op->d, REG_EAX);
+            break;
+
+        case OP_CLT:
+        case OP_CLTU:
+            emit_load_reg(j, REG_EAX, op->a);
+            emit_op_reg(j, 0x3B, op->b);                                           // cmp eax, reg[b]
+            emit3(j, 0x0F, op->kind==OP_CLT ? 0x9C : 0x92, 0xC0);                  // setl/setb al
+            emit3(j, 0x0F, 0xB6, 0xC0);                                            // movzx eax, al
+            emit_store_reg(j, op->d, REG_EAX);
+            break;
+
+        case OP_ANDI:  emit_load_reg(j, REG_EAX, op->a); emit_op_imm(j, 0x25, op->imm); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_ORI:   emit_load_reg(j, REG_EAX, op->a); emit_op_imm(j, 0x0D, op->imm); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_XORI:  emit_load_reg(j, REG_EAX, op->a); emit_op_imm(j, 0x35, op->imm); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_ADDI:  emit_load_reg(j, REG_EAX, op->a); emit_op_imm(j, 0x05, op->imm); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_SUBI:  emit_load_reg(j, REG_EAX, op->a); emit_op_imm(j, 0x2D, op->imm); emit_store_reg(j, op->d, REG_EAX); break;
+        case OP_MULI:  emit_load_reg(j, REG_EAX, op->a); emit2(j, 0x69, 0xC0); emit_imm32(j, op->imm);   // imul eax, eax, imm32
+                       emit_store_reg(j, op->d, REG_EAX); break;
+
+        case OP_LSLI:
+        case OP_LSRI:
+        case OP_ASRI:
+            emit_load_reg(j, REG_EAX, op->a);
+            emit3(j, 0xC1, op->kind==OP_LSLI ? 0xE0 : op->kind==OP_LSRI ? 0xE8 : 0xF8, op->imm);  // shl/shr/sar eax, imm8
+            emit_store_reg(j, op->d, REG_EAX);
+            break;
+
+        case OP_CLTI:
+        case OP_CLTUI:
+            emit_load_reg(j, REG_EAX, op->a);
+            emit_op_imm(j, 0x3D, op->imm);                                         // cmp eax, imm32
+            emit3(j, 0x0F, op->kind==OP_CLTI ? 0x9C : 0x92, 0xC0);                 // setl/setb al
+            emit3(j, 0x0F, 0xB6, 0xC0);                                            // movzx eax, al
+            emit_store_reg(j, op->d, REG_EAX);
+            break;
+
+        case OP_DIVU:  emit_divide(j, op, index, 0, 0, 0); break;
+        case OP_DIVS:  emit_divide(j, op, index, 1, 0, 0); break;
+        case OP_MODU:  emit_divide(j, op, index, 0, 1, 0); break;
+        case OP_MODS:  emit_divide(j, op, index, 1, 1, 0); break;
+        case OP_DIVUI:
+        case OP_DIVSI:
+        case OP_MODUI:
+        case OP_MODSI:
+            if (op->imm==0)
+                goto side_exit;
+            emit_divide(j, op, index, op->kind==OP_DIVSI || op->kind==OP_MODSI, op->kind==OP_MODUI || op->kind==OP_MODSI, 1);
+            break;
+
+        case OP_LDB:
+        case OP_LDH:
+        case OP_LDW:
+            emit_load(j, op, index);
+            break;
+
+        case OP_STB:
+        case OP_STH:
+        case OP_STW:
+            emit_store(j, op, index);
+            break;
+
+        case OP_BEQ:   emit_branch(j, op, CC_E);  emit_mov_eax_imm(j, -1); return 0;
+        case OP_BNE:   emit_branch(j, op, CC_NE); emit_mov_eax_imm(j, -1); return 0;
+        case OP_BLT:   emit_branch(j, op, CC_L);  emit_mov_eax_imm(j, -1); return 0;
+        case OP_BGE:   emit_branch(j, op, CC_GE); emit_mov_eax_imm(j, -1); return 0;
+        case OP_BLTU:  emit_branch(j, op, CC_B);  emit_mov_eax_imm(j, -1); return 0;
+        case OP_BGEU:  emit_branch(j, op, CC_AE); emit_mov_eax_imm(j, -1); return 0;
+        case OP_BRA:   emit_set_pc_imm(j, op->imm); emit_mov_eax_imm(j, -1); return 0;
+
+        case OP_JMP:
+            if (op->d)
+                emit_store_reg_imm(j, op->d, op->pc);
+            emit_set_pc_imm(j, op->imm);
+            emit_mov_eax_imm(j, -1);
+            return 0;
+
+        case OP_JMPR:
+            emit_load_reg(j, REG_ECX, op->a);
+            emit2(j, 0x81, 0xC1);                      // add ecx, imm32
+            emit_imm32(j, op->imm);
+            emit_set_pc_ecx(j);
+            if (op->d)
+                emit_store_reg_imm(j, op->d, op->pc);
+            emit_mov_eax_imm(j, -1);
+            return 0;
+
+        case OP_END:
+            emit_set_pc_imm(j, op->pc);
+            emit_mov_eax_imm(j, -1);
+            return 0;
+
+        default:
+        side_exit:
+            emit_mov_eax_imm(j, index);
+            return 0;
+    }
+    return 1;
+}
+
+// ================================================
+//                  jit_compile
+// ================================================
+
+NativeCode jit_compile(Jit* j, Block* block) {
+    if (j->end - j->p < (block->num_instr+1)*MAX_OP_SIZE + 64 + MAX_FIXUPS*16)
+        return 0;
+
+    unsigned char* start = j->p;
+    j->num_fixups = 0;
+
+    // Prologue
+    emit1(j, 0x53);                                    // push rbx
+    emit2(j, 0x41, 0x54);                              // push r12
+    emit2(j, 0x41, 0x55);                              // push r13
+    emit2(j, 0x41, 0x56);                              // push r14
+    emit2(j, 0x41, 0x57);                              // push r15
+    emit2(j, 0x48, 0xBB); emit_imm64(j, (uintptr_t)j->m->reg);         // mov rbx, m->reg
+    emit2(j, 0x49, 0xBC); emit_imm64(j, (uintptr_t)j->m->fast_pages);  // mov r12, m->fast_pages
+    emit2(j, 0x49, 0xBD); emit_imm64(j, (uintptr_t)&j->m->status);     // mov r13, &m->status
+    emit2(j, 0x49, 0xBE); emit_imm64(j, (uintptr_t)&j->m->pc);         // mov r14, &m->pc
+    emit2(j, 0x49, 0xBF); emit_imm64(j, (uintptr_t)j->m->code_pages);  // mov r15, m->code_pages
+
+    for(int i=0; compile_op(j, &block->ops[i], i); i++)
+        ;
+
+    // Epilogue
+    unsigned char* epilogue = j->p;
+    emit2(j, 0x41, 0x5F);                              // pop r15
+    emit2(j, 0x41, 0x5E);                              // pop r14
+    emit2(j, 0x41, 0x5D);                              // pop r13
+    emit2(j, 0x41, 0x5C);                              // pop r12
+    emit1(j, 0x5B);                                    // pop rbx
+    emit1(j, 0xC3);                                    // ret
+
+    // Side exit stubs
+    for(int i=0; i<j->num_fixups; i++) {
+        int rel = j->p - (j->fixups[i].rel + 4);
+        j->fixups[i].rel[0] = rel;
+        j->fixups[i].rel[1] = rel>>8;
+        j->fixups[i].rel[2] = rel>>16;
+        j->fixups[i].rel[3] = rel>>24;
+        emit_mov_eax_imm(j, j->fixups[i].op);
+        emit1(j, 0xE9);                                // jmp epilogue
+        emit_imm32(j, epilogue - (j->p+4));
+    }
+
+    return (NativeCode)start;
+}
+
+// ================================================
+//                  jit_create
+// ================================================
+
+Jit* jit_create(F32Machine* m) {
+    Jit* j = my_malloc(sizeof(Jit));
+#ifdef _WIN32
+    j->buffer = VirtualAlloc(NULL, JIT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    j->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->buffer==MAP_FAILED)
+        j->buffer = 0;
+#endif
+    if (j->buffer==0) {
+        printf("JIT: can't allocate executable memory\n");
+        free(j);
+        return 0;
+    }
+    j->m = m;
+    j->p = j->buffer;
+    j->end = j->buffer + JIT_BUFFER_SIZE;
+    return j;
+}
+
+void jit_destroy(Jit* j) {
+#ifdef _WIN32
+    VirtualFree(j->buffer, 0, MEM_RELEASE);
+#else
+    munmap(j->buffer, JIT_BUFFER_SIZE);
+#endif
+    free(j);
+}
+
+#else
+
+Jit* jit_create(F32Machine* m) {
+    printf("JIT is only supported on x86-64 hosts\n");
+    return 0;
+}
+
+void jit_destroy(Jit* j) {
+}
+
+NativeCode jit_compile(Jit* j, Block* block) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,179 @@
+// ----------------------------------------------------
+//                    libf32sim
+// ----------------------------------------------------
+// Embeddable F32 simulator. Each F32Machine holds the complete state of one simulated
+// system, so any number of machines can be created, and different machines can be run on
+// different threads at the same time.
+
+#include <stdio.h>
+
+typedef struct F32Machine F32Machine;
+
+// Results of f32_run()
+#define F32_RUNNING   0     // Executed the requested number of instructions
+#define F32_FINISHED  1     // The program returned to address 0
+#define F32_EXCEPTION 2     // An exception was raised with F32_ABORT_ON_EXCEPTION set
+#define F32_SYNC      3     // The program wrote to the simulation sync register (0xE0000044)
+#define F32_BREAKPOINT 4    // Reached a breakpoint, before running the instruction there
+#define F32_WATCHPOINT 5    // A load or store hit a watch with F32_WATCH_STOP, see f32_watch_hit()
+#define F32_HISTORY_START 6 // f32_reverse_continue() went back to the first checkpoint
+
+// Options for f32_set_options()
+#define F32_ABORT_ON_EXCEPTION 0x01  // Print the registers and stop at the first exception
+#define F32_USE_JIT            0x02  // Compile hot code to native code (x86-64 hosts only)
+#define F32_PROFILE            0x04  // Count the instructions executed at each address
+#define F32_CALLGRAPH          0x08  // Count the instructions executed in each call path
+#define F32_TIMING             0x10  // Estimate the clock cycles the hardware would take
+#define F32_SKIP_IDLE          0x20  // Skip the time spent in loops polling the devices
+
+// MMIO hooks are called for every access to the hardware registers, before the built in
+// devices. They return 1 if they handled the access, or 0 to leave it to the built in devices.
+// Device models use the same callbacks.
+typedef int (*F32MmioRead)(void* ctx, unsigned int addr, int* value);
+typedef int (*F32MmioWrite)(void* ctx, unsigned int addr, int value, int mask);
+
+// Receives each frame of the display, as 8 bit RGB triples from the top left
+typedef void (*F32Frame)(void* ctx, const unsigned char* rgb, int width, int height, int frame_number);
+
+// Receives the text output of the built in devices (uart, 7 segment display, leds...)
+typedef void (*F32Output)(void* ctx, const char* text, int len);
+
+// Create a machine in its reset state, with empty memory.
+F32Machine* f32_create(void);
+void f32_destroy(F32Machine* m);
+
+// Load a hex file (one word per line) into the boot rom. Returns 0 if the file can't be read.
+int f32_load(F32Machine* m, const char* filename);
+
+void f32_set_options(F32Machine* m, int options);
+
+// Set the files the built in devices and logging use. Any may be NULL. The machine
+// doesn't take ownership of them. Logging registers or memory, or tracing, turns the JIT off.
+void f32_set_files(F32Machine* m, FILE* uart_input, FILE* uart_log, FILE* reg_log, FILE* mem_log, FILE* trace);
+
+void f32_set_mmio_hooks(F32Machine* m, F32MmioRead read, F32MmioWrite write, void* ctx);
+
+// Add a device model handling the registers from base to base+size in the hardware register
+// space (0xE0000000 to 0xE000FFFF). Either callback may be NULL. The device replaces any
+// earlier one at those addresses, including the built in devices. Returns 0 if the range is
+// outside the register space or there are too many devices.
+int f32_add_device(F32Machine* m, unsigned int base, unsigned int size, F32MmioRead read, F32MmioWrite write, void* ctx);
+
+// Send device output to a callback rather than to the uart log and stdout
+void f32_set_output(F32Machine* m, F32Output output, void* ctx);
+
+// Back the disk device with a disk image, such as f32filesys makes, mapped into memory so
+// that writes go to the file. Each sector transferred takes clocks_per_sector. Returns 0 if
+// the file can't be opened.
+#define F32_SECTOR_CLOCKS 10000
+int f32_open_disk(F32Machine* m, const char* filename, int clocks_per_sector);
+
+// Write the sectors transferred and the time the disk was busy
+void f32_write_disk(F32Machine* m, const char* filename);
+
+// Connect the uart to "raw:<file>" for input from a binary file, or on systems other than
+// Windows to "pty" for a pseudo-terminal or "unix:<path>" for a unix socket, for both input
+// and output. Waits for a connection to the socket. Returns 0 if it can't be opened.
+int f32_set_uart(F32Machine* m, const char* spec);
+
+// Run for up to n_instrs instructions. Returns one of the F32_xxx results above.
+int f32_run(F32Machine* m, int n_instrs);
+
+// Total number of instructions executed so far
+long long f32_instr_count(F32Machine* m);
+
+// Number of those instructions that were skipped by F32_SKIP_IDLE rather than run
+long long f32_idle_count(F32Machine* m);
+
+int f32_read_reg(F32Machine* m, int reg_num);
+void f32_write_reg(F32Machine* m, int reg_num, int value);
+unsigned int f32_read_pc(F32Machine* m);
+void f32_write_pc(F32Machine* m, unsigned int pc);
+
+// Set or clear a breakpoint on an instruction in SDRAM or the boot rom. f32_run() returns
+// F32_BREAKPOINT when it reaches one, except at the address it was called at, so calling it
+// again carries on from the breakpoint. Returns 0 if there can't be code at the address.
+int f32_set_breakpoint(F32Machine* m, unsigned int addr, int set);
+
+// Watch the CPU's accesses to len bytes from addr. Each access is printed, or with
+// F32_WATCH_STOP a load or store makes f32_run() return F32_WATCHPOINT after the instruction,
+// and an instruction fetch acts as a breakpoint. Returns 0 if the range is empty or there are
+// too many watches. Removing takes the same arguments as adding.
+#define F32_WATCH_READ  1
+#define F32_WATCH_WRITE 2
+#define F32_WATCH_EXEC  4
+#define F32_WATCH_STOP  8
+int f32_add_watch(F32Machine* m, unsigned int addr, unsigned int len, int flags);
+void f32_remove_watch(F32Machine* m, unsigned int addr, unsigned int len, int flags);
+
+// After F32_WATCHPOINT, returns F32_WATCH_READ or F32_WATCH_WRITE and the address accessed
+int f32_watch_hit(F32Machine* m, unsigned int* addr);
+
+// Record the run from here on, with a checkpoint every interval instructions, so that it can
+// be taken back. 0 stops recording and forgets the checkpoints. Recording disables the JIT.
+void f32_record(F32Machine* m, int interval);
+
+// Go back or forward to the point where f32_instr_count() is instr, running quietly past any
+// breakpoints. Returns 0 if that is before the first checkpoint, or the program stops first.
+int f32_goto(F32Machine* m, long long instr);
+
+// Go back to the last breakpoint or watchpoint stop before now, and return F32_BREAKPOINT or
+// F32_WATCHPOINT. If there isn't one, goes to the first checkpoint and returns F32_HISTORY_START.
+int f32_reverse_continue(F32Machine* m);
+
+// Get a pointer to a word of SDRAM or boot rom, or NULL for any other address. Any code
+// translated from that word is discarded, so the pointer can be used to patch code.
+int* f32_mem_ptr(F32Machine* m, unsigned int addr);
+
+// Write the counts collected with F32_PROFILE, as a flat profile by label followed by an
+// annotated disassembly. Labels come from load_labels().
+void f32_write_profile(F32Machine* m, const char* filename);
+
+// Write the call paths collected with F32_CALLGRAPH, both as folded stacks for flamegraph
+// tools and as a call tree with inclusive and exclusive counts.
+void f32_write_callgraph(F32Machine* m, const char* folded_file, const char* report_file);
+
+// Set the latencies, in clock cycles, used by F32_TIMING. See timing.c for the model.
+#define F32_SDRAM_LATENCY   10      // From an SDRAM read request to the data
+#define F32_DIV_LATENCY     33      // Extra cycles for a divide or modulo
+#define F32_BRANCH_PENALTY  3       // Extra cycles for a taken branch or jump
+void f32_set_latencies(F32Machine* m, int sdram_latency, int div_latency, int branch_penalty);
+
+// Write the cycle counts collected with F32_TIMING, in total and by function
+void f32_write_timing(F32Machine* m, const char* filename);
+
+// Attach a cache configuration to simulate, such as "size=16k,line=64,ways=4". See cache.c
+// for the options. Returns 0 if the configuration is not valid.
+int f32_add_cache(F32Machine* m, const char* spec);
+
+// Write the miss rates of each cache configuration, in total and by function
+void f32_write_caches(F32Machine* m, const char* filename);
+
+// Set the speed of the blitter, in pixels per clock. With 0 each command runs as soon as it
+// is written. See blitter.c
+#define F32_BLIT_RATE  1.0
+void f32_set_blit_rate(F32Machine* m, double pixels_per_clock);
+
+// Write the number of each blitter command run and the pixels they drew, and how busy the
+// blitter was
+void f32_write_blitter(F32Machine* m, const char* filename);
+
+// Write each frame of the display, at the start of its vertical sync, to <prefix>00000.ppm,
+// <prefix>00001.ppm and so on. NULL stops writing frames. See vga.c
+void f32_set_frames(F32Machine* m, const char* prefix);
+
+// Pass each frame to a callback, for a live display. The callback is called on a background
+// thread, and the frame is only valid until it returns.
+void f32_set_frame_callback(F32Machine* m, F32Frame callback, void* ctx);
+
+// Write what the display currently shows as a PPM file. Returns 0 if the file can't be created.
+int f32_write_screen(F32Machine* m, const char* filename);
+
+// Write a binary trace of every instruction executed, for f32trace to decode. With compress
+// set the trace is compressed by a background thread. Returns 0 if the file can't be created.
+int f32_open_trace(F32Machine* m, const char* filename, int compress);
+void f32_close_trace(F32Machine* m);
+
+// Save or restore the complete machine state. See snapshot.c
+void f32_save_snapshot(F32Machine* m, const char* filename);
+void f32_load_snapshot(F32Machine* m, const char* filename);
@@ -0,0 +1,408 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  profiler
+// ================================================
+// With F32_PROFILE set, f32_run() counts the number of times each instruction is executed,
+// and the number of times each branch is taken. The counts are kept in pages that parallel
+// the code pages, allocated the first time code in them runs.
+//
+// With F32_CALLGRAPH set, it also follows the guest's calls and returns, and counts the
+// instructions executed in each call path. Exceptions and interrupts enter pseudo-frames,
+// which rte and rti leave.
+
+typedef struct ProfilePage {
+    long long count[CODE_PAGE_SIZE];    // Times each instruction was executed
+    long long taken[CODE_PAGE_SIZE];    // Times each branch was taken
+} ProfilePage;
+
+#define FRAME_CALL      0
+#define FRAME_EXCEPTION 1
+#define FRAME_INTERRUPT 2
+
+#define MAX_CALL_DEPTH  200     // Deeper calls are counted in the frame that makes them
+
+typedef struct CallNode CallNode;
+struct CallNode {
+    unsigned int addr;          // Address of the called function or the handler
+    int kind;                   // FRAME_xxx
+    int depth;
+    long long self;             // Instructions executed in this call path
+    long long total;            // Including its callees, worked out when writing the report
+    CallNode* parent;
+    CallNode* children;
+    CallNode* next;             // Next child of the same parent
+};
+
+struct Profile {
+    ProfilePage* pages[CODE_SDRAM_PAGES + CODE_ROM_PAGES];
+    CallNode* root;
+    CallNode* current;          // The frame currently running
+    int overflow;               // Number of calls deeper than MAX_CALL_DEPTH not yet returned from
+    int pending_exception;      // Set when an exception is to enter its frame after the block
+    unsigned int exception_addr;
+};
+
+// Called with the address of the code being run, which names the outermost frame
+static Profile* get_profile(F32Machine* m, unsigned int addr) {
+    if (m->profile==0) {
+        m->profile = my_malloc(sizeof(Profile));
+        m->profile->root = m->profile->current = my_malloc(sizeof(CallNode));
+        m->profile->root->addr = addr;
+    }
+    return m->profile;
+}
+
+// ================================================
+//                  call graph
+// ================================================
+
+static void enter_frame(Profile* p, int kind, unsigned int addr) {
+    CallNode* cur = p->current;
+    if (cur->depth >= MAX_CALL_DEPTH) {
+        p->overflow++;
+        return;
+    }
+
+    CallNode* n;
+    for (n=cur->children; n; n=n->next)
+        if (n->addr==addr && n->kind==kind)
+            break;
+    if (n==0) {
+        n = my_malloc(sizeof(CallNode));
+        n->addr = addr;
+        n->kind = kind;
+        n->depth = cur->depth+1;
+        n->parent = cur;
+        n->next = cur->children;
+        cur->children = n;
+    }
+    p->current = n;
+}
+
+// Leave the innermost frame of the given kind. Returns that don't match a call are ignored.
+static void leave_frame(Profile* p, int kind) {
+    if (p->overflow) {
+        p->overflow--;
+        return;
+    }
+    CallNode* n = p->current;
+    if (kind==FRAME_CALL) {
+        if (n->kind==FRAME_CALL && n->parent)
+            p->current = n->parent;
+        return;
+    }
+    while (n->parent && n->kind!=kind)
+        n = n->parent;
+    if (n->parent)
+        p->current = n->parent;
+}
+
+// Interrupts are taken before the instruction at the handler runs, so enter their frame
+// immediately. Exceptions are raised part way through a block, so wait until its
+// instructions have been counted.
+
+void profile_interrupt(F32Machine* m) {
+    enter_frame(get_profile(m, m->ipc), FRAME_INTERRUPT, m->pc);
+}
+
+void profile_exception(F32Machine* m) {
+    Profile* p = get_profile(m, m->epc);
+    p->pending_exception = 1;
+    p->exception_addr = m->pc;
+}
+
+static void profile_calls(F32Machine* m, Block* block, int executed) {
+    Profile* p = get_profile(m, block->ops[0].pc - 4);
+    p->current->self += executed;
+
+    if (p->pending_exception) {
+        p->pending_exception = 0;
+        enter_frame(p, FRAME_EXCEPTION, p->exception_addr);
+        return;
+    }
+
+    // Calls and returns only come at the end of a block
+    MicroOp* last = &block->ops[executed-1];
+    if (executed!=block->num_instr)
+        return;
+    if ((last->kind==OP_JMP || last->kind==OP_JMPR) && last->d==30)
+        enter_frame(p, FRAME_CALL, m->pc);
+    else if (last->kind==OP_JMPR && last->a==30 && last->d==0)
+        leave_frame(p, FRAME_CALL);
+    else if (last->kind==OP_RTE)
+        leave_frame(p, FRAME_EXCEPTION);
+    else if (last->kind==OP_RTI)
+        leave_frame(p, FRAME_INTERRUPT);
+}
+
+// ================================================
+//                  profile_block
+// ================================================
+// Called after running the first `executed` instructions of a block
+
+void profile_block(F32Machine* m, Block* block, int executed) {
+    if (m->options & F32_CALLGRAPH)
+        profile_calls(m, block, executed);
+    if (!(m->options & F32_PROFILE))
+        return;
+
+    unsigned int addr = block->ops[0].pc - 4;
+    int index = code_page_index(addr);
+    if (index<0)
+        return;
+
+    Profile* p = get_profile(m, addr);
+    ProfilePage* pp = p->pages[index];
+    if (pp==0)
+        pp = p->pages[index] = my_malloc(sizeof(ProfilePage));
+
+    int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+    for (int i=0; i<executed; i++)
+        pp->count[w+i]++;
+
+    // Branches only come at the end of a block
+    MicroOp* last = &block->ops[executed-1];
+    if (executed==block->num_instr && last->kind>=OP_BEQ && last->kind<=OP_BRA && m->pc!=last->pc)
+        pp->taken[w+executed-1]++;
+}
+
+static void free_call_node(CallNode* n) {
+    while (n) {
+        CallNode* next = n->next;
+        free_call_node(n->children);
+        free(n);
+        n = next;
+    }
+}
+
+void profile_destroy(Profile* profile) {
+    for (int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++)
+        free(profile->pages[i]);
+    free_call_node(profile->root);
+    free(profile);
+}
+
+// ================================================
+//                  labels
+// ================================================
+// Instructions are attributed to the closest function label at or before them. Labels of
+// the form <function>.<name> are local labels, such as the .L<n> labels generated by the
+// FPL compiler, and are skipped.
+
+static int is_local_label(string name) {
+    string s = strrchr(name, '.');
+    return s && s!=name && s[1] && strchr(s, ')')==0;
+}
+
+static int compare_label_addr(const void* a, const void* b) {
+    unsigned int x = ((const ProfileLabel*)a)->addr;
+    unsigned int y = ((const ProfileLabel*)b)->addr;
+    return (x>y) - (x<y);
+}
+
+static int compare_label_count(const void* a, const void* b) {
+    long long x = ((const ProfileLabel*)a)->count;
+    long long y = ((const ProfileLabel*)b)->count;
+    return (x<y) - (x>y);
+}
+
+// Returns the labels sorted by address, followed by a catch-all for code before the first label
+ProfileLabel* sort_labels(int* num_labels) {
+    int n = 0;
+    for (Token t = all_labels; t; t=t->next)
+        n++;
+    *num_labels = n;
+    ProfileLabel* labels = my_malloc((n+1) * sizeof(ProfileLabel));
+
+    n = 0;
+    for (Token t = all_labels; t; t=t->next) {
+        labels[n].addr = t->value;
+        labels[n].name = t->text;
+        labels[n++].count = 0;
+    }
+    qsort(labels, n, sizeof(ProfileLabel), compare_label_addr);
+
+    labels[n].addr = 0;
+    labels[n].name = "(unlabelled)";
+    labels[n].count = 0;
+    return labels;
+}
+
+static ProfileLabel* enclosing_label(ProfileLabel* labels, int num_labels, unsigned int addr) {
+    int lo = 0, hi = num_labels;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (labels[mid].addr <= addr)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo==0 ? &labels[num_labels] : &labels[lo-1];
+}
+
+ProfileLabel* enclosing_function(ProfileLabel* labels, int num_labels, unsigned int addr) {
+    ProfileLabel* l = enclosing_label(labels, num_labels, addr);
+    while (l>labels && l!=&labels[num_labels] && is_local_label(l->name))
+        l--;
+    return l;
+}
+
+// ================================================
+//                  f32_write_profile
+// ================================================
+
+static int read_code(F32Machine* m, unsigned int addr) {
+    if (addr >= ROM_BASE)
+        return m->prog_mem[(addr - ROM_BASE)>>2];
+    return mem_read(m, addr);
+}
+
+void f32_write_profile(F32Machine* m, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file==NULL)
+        fatal("Can't create profile '%s'", filename);
+
+    Profile* prof = m->profile;
+    int num_labels;
+    ProfileLabel* labels = sort_labels(&num_labels);
+
+    // Total up the counts for each function
+    long long total = 0;
+    for (int i=0; prof && i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++) {
+        ProfilePage* pp = prof->pages[i];
+        if (pp==0)
+            continue;
+        for (int w=0; w<CODE_PAGE_SIZE; w++)
+            if (pp->count[w]) {
+                enclosing_function(labels, num_labels, code_page_address(i) + 4*w)->count += pp->count[w];
+                total += pp->count[w];
+            }
+    }
+
+    ProfileLabel* flat = my_malloc((num_labels+1) * sizeof(ProfileLabel));
+    memcpy(flat, labels, (num_labels+1) * sizeof(ProfileLabel));
+    qsort(flat, num_labels+1, sizeof(ProfileLabel), compare_label_count);
+
+    fprintf(file, "Flat profile - %lld instructions\n\n", total);
+    fprintf(file, "       count       %%  function\n");
+    for (int i=0; i<=num_labels && flat[i].count; i++)
+        fprintf(file, "%12lld  %6.2f  %s\n", flat[i].count, 100.0*flat[i].count/total, flat[i].name);
+    free(flat);
+
+    // Annotated disassembly of everything that ran
+    fprintf(file, "\nAnnotated disassembly\n");
+    for (int i=0; prof && i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++) {
+        ProfilePage* pp = prof->pages[i];
+        if (pp==0)
+            continue;
+        for (int w=0; w<CODE_PAGE_SIZE; w++) {
+            if (pp->count[w]==0)
+                continue;
+            unsigned int addr = code_page_address(i) + 4*w;
+            if (w==0 || pp->count[w-1]==0)
+                fprintf(file, "\n");
+            int first = enclosing_label(labels, num_labels, addr) - labels;
+            while (first>0 && first<=num_labels && labels[first-1].addr==addr)
+                first--;
+            for (int l=first; l<num_labels && labels[l].addr==addr; l++)
+                fprintf(file, "%12s  %08x:          %s:\n", "", addr, labels[l].name);
+
+            int instr = read_code(m, addr);
+            string text = disassemble_line(instr, addr+4);
+            if (((instr>>26) & 0x3f) == KIND_BRA)
+                fprintf(file, "%12lld  %08x: %08x %-40s taken %lld, not taken %lld\n", pp->count[w], addr, instr,
+                        text, pp->taken[w], pp->count[w] - pp->taken[w]);
+            else
+                fprintf(file, "%12lld  %08x: %08x %s\n", pp->count[w], addr, instr, text);
+        }
+    }
+    free(labels);
+    fclose(file);
+}
+
+// ================================================
+//                  f32_write_callgraph
+// ================================================
+
+static string frame_name(CallNode* n, ProfileLabel* labels, int num_labels) {
+    if (n->kind==FRAME_EXCEPTION)
+        return "[exception]";
+    if (n->kind==FRAME_INTERRUPT)
+        return "[interrupt]";
+    return enclosing_function(labels, num_labels, n->addr)->name;
+}
+
+static long long total_calls(CallNode* n) {
+    n->total = n->self;
+    for (CallNode* c=n->children; c; c=c->next)
+        n->total += total_calls(c);
+    return n->total;
+}
+
+static int compare_call_total(const void* a, const void* b) {
+    long long x = (*(CallNode* const*)a)->total;
+    long long y = (*(CallNode* const*)b)->total;
+    return (x<y) - (x>y);
+}
+
+// Folded stacks, one line per call path: "main;kprintf;printChar 120"
+static void write_folded(FILE* file, CallNode* n, string* path, ProfileLabel* labels, int num_labels) {
+    path[n->depth] = frame_name(n, labels, num_labels);
+    if (n->self) {
+        for (int i=0; i<=n->depth; i++)
+            fprintf(file, "%s%s", i ? ";" : "", path[i]);
+        fprintf(file, " %lld\n", n->self);
+    }
+    for (CallNode* c=n->children; c; c=c->next)
+        write_folded(file, c, path, labels, num_labels);
+}
+
+// The call tree, with the callees of each frame sorted by inclusive count
+static void write_call_tree(FILE* file, CallNode* n, long long total, ProfileLabel* labels, int num_labels) {
+    fprintf(file, "%12lld %6.2f %12lld  %*s%s\n", n->total, 100.0*n->total/total, n->self,
+            2*n->depth, "", frame_name(n, labels, num_labels));
+
+    int num_children = 0;
+    for (CallNode* c=n->children; c; c=c->next)
+        num_children++;
+    CallNode** children = my_malloc(num_children * sizeof(CallNode*) + 1);
+    num_children = 0;
+    for (CallNode* c=n->children; c; c=c->next)
+        children[num_children++] = c;
+    qsort(children, num_children, sizeof(CallNode*), compare_call_total);
+    for (int i=0; i<num_children; i++)
+        write_call_tree(file, children[i], total, labels, num_labels);
+    free(children);
+}
+
+void f32_write_callgraph(F32Machine* m, const char* folded_file, const char* report_file) {
+    if (m->profile==0)
+        return;
+    int num_labels;
+    ProfileLabel* labels = sort_labels(&num_labels);
+    CallNode* root = m->profile->root;
+    long long total = total_calls(root);
+
+    FILE* file = fopen(folded_file, "w");
+    if (file==NULL)
+        fatal("Can't create '%s'", folded_file);
+    string path[MAX_CALL_DEPTH+1];
+    write_folded(file, root, path, labels, num_labels);
+    fclose(file);
+
+    file = fopen(report_file, "w");
+    if (file==NULL)
+        fatal("Can't create '%s'", report_file);
+    fprintf(file, "Call graph - %lld instructions\n\n", total);
+    fprintf(file, "   inclusive      %%    exclusive  call path\n");
+    if (total)
+        write_call_tree(file, root, total, labels, num_labels);
+    fclose(file);
+    free(labels);
+}
@@ -0,0 +1,322 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  record and replay
+// ================================================
+// While recording, a checkpoint is taken every interval instructions. It holds the CPU and
+// device state, and the pages of SDRAM that are written after it, copied just before their first write.
+// Going back to a checkpoint copies those pages back, newest checkpoint first, and anywhere
+// after it is reached by running forward again. The program is deterministic given its
+// inputs, so the run repeats exactly - quietly, without device output, logs or frames.
+//
+// Pages are saved by write_memory() for stores, and by invalidate_code_range() for devices
+// writing to memory. The compiled code stores directly, so there is no JIT while recording.
+// Sectors of the disk image are saved before each disk write too.
+//
+// The device state includes the position in the uart's input file, so going back over uart
+// input reads it again. Input from a terminal or socket can't be read again, so going back
+// over that may not repeat the run exactly. Writes to the boot rom aren't saved.
+
+#define RECORD_MAX_PAGES  16384     // Saved pages (64MB) to keep before dropping old checkpoints
+
+typedef struct SavedPage {
+    int page;                   // Index in mem_pages
+    int* data;                  // Contents at the checkpoint, or NULL if it wasn't allocated
+} SavedPage;
+
+typedef struct SavedSectors {
+    int sector, count;
+    unsigned char* data;        // Contents before the write
+} SavedSectors;
+
+typedef struct Checkpoint {
+    long long time;             // f32_instr_count() at the checkpoint
+    CpuState cpu;
+    DeviceState devices;
+    int serial;                 // Pages saved for this checkpoint are marked with its serial
+    SavedPage* pages;
+    int num_pages, max_pages;
+    SavedSectors* sectors;      // In the order they were saved
+    int num_sectors;
+} Checkpoint;
+
+struct Record {
+    int interval;
+    Checkpoint* checkpoints;    // Oldest first
+    int num_checkpoints, max_checkpoints;
+    int serial;
+    int saved[MEM_NUM_PAGES];   // Serial of the checkpoint each page was last saved for
+    int num_saved;              // Pages (and sectors, in pages) held over all the checkpoints
+};
+
+// A breakpoint or watchpoint met while replaying
+typedef struct Hit {
+    long long time;
+    int result;                 // F32_BREAKPOINT or F32_WATCHPOINT
+    unsigned int addr;
+    int kind;
+} Hit;
+
+static int sector_pages(int count) {
+    return (count*DISK_SECTOR_SIZE + MEM_PAGE_SIZE-1) / MEM_PAGE_SIZE;
+}
+
+static void free_checkpoint(Record* r, Checkpoint* c) {
+    for (int i=0; i<c->num_pages; i++)
+        free(c->pages[i].data);
+    r->num_saved -= c->num_pages;
+    free(c->pages);
+    for (int i=0; i<c->num_sectors; i++) {
+        free(c->sectors[i].data);
+        r->num_saved -= sector_pages(c->sectors[i].count);
+    }
+    free(c->sectors);
+}
+
+// ================================================
+//                  record_write
+// ================================================
+// Called before memory is written, to save the page for the latest checkpoint
+
+void record_write(F32Machine* m, unsigned int addr) {
+    Record* r = m->record;
+    int page = (addr & (MEM_SIZE-1)) >> MEM_PAGE_BITS;
+    if (r->num_checkpoints==0 || r->saved[page]==r->serial)
+        return;
+    r->saved[page] = r->serial;
+
+    Checkpoint* c = &r->checkpoints[r->num_checkpoints-1];
+    if (c->num_pages==c->max_pages) {
+        c->max_pages = c->max_pages ? 2*c->max_pages : 16;
+        c->pages = realloc(c->pages, c->max_pages * sizeof(SavedPage));
+        if (c->pages==0)
+            fatal("Out of memory");
+    }
+    SavedPage* s = &c->pages[c->num_pages++];
+    s->page = page;
+    s->data = 0;
+    if (m->mem_pages[page]) {
+        s->data = my_malloc(MEM_PAGE_SIZE);
+        memcpy(s->data, m->mem_pages[page], MEM_PAGE_SIZE);
+    }
+    r->num_saved++;
+}
+
+// Called before the disk writes count sectors. Unlike pages, sectors are saved at every
+// write, and put back newest first.
+void record_disk_write(F32Machine* m, int sector, int count) {
+    Record* r = m->record;
+    if (r->num_checkpoints==0)
+        return;
+    Checkpoint* c = &r->checkpoints[r->num_checkpoints-1];
+    c->sectors = my_realloc(c->sectors, (c->num_sectors+1) * sizeof(SavedSectors));
+    SavedSectors* s = &c->sectors[c->num_sectors++];
+    s->sector = sector;
+    s->count = count;
+    s->data = my_malloc(count*DISK_SECTOR_SIZE);
+    memcpy(s->data, disk_sectors(m->disk, sector), count*DISK_SECTOR_SIZE);
+    r->num_saved += sector_pages(count);
+}
+
+// ================================================
+//                  checkpoints
+// ================================================
+
+static void checkpoint_event(F32Machine* m, void* ctx);
+
+static void take_checkpoint(F32Machine* m) {
+    Record* r = m->record;
+
+    // Drop the oldest checkpoints once too much is saved, keeping at least the latest
+    int drop = 0;
+    while (drop < r->num_checkpoints-1 && r->num_saved > RECORD_MAX_PAGES)
+        free_checkpoint(r, &r->checkpoints[drop++]);
+    if (drop) {
+        r->num_checkpoints -= drop;
+        memmove(r->checkpoints, r->checkpoints + drop, r->num_checkpoints * sizeof(Checkpoint));
+    }
+
+    if (r->num_checkpoints==r->max_checkpoints) {
+        r->max_checkpoints = r->max_checkpoints ? 2*r->max_checkpoints : 64;
+        r->checkpoints = realloc(r->checkpoints, r->max_checkpoints * sizeof(Checkpoint));
+        if (r->checkpoints==0)
+            fatal("Out of memory");
+    }
+    Checkpoint* c = &r->checkpoints[r->num_checkpoints++];
+    memset(c, 0, sizeof(Checkpoint));
+    c->time = machine_time(m);
+    get_cpu_state(m, &c->cpu);
+    get_device_state(m, &c->devices);
+    c->serial = ++r->serial;
+    schedule_event(m, c->time + r->interval, checkpoint_event, r);
+}
+
+static void checkpoint_event(F32Machine* m, void* ctx) {
+    (void)ctx;
+    take_checkpoint(m);
+}
+
+// Put memory and the CPU back as they were at checkpoint n, discarding the later checkpoints.
+// Only called between runs.
+static void restore_checkpoint(F32Machine* m, int n) {
+    Record* r = m->record;
+    m->record = 0;      // So invalidate_code_range() doesn't save the pages being put back
+    for (int i=r->num_checkpoints-1; i>=n; i--) {
+        Checkpoint* c = &r->checkpoints[i];
+        for (int j=0; j<c->num_pages; j++) {
+            SavedPage* s = &c->pages[j];
+            unsigned int addr = (unsigned int)s->page << MEM_PAGE_BITS;
+            invalidate_code_range(m, addr, MEM_PAGE_SIZE);
+            if (s->data)
+                memcpy(m->mem_pages[s->page], s->data, MEM_PAGE_SIZE);
+            else {
+                free(m->mem_pages[s->page]);
+                m->mem_pages[s->page] = 0;
+                m->fast_pages[s->page] = 0;
+            }
+        }
+        for (int j=c->num_sectors-1; j>=0; j--) {
+            SavedSectors* s = &c->sectors[j];
+            memcpy(disk_sectors(m->disk, s->sector), s->data, s->count*DISK_SECTOR_SIZE);
+        }
+        if (i > n)
+            free_checkpoint(r, c);
+    }
+    r->num_checkpoints = n+1;
+    m->record = r;
+
+    // Memory is now as it was at the checkpoint, so its pages have to be saved again
+    Checkpoint* c = &r->checkpoints[n];
+    free_checkpoint(r, c);
+    c->pages = 0;
+    c->num_pages = c->max_pages = 0;
+    c->sectors = 0;
+    c->num_sectors = 0;
+    c->serial = ++r->serial;
+
+    m->instr_count = c->time;
+    set_cpu_state(m, &c->cpu);
+    set_device_state(m, &c->devices);
+    schedule_event(m, c->time + r->interval, checkpoint_event, r);
+}
+
+// ================================================
+//                  replay
+// ================================================
+// Run quietly up to time end. Breakpoints and watchpoints don't stop it, but the last one met
+// before end is returned in *hit. Returns 0 if the program stopped short of end.
+
+static int replay(F32Machine* m, long long end, Hit* hit) {
+    FILE* uart_log = m->uart_log;
+    FILE* reg_log = m->reg_log;
+    FILE* mem_log = m->mem_log;
+    FILE* trace_file = m->trace_file;
+    Trace* trace = m->trace;
+    m->uart_log = m->reg_log = m->mem_log = m->trace_file = 0;
+    m->trace = 0;
+    m->replaying = 1;
+
+    // f32_run() doesn't stop at a breakpoint it starts at
+    if (hit && m->instr_count < end && breakpoint_here(m, 1)) {
+        hit->time = m->instr_count;
+        hit->result = F32_BREAKPOINT;
+    }
+
+    int result = F32_RUNNING;
+    while (m->instr_count < end) {
+        long long left = end - m->instr_count;
+        result = f32_run(m, left > 0x40000000 ? 0x40000000 : (int)left);
+        if (result==F32_BREAKPOINT || result==F32_WATCHPOINT) {
+            if (hit && m->instr_count < end) {
+                hit->time = m->instr_count;
+                hit->result = result;
+                hit->kind = f32_watch_hit(m, &hit->addr);
+            }
+        } else if (result!=F32_RUNNING && result!=F32_SYNC)
+            break;
+    }
+
+    m->replaying = 0;
+    m->uart_log = uart_log;
+    m->reg_log = reg_log;
+    m->mem_log = mem_log;
+    m->trace_file = trace_file;
+    m->trace = trace;
+    return m->instr_count==end;
+}
+
+// ================================================
+//                  f32_record
+// ================================================
+
+void f32_record(F32Machine* m, int interval) {
+    Record* r = m->record;
+    if (r) {
+        cancel_event(m, checkpoint_event, r);
+        for (int i=0; i<r->num_checkpoints; i++)
+            free_checkpoint(r, &r->checkpoints[i]);
+        free(r->checkpoints);
+        free(r);
+        m->record = 0;
+    }
+    if (interval <= 0)
+        return;
+    r = m->record = my_malloc(sizeof(Record));
+    r->interval = interval;
+    take_checkpoint(m);
+}
+
+void record_destroy(F32Machine* m) {
+    f32_record(m, 0);
+}
+
+// ================================================
+//                  f32_goto
+// ================================================
+
+int f32_goto(F32Machine* m, long long instr) {
+    Record* r = m->record;
+    if (r==0 || instr < r->checkpoints[0].time)
+        return 0;
+    if (instr < m->instr_count) {
+        int n = r->num_checkpoints-1;
+        while (r->checkpoints[n].time > instr)
+            n--;
+        restore_checkpoint(m, n);
+    }
+    return replay(m, instr, 0);
+}
+
+// ================================================
+//                  f32_reverse_continue
+// ================================================
+// Search back a checkpoint at a time, replaying each stretch to find the last stop in it
+
+int f32_reverse_continue(F32Machine* m) {
+    Record* r = m->record;
+    if (r==0)
+        return F32_HISTORY_START;
+    long long end = m->instr_count;
+    for (int n=r->num_checkpoints-1; n>=0; n--) {
+        long long start = r->checkpoints[n].time;
+        if (start >= end)
+            continue;
+        Hit hit = {-1, 0, 0, 0};
+        restore_checkpoint(m, n);
+        replay(m, end, &hit);
+        if (hit.time >= 0) {
+            f32_goto(m, hit.time);
+            m->watch_addr = hit.addr;
+            m->watch_kind = hit.kind;
+            return hit.result;
+        }
+        end = start;
+    }
+    f32_goto(m, r->checkpoints[0].time);
+    return F32_HISTORY_START;
+}
@@ -0,0 +1,474 @@
+// ----------------------------------------------------
+//               simulator internals
+// ----------------------------------------------------
+// Definitions shared between the parts of the simulator library (execute.c, jit.c and
+// snapshot.c) and the f32sim command line tool.
+
+#include "libf32sim.h"
+
+#define STATUS_SUPERVISOR 0x00000001
+#define STATUS_INTERRUPT  0x00000002
+
+// The architectural state of the CPU, apart from memory
+typedef struct CpuState {
+    int reg[32];
+    unsigned int pc;
+    int epc, ecause, edata, estatus, escratch, status;
+    int ipc, icause, istatus, intvec, int_timer;
+    int dmpu[8];
+    int blit1, blit2;       // Blitter argument latches
+} CpuState;
+
+void get_cpu_state(F32Machine* m, CpuState* state);
+void set_cpu_state(F32Machine* m, const CpuState* state);
+
+// ----------------------------------------------------
+//                  guest memory
+// ----------------------------------------------------
+// The 64MB of SDRAM is held as 4kB pages, allocated the first time they are written.
+// Untouched pages read as 0xBAADF00D.
+
+#define MEM_SIZE       0x4000000
+#define MEM_PAGE_BITS  12
+#define MEM_PAGE_SIZE  (1<<MEM_PAGE_BITS)
+#define MEM_NUM_PAGES  (MEM_SIZE >> MEM_PAGE_BITS)
+#define MEM_UNTOUCHED  0xBAADF00D
+#define ROM_BASE       0xFFFF0000
+#define ROM_SIZE       0x10000
+
+int* alloc_mem_page(F32Machine* m, unsigned int addr);
+
+// ----------------------------------------------------
+//                  watch.c
+// ----------------------------------------------------
+
+#define MAX_WATCHES 32
+
+typedef struct Watch {
+    unsigned int addr, last;    // First and last byte watched
+    int flags;                  // F32_WATCH_xxx
+} Watch;
+
+int page_watched(F32Machine* m, int page);
+void check_watch(F32Machine* m, unsigned int addr, int len, int value, int kind);
+int watch_exec(F32Machine* m, int can_stop);
+
+// ----------------------------------------------------
+//                  devices
+// ----------------------------------------------------
+// The hardware registers, see devices.c
+
+#define MMIO_BASE      0xE0000000
+#define MMIO_SIZE      0x10000
+#define MAX_DEVICES    64
+
+typedef struct Device {
+    F32MmioRead  read;
+    F32MmioWrite write;
+    void* ctx;
+    int steady;             // Reads have no side effects, and only change at device_next_event()
+} Device;
+
+int device_read(F32Machine* m, unsigned int addr);
+void device_write(F32Machine* m, unsigned int addr, int value, int mask);
+void device_output(F32Machine* m, string fmt, ...);
+int add_device(F32Machine* m, unsigned int base, unsigned int size, F32MmioRead read, F32MmioWrite write, void* ctx, int steady);
+void add_builtin_devices(F32Machine* m);
+long long device_next_event(F32Machine* m);
+void invalidate_code_range(F32Machine* m, unsigned int addr, int len);
+void raise_interrupt(F32Machine* m, int cause);     // Devices raise interrupts from event handlers
+
+// ----------------------------------------------------
+//                  events.c
+// ----------------------------------------------------
+
+#define MAX_EVENTS 32
+
+typedef void (*EventHandler)(F32Machine* m, void* ctx);
+
+typedef struct Event {
+    long long time;         // machine_time() the event is due
+    EventHandler handler;
+    void* ctx;
+} Event;
+
+void schedule_event(F32Machine* m, long long time, EventHandler handler, void* ctx);
+void cancel_event(F32Machine* m, EventHandler handler, void* ctx);
+void run_events(F32Machine* m);
+
+// ----------------------------------------------------
+//                  translated code
+// ----------------------------------------------------
+// Code is translated a basic block at a time into arrays of micro-ops, each specialized on
+// its operation and operand kinds.
+
+enum {
+    OP_END, OP_NOP, OP_LDI,
+    OP_AND, OP_OR, OP_XOR, OP_LSL, OP_LSR, OP_ASR, OP_ADD, OP_SUB, OP_CLT, OP_CLTU,
+    OP_ANDI, OP_ORI, OP_XORI, OP_LSLI, OP_LSRI, OP_ASRI, OP_ADDI, OP_SUBI, OP_CLTI, OP_CLTUI,
+    OP_MUL, OP_DIVU, OP_DIVS, OP_MODU, OP_MODS,
+    OP_MULI, OP_DIVUI, OP_DIVSI, OP_MODUI, OP_MODSI,
+    OP_LDB, OP_LDH, OP_LDW, OP_LDX,
+    OP_STB, OP_STH, OP_STW, OP_STX,
+    OP_IDX1, OP_IDX2, OP_IDX4, OP_IDXX,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU, OP_BRA,
+    OP_JMP, OP_JMPR,
+    OP_CFGR, OP_CFGW, OP_RTE, OP_RTI, OP_SYS, OP_CFGX,
+    OP_ILLEGAL,
+    NUM_OPS
+};
+
+typedef struct MicroOp MicroOp;
+typedef struct Block Block;
+typedef struct CodePage CodePage;
+typedef struct Jit Jit;
+typedef struct Profile Profile;
+typedef struct Timing Timing;
+typedef struct Cache Cache;
+typedef struct Trace Trace;
+typedef struct Blitter Blitter;
+typedef struct Vga Vga;
+typedef struct Record Record;
+typedef struct Uart Uart;
+typedef struct Disk Disk;
+typedef int (*NativeCode)(void);  // Returns the op to resume interpreting at, or -1 when the block is done
+
+struct MicroOp {
+    void* handler;          // Address of the handler for this op in run_block()
+    unsigned char kind;     // OP_xxx
+    unsigned char d, a, b;  // Register numbers
+    unsigned char i;        // Size field of loads and stores
+    int imm;                // Immediate operand, branch target or constant result
+    unsigned int pc;        // Address of the following instruction
+};
+
+struct Block {
+    Block* next;            // Link in the list of retired blocks
+    int num_instr;          // Number of instructions in the block
+    int exec_count;         // Number of times the block has been run, until it gets compiled
+    NativeCode native;      // Compiled code for the block, or NULL
+    int poll_loop;          // Branches back to its own start without storing anything - see skip_idle()
+    MicroOp ops[];          // One op per instruction, followed by an OP_END
+};
+
+#define CODE_PAGE_BITS   10
+#define CODE_PAGE_SIZE   (1<<CODE_PAGE_BITS)
+#define CODE_SDRAM_PAGES (0x4000000 >> (CODE_PAGE_BITS+2))
+#define CODE_ROM_PAGES   (0x10000 >> (CODE_PAGE_BITS+2))
+#define MAX_BLOCK_INSTR  64
+
+struct CodePage {
+    Block*       blocks[CODE_PAGE_SIZE];      // Translated block starting at each word
+    unsigned int code_map[CODE_PAGE_SIZE/32]; // Bit set for each word covered by a block
+    unsigned int break_map[CODE_PAGE_SIZE/32];// Bit set for each word with a breakpoint
+    int          flush_count;                 // Number of times self modifying code flushed the page
+};
+
+// Index of the code page holding addr, or -1 if there can't be code there
+static inline int code_page_index(unsigned int addr) {
+    if (addr < 0x4000000)
+        return addr >> (CODE_PAGE_BITS+2);
+    else if (addr>=0xffff0000)
+        return CODE_SDRAM_PAGES + ((addr & 0xffff) >> (CODE_PAGE_BITS+2));
+    else
+        return -1;
+}
+
+// Address of the first word in a code page
+static inline unsigned int code_page_address(int index) {
+    if (index < CODE_SDRAM_PAGES)
+        return index << (CODE_PAGE_BITS+2);
+    return ROM_BASE + ((index - CODE_SDRAM_PAGES) << (CODE_PAGE_BITS+2));
+}
+
+// ----------------------------------------------------
+//                  F32Machine
+// ----------------------------------------------------
+
+struct F32Machine {
+    int reg[32];                // The CPU registers
+    unsigned int pc;            // The program counter
+    int status;
+    int epc, ecause, edata, estatus, escratch;
+    int ipc, icause, istatus, intvec;
+    long long timer_due;        // machine_time() of the timer interrupt, see set_timer()
+    int dmpu[8];                // The data memory protection registers
+    int exception;
+    int blit1, blit2;
+
+    int* prog_mem;                      // The 64kB boot rom
+    int* mem_pages[MEM_NUM_PAGES];      // SDRAM pages, or NULL until written
+    int* fast_pages[MEM_NUM_PAGES];     // mem_pages without the watched pages, see watch.c
+
+    CodePage* code_pages[CODE_SDRAM_PAGES + CODE_ROM_PAGES];
+    Block* retired_blocks;      // Flushed blocks, freed once we are no longer running them
+    Block* step_block;          // Scratch block for the single step interpreter
+    void** op_handlers;         // Handler addresses in run_block(), indexed by OP_xxx
+    int end_block;              // Set when a store means the rest of the block must not run
+    Jit* jit;
+    Profile* profile;           // Instruction counts, when F32_PROFILE or F32_CALLGRAPH is set
+    Timing* timing;             // Cycle counts, when F32_TIMING is set
+    Cache* caches;              // Cache configurations being simulated
+
+    int options;                // F32_ABORT_ON_EXCEPTION, F32_USE_JIT
+    int stop;                   // Set to an F32_xxx result to make f32_run() return early
+    int timeout;                // Instructions left in the current f32_run()
+    int counted_timeout;        // timeout when instr_count was last brought up to date
+    long long instr_count;
+    long long idle_instrs;      // Instructions skipped by F32_SKIP_IDLE
+    int device_effect;          // Set by device reads with side effects
+
+    FILE* uart_input;
+    FILE* uart_log;
+    FILE* reg_log;
+    FILE* mem_log;
+    FILE* trace_file;
+    Trace* trace;               // Binary trace, see trace.c
+
+    Uart* uart;
+    Blitter* blitter;
+    Vga* vga;
+    Disk* disk;
+
+    Event events[MAX_EVENTS];   // Heap of pending events, see events.c
+    int num_events;
+    long long next_event;       // Time of the first event, or LLONG_MAX
+
+    Record* record;             // Checkpoints, when recording with f32_record()
+    int replaying;              // Set while record.c runs forward again, to keep it quiet
+
+    Watch watches[MAX_WATCHES];
+    int num_watches;
+    unsigned int watch_addr;    // The access that stopped f32_run() with F32_WATCHPOINT
+    int watch_kind;
+
+    Device devices[MAX_DEVICES];
+    int num_devices;
+    unsigned char device_map[MMIO_SIZE/4];  // Index+1 in devices of the device at each word, or 0
+
+    F32MmioRead  mmio_read;
+    F32MmioWrite mmio_write;
+    void* mmio_ctx;
+    F32Output output;
+    void* output_ctx;
+};
+
+// Instructions executed so far, including those of the current f32_run() up to the end of
+// the block being run. Devices use this as the time.
+static inline long long machine_time(F32Machine* m) {
+    return m->instr_count + m->counted_timeout - m->timeout;
+}
+
+// Read a word of SDRAM
+static inline int mem_read(F32Machine* m, unsigned int addr) {
+    int* page = m->mem_pages[addr >> MEM_PAGE_BITS];
+    return page ? page[(addr & (MEM_PAGE_SIZE-1)) >> 2] : (int)MEM_UNTOUCHED;
+}
+
+// Get a pointer to a word of SDRAM, allocating its page if needed
+static inline int* mem_ptr(F32Machine* m, unsigned int addr) {
+    int* page = m->mem_pages[addr >> MEM_PAGE_BITS];
+    if (page==0)
+        page = alloc_mem_page(m, addr);
+    return &page[(addr & (MEM_PAGE_SIZE-1)) >> 2];
+}
+
+// ----------------------------------------------------
+//                        jit.c
+// ----------------------------------------------------
+
+#define JIT_THRESHOLD 50    // Number of runs before a block gets compiled
+
+Jit* jit_create(F32Machine* m);
+void jit_destroy(Jit* jit);
+NativeCode jit_compile(Jit* jit, Block* block);
+
+// ----------------------------------------------------
+//                        profile.c
+// ----------------------------------------------------
+
+typedef struct ProfileLabel {
+    unsigned int addr;
+    string name;
+    long long count;
+} ProfileLabel;
+
+void profile_block(F32Machine* m, Block* block, int executed);
+void profile_exception(F32Machine* m);
+void profile_interrupt(F32Machine* m);
+void profile_destroy(Profile* profile);
+ProfileLabel* sort_labels(int* num_labels);
+ProfileLabel* enclosing_function(ProfileLabel* labels, int num_labels, unsigned int addr);
+
+// ----------------------------------------------------
+//                        timing.c
+// ----------------------------------------------------
+
+void timing_block(F32Machine* m, Block* block, int executed);
+void timing_data(F32Machine* m, unsigned int addr, int write);
+void timing_destroy(Timing* timing);
+
+// ----------------------------------------------------
+//                        cache.c
+// ----------------------------------------------------
+
+void cache_block(F32Machine* m, Block* block, int executed);
+void cache_data(F32Machine* m, unsigned int addr, int write);
+void cache_destroy(Cache* caches);
+
+// ----------------------------------------------------
+//                        uart.c
+// ----------------------------------------------------
+
+#define UART_RX_SIZE 1024
+
+typedef struct UartState {
+    int rx[UART_RX_SIZE];       // Bytes received that the program hasn't read yet
+    int rx_head, rx_count;
+    long input_pos;             // Position in the input file, or -1 to leave it alone
+} UartState;
+
+Uart* uart_create(F32Machine* m);
+void uart_destroy(F32Machine* m);
+void uart_flush(F32Machine* m);
+void uart_new_input(F32Machine* m);
+void uart_get_state(Uart* u, UartState* state);
+void uart_set_state(Uart* u, const UartState* state);
+
+// ----------------------------------------------------
+//                        blitter.c
+// ----------------------------------------------------
+
+#define BLIT_BASE      0xE0002000
+#define BLIT_FIFO_SIZE 256      // The command being run, plus 255 waiting
+
+typedef struct BlitterState {
+    int regs[4];                        // BLIT_CMD and the three arguments
+    int fifo[BLIT_FIFO_SIZE][4];
+    int head, count;
+    long long head_left;                // Clocks until the first command in the fifo finishes
+    int overflow;
+    unsigned int dest_addr;
+    int dest_bpl, dest_ox, dest_oy;
+    int clip_x1, clip_y1, clip_x2, clip_y2;
+    unsigned int src_addr;
+    int src_bpl, src_ox, src_oy;
+    unsigned int font_addr;
+    int font_width, font_height, font_bpc, font_offset;
+} BlitterState;
+
+Blitter* blitter_create(F32Machine* m);
+void blitter_destroy(Blitter* b);
+void blitter_update(F32Machine* m);
+void blitter_get_state(Blitter* b, BlitterState* state);
+void blitter_set_state(Blitter* b, const BlitterState* state);
+
+// ----------------------------------------------------
+//                        vga.c
+// ----------------------------------------------------
+
+#define VGA_LAYER_BASE 0xE0001000
+#define VGA_LAYERS     8
+
+typedef struct Layer {
+    unsigned int addr;                  // Address of pixel (x1,y1)
+    int x1, y1, x2, y2;                 // The layer covers x1<=x<x2, y1<=y<y2
+    int bpl, bpp;                       // Bytes per line and per pixel
+} Layer;
+
+Vga* vga_create(F32Machine* m);
+void vga_destroy(Vga* v);
+long long vga_next_row(F32Machine* m);
+void vga_get_state(Vga* v, Layer* layers);
+void vga_set_state(Vga* v, const Layer* layers);
+
+// ----------------------------------------------------
+//                        disk.c
+// ----------------------------------------------------
+
+#define DISK_BASE        0xE0003000
+#define DISK_SECTOR_SIZE 1024
+
+typedef struct DiskState {
+    int sector;
+    unsigned int addr;
+    int count;
+    int command;                // Command in progress, or 0
+    int error;
+    long long left;             // Clocks until the command finishes
+} DiskState;
+
+Disk* disk_create(F32Machine* m);
+void disk_destroy(Disk* d);
+void disk_private(Disk* d);
+unsigned char* disk_sectors(Disk* d, int sector);
+void disk_get_state(Disk* d, DiskState* state);
+void disk_set_state(Disk* d, const DiskState* state);
+
+// ----------------------------------------------------
+//                  device state
+// ----------------------------------------------------
+// What a program can see of the built in devices, for snapshots and record.c's checkpoints.
+// Times are relative to machine_time(). Statistics and options aren't included.
+
+typedef struct DeviceState {
+    UartState uart;
+    BlitterState blitter;
+    Layer layers[VGA_LAYERS];
+    DiskState disk;
+} DeviceState;
+
+void get_device_state(F32Machine* m, DeviceState* state);
+void set_device_state(F32Machine* m, const DeviceState* state);
+
+// ----------------------------------------------------
+//                        record.c
+// ----------------------------------------------------
+
+void record_write(F32Machine* m, unsigned int addr);
+void record_disk_write(F32Machine* m, int sector, int count);
+void record_destroy(F32Machine* m);
+int breakpoint_here(F32Machine* m, int can_stop);
+
+// ----------------------------------------------------
+//                        trace.c
+// ----------------------------------------------------
+// The binary trace file starts with TRACE_MAGIC and the starting pc, then holds chunks of
+// records. Each chunk has its length, its stored length and then the data, which is
+// compressed if the two lengths differ. Values are little endian. The records are:
+
+#define TR_INSTR          1   // Instruction at the expected address - the previous one +4, or the jump target
+#define TR_INSTR_WORD     2   // + instruction word
+#define TR_INSTR_PC       3   // + address
+#define TR_INSTR_PC_WORD  4   // + address, instruction word
+#define TR_REG            5   // + register number (1 byte), value
+#define TR_MEM            6   // + address, value
+#define TR_JUMP           7   // + target address
+#define TR_EXCEPTION      8   // + cause (1 byte), value
+#define TR_INTERRUPT      9   // + cause (1 byte)
+
+#define TRACE_MAGIC       0x54323346    // "F32T"
+#define TRACE_CHUNK_SIZE  0x100000
+
+void trace_write_instr(F32Machine* m, unsigned int pc, int instr);
+void trace_write_reg(F32Machine* m, int reg_num, int value);
+void trace_write_mem(F32Machine* m, unsigned int addr, int value);
+void trace_write_jump(F32Machine* m, unsigned int target);
+void trace_write_exception(F32Machine* m, int cause, int value);
+void trace_write_interrupt(F32Machine* m, int cause);
+void trace_invalidate(F32Machine* m, unsigned int addr);
+int trace_decompress(const unsigned char* in, int n, unsigned char* out, int max);
+
+// ----------------------------------------------------
+//                  f32sim.c, batch.c and gdb.c
+// ----------------------------------------------------
+
+#define BATCH_TIMEOUT 2         // Exit status of a batch case that ran out of instructions
+
+extern string batch_file;       // Manifest of cases to fork at the sync point
+extern int batch_jobs;          // Maximum number of cases to run at once
+extern int batch_child;         // Set in the forked process running a case
+
+void open_logs(F32Machine* m, FILE* uart_input);
+void run_batch(F32Machine* m);
+int gdb_serve(F32Machine* m, string port, long long max_instrs);
@@ -0,0 +1,149 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  snapshot file format
+// ================================================
+// A snapshot holds the CPU and device state plus every page of memory the program has
+// touched. The files the devices use - the uart input and the disk image - aren't included.
+//
+//    SnapshotHeader
+//    unsigned int page_addr[num_pages]     guest address of each page that follows
+//    padding up to the next 4kB boundary
+//    num_pages * 4kB of page contents
+//
+// The page contents are 4kB aligned in the file, so a loader can map them directly
+// rather than copying. All values are in host (little endian) byte order.
+
+#define SNAPSHOT_MAGIC   0x53323346     // "F32S"
+#define SNAPSHOT_VERSION 2
+#define ROM_PAGES        (ROM_SIZE >> MEM_PAGE_BITS)
+
+typedef struct SnapshotHeader {
+    unsigned int magic;
+    int version;
+    int page_size;
+    int num_pages;
+    CpuState cpu;
+    DeviceState devices;
+} SnapshotHeader;
+
+// Does a page of the boot rom hold anything other than zeros?
+static int rom_page_used(F32Machine* m, int page) {
+    int* p = &m->prog_mem[page * (MEM_PAGE_SIZE/4)];
+    for (int i=0; i<MEM_PAGE_SIZE/4; i++)
+        if (p[i])
+            return 1;
+    return 0;
+}
+
+static int* page_data(F32Machine* m, unsigned int addr) {
+    if (addr >= ROM_BASE)
+        return &m->prog_mem[(addr - ROM_BASE) >> 2];
+    return m->mem_pages[addr >> MEM_PAGE_BITS];
+}
+
+// ================================================
+//                  save_snapshot
+// ================================================
+
+void f32_save_snapshot(F32Machine* m, string filename) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL)
+        fatal("Can't open snapshot file '%s'", filename);
+
+    // Collect the pages to write - SDRAM pages are only allocated once written
+    unsigned int* page_addr = my_malloc((MEM_NUM_PAGES + ROM_PAGES) * sizeof(unsigned int));
+    int num_pages = 0;
+    for (int i=0; i<MEM_NUM_PAGES; i++)
+        if (m->mem_pages[i])
+            page_addr[num_pages++] = i << MEM_PAGE_BITS;
+    for (int i=0; i<ROM_PAGES; i++)
+        if (rom_page_used(m, i))
+            page_addr[num_pages++] = ROM_BASE + (i << MEM_PAGE_BITS);
+
+    SnapshotHeader header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.page_size = MEM_PAGE_SIZE;
+    header.num_pages = num_pages;
+    get_cpu_state(m, &header.cpu);
+    get_device_state(m, &header.devices);
+    header.devices.uart.input_pos = -1;     // The loader reads its own uart input
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(page_addr, sizeof(unsigned int), num_pages, file);
+
+    long pos = ftell(file);
+    static char padding[MEM_PAGE_SIZE];
+    fwrite(padding, 1, (MEM_PAGE_SIZE - pos % MEM_PAGE_SIZE) % MEM_PAGE_SIZE, file);
+
+    for (int i=0; i<num_pages; i++)
+        fwrite(page_data(m, page_addr[i]), 1, MEM_PAGE_SIZE, file);
+
+    if (ferror(file))
+        fatal("Error writing snapshot file '%s'", filename);
+    fclose(file);
+    free(page_addr);
+    printf("Saved snapshot '%s' at pc=%08x (%d pages)\n", filename, header.cpu.pc, num_pages);
+}
+
+// ================================================
+//                  load_snapshot
+// ================================================
+// Must be called on a newly created machine, while memory and the code cache are still empty.
+
+void f32_load_snapshot(F32Machine* m, string filename) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        fatal("Can't open snapshot file '%s'", filename);
+
+    // Check the version before reading the rest, as the header has grown with each version
+    SnapshotHeader header;
+    size_t start = offsetof(SnapshotHeader, page_size);
+    if (fread(&header, start, 1, file) != 1 || header.magic != SNAPSHOT_MAGIC)
+        fatal("'%s' is not a snapshot file", filename);
+    if (header.version != SNAPSHOT_VERSION)
+        fatal("Snapshot file '%s' has an unsupported version", filename);
+    if (fread((char*)&header + start, sizeof(header) - start, 1, file) != 1)
+        fatal("Snapshot file '%s' is truncated", filename);
+    if (header.page_size != MEM_PAGE_SIZE)
+        fatal("Snapshot file '%s' has an unsupported version", filename);
+    DeviceState* d = &header.devices;
+    if (header.num_pages < 0 || header.num_pages > MEM_NUM_PAGES + ROM_PAGES
+        || d->uart.rx_count < 0 || d->uart.rx_count > UART_RX_SIZE || d->uart.rx_head < 0
+        || d->blitter.count < 0 || d->blitter.count > BLIT_FIFO_SIZE || d->blitter.head < 0)
+        fatal("Snapshot file '%s' is corrupt", filename);
+
+    unsigned int* page_addr = my_malloc(header.num_pages * sizeof(unsigned int) + 1);
+    if (fread(page_addr, sizeof(unsigned int), header.num_pages, file) != (size_t)header.num_pages)
+        fatal("Snapshot file '%s' is truncated", filename);
+
+    long pos = ftell(file);
+    fseek(file, (pos + MEM_PAGE_SIZE - 1) & ~(long)(MEM_PAGE_SIZE-1), SEEK_SET);
+
+    for (int i=0; i<header.num_pages; i++) {
+        unsigned int addr = page_addr[i];
+        int* page;
+        if (addr & (MEM_PAGE_SIZE-1))
+            fatal("Snapshot file '%s' is corrupt", filename);
+        if (addr >= ROM_BASE)
+            page = &m->prog_mem[(addr - ROM_BASE) >> 2];
+        else if (addr < MEM_SIZE)
+            page = m->mem_pages[addr >> MEM_PAGE_BITS] ? m->mem_pages[addr >> MEM_PAGE_BITS] : alloc_mem_page(m, addr);
+        else
+            fatal("Snapshot file '%s' is corrupt", filename);
+        if (fread(page, 1, MEM_PAGE_SIZE, file) != MEM_PAGE_SIZE)
+            fatal("Snapshot file '%s' is truncated", filename);
+    }
+
+    set_cpu_state(m, &header.cpu);
+    set_device_state(m, &header.devices);
+    fclose(file);
+    free(page_addr);
+}
@@ -0,0 +1,211 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  timing model
+// ================================================
+// With F32_TIMING set, f32_run() estimates the number of clock cycles the RTL CPU would take.
+// Every instruction takes one cycle, plus:-
+//
+//   - Instruction fetches from SDRAM go through a model of the icache in cpu_icache.sv: 16kB
+//     direct mapped, 256 lines of 64 bytes. A miss costs the SDRAM latency. Fetches from the
+//     boot rom (the iram) always take one cycle.
+//   - The dcache (cpu_dcache.sv) is a pass-through, so every SDRAM read costs the SDRAM
+//     latency. Writes are acknowledged immediately.
+//   - Divides and modulos wait for the divider (cpu_divider.sv).
+//   - Taken branches and jumps flush the instructions fetched behind them, as the jump is
+//     only resolved in the fourth pipeline stage.
+//
+// Cycles are counted against the address of the instruction that caused them.
+
+#define ICACHE_LINES      256
+#define ICACHE_LINE_BITS  6
+
+typedef struct TimingPage {
+    long long count[CODE_PAGE_SIZE];        // Times each instruction was executed
+    long long cycles[CODE_PAGE_SIZE];       // Cycles spent on each instruction
+    long long fetches[CODE_PAGE_SIZE];      // Times each instruction was fetched through the icache
+    long long misses[CODE_PAGE_SIZE];       // Times it missed the icache
+} TimingPage;
+
+struct Timing {
+    int sdram_latency;
+    int div_latency;
+    int branch_penalty;
+
+    unsigned int icache_tag[ICACHE_LINES];  // Address bits 25:14 of the line held
+    unsigned char icache_valid[ICACHE_LINES];
+
+    long long cycles;
+    long long instrs;
+    TimingPage* pages[CODE_SDRAM_PAGES + CODE_ROM_PAGES];
+};
+
+static Timing* get_timing(F32Machine* m) {
+    if (m->timing==0) {
+        m->timing = my_malloc(sizeof(Timing));
+        m->timing->sdram_latency = F32_SDRAM_LATENCY;
+        m->timing->div_latency = F32_DIV_LATENCY;
+        m->timing->branch_penalty = F32_BRANCH_PENALTY;
+    }
+    return m->timing;
+}
+
+static TimingPage* timing_page(Timing* t, unsigned int addr) {
+    int index = code_page_index(addr);
+    if (index<0)
+        return 0;
+    if (t->pages[index]==0)
+        t->pages[index] = my_malloc(sizeof(TimingPage));
+    return t->pages[index];
+}
+
+static void add_cycles(Timing* t, unsigned int addr, int cycles) {
+    TimingPage* tp = timing_page(t, addr);
+    if (tp)
+        tp->cycles[(addr>>2) & (CODE_PAGE_SIZE-1)] += cycles;
+    t->cycles += cycles;
+}
+
+void f32_set_latencies(F32Machine* m, int sdram_latency, int div_latency, int branch_penalty) {
+    Timing* t = get_timing(m);
+    t->sdram_latency = sdram_latency;
+    t->div_latency = div_latency;
+    t->branch_penalty = branch_penalty;
+}
+
+void timing_destroy(Timing* timing) {
+    for (int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++)
+        free(timing->pages[i]);
+    free(timing);
+}
+
+// ================================================
+//                  timing_block
+// ================================================
+// Called after running the first `executed` instructions of a block
+
+void timing_block(F32Machine* m, Block* block, int executed) {
+    Timing* t = get_timing(m);
+    t->instrs += executed;
+
+    for (int i=0; i<executed; i++) {
+        MicroOp* op = &block->ops[i];
+        unsigned int addr = op->pc - 4;
+        TimingPage* tp = timing_page(t, addr);
+        int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+        int cycles = 1;
+        if (tp)
+            tp->count[w]++;
+
+        if (addr < MEM_SIZE) {
+            int line = (addr >> ICACHE_LINE_BITS) & (ICACHE_LINES-1);
+            unsigned int tag = addr >> 14;
+            tp->fetches[w]++;
+            if (!t->icache_valid[line] || t->icache_tag[line]!=tag) {
+                tp->misses[w]++;
+                t->icache_valid[line] = 1;
+                t->icache_tag[line] = tag;
+                cycles += t->sdram_latency;
+            }
+        }
+
+        if ((op->kind>=OP_DIVU && op->kind<=OP_MODS) || (op->kind>=OP_DIVUI && op->kind<=OP_MODSI))
+            cycles += t->div_latency;
+        add_cycles(t, addr, cycles);
+    }
+
+    // Anything that changes the flow of control comes at the end of a block
+    MicroOp* last = &block->ops[executed-1];
+    if (executed!=block->num_instr)
+        return;
+    if ((last->kind>=OP_BEQ && last->kind<=OP_JMPR && m->pc!=last->pc) || last->kind==OP_RTE || last->kind==OP_RTI)
+        add_cycles(t, last->pc-4, t->branch_penalty);
+}
+
+// ================================================
+//                  timing_data
+// ================================================
+// Called for every load and store, while m->pc is the address after the instruction
+
+void timing_data(F32Machine* m, unsigned int addr, int write) {
+    Timing* t = get_timing(m);
+    if (!write && addr < MEM_SIZE)
+        add_cycles(t, m->pc-4, t->sdram_latency);
+}
+
+// ================================================
+//                  f32_write_timing
+// ================================================
+
+typedef struct FunctionTiming {
+    string name;
+    long long instrs, cycles, fetches, misses;
+} FunctionTiming;
+
+static int compare_function_cycles(const void* a, const void* b) {
+    long long x = ((const FunctionTiming*)a)->cycles;
+    long long y = ((const FunctionTiming*)b)->cycles;
+    return (x<y) - (x>y);
+}
+
+static void write_timing_line(FILE* file, FunctionTiming* f) {
+    fprintf(file, "%12lld %12lld %6.2f %12lld ", f->cycles, f->instrs, f->instrs ? (double)f->cycles/f->instrs : 0, f->fetches);
+    if (f->fetches)
+        fprintf(file, "%11.2f%%  %s\n", 100.0 - 100.0*f->misses/f->fetches, f->name);
+    else
+        fprintf(file, "%12s  %s\n", "-", f->name);
+}
+
+void f32_write_timing(F32Machine* m, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (file==NULL)
+        fatal("Can't create '%s'", filename);
+
+    Timing* t = get_timing(m);
+    int num_labels;
+    ProfileLabel* labels = sort_labels(&num_labels);
+    FunctionTiming* funcs = my_malloc((num_labels+1) * sizeof(FunctionTiming));
+    for (int i=0; i<=num_labels; i++)
+        funcs[i].name = labels[i].name;
+    FunctionTiming all = {0};
+
+    for (int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++) {
+        TimingPage* tp = t->pages[i];
+        if (tp==0)
+            continue;
+        for (int w=0; w<CODE_PAGE_SIZE; w++) {
+            if (tp->cycles[w]==0)
+                continue;
+            FunctionTiming* f = &funcs[enclosing_function(labels, num_labels, code_page_address(i) + 4*w) - labels];
+            f->instrs += tp->count[w];
+            f->cycles += tp->cycles[w];
+            f->fetches += tp->fetches[w];
+            f->misses += tp->misses[w];
+            all.fetches += tp->fetches[w];
+            all.misses += tp->misses[w];
+        }
+    }
+
+    fprintf(file, "Timing model: sdram latency %d, divider latency %d, branch penalty %d\n\n",
+            t->sdram_latency, t->div_latency, t->branch_penalty);
+    fprintf(file, "Cycles       %lld\n", t->cycles);
+    fprintf(file, "Instructions %lld\n", t->instrs);
+    fprintf(file, "CPI          %.3f\n", t->instrs ? (double)t->cycles/t->instrs : 0);
+    fprintf(file, "Icache       %lld fetches, %lld misses", all.fetches, all.misses);
+    if (all.fetches)
+        fprintf(file, ", %.2f%% hit rate", 100.0 - 100.0*all.misses/all.fetches);
+    fprintf(file, "\n\n");
+
+    fprintf(file, "      cycles       instrs    CPI      fetches  icache hits  function\n");
+    qsort(funcs, num_labels+1, sizeof(FunctionTiming), compare_function_cycles);
+    for (int i=0; i<=num_labels && funcs[i].cycles; i++)
+        write_timing_line(file, &funcs[i]);
+    fclose(file);
+    free(funcs);
+    free(labels);
+}
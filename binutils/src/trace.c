@@ -0,0 +1,385 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  binary trace
+// ================================================
+// A compact alternative to the text trace (-t). Each instruction is written as a TR_INSTR
+// record, followed by records for its effects in the order the text trace would print them.
+// See sim.h for the records. The instruction word is only written the first time an address
+// is traced, or after the word there has been overwritten, so the decoder (f32trace) doesn't
+// need the program image.
+//
+// Records are collected in a ring of chunks. Without compression, each chunk is written out
+// as soon as it fills. With compression, a background thread compresses and writes the full
+// chunks while the simulation carries on filling the next one.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define TRACE_CHUNKS  4
+#define HASH_BITS     16
+
+struct Trace {
+    FILE* file;
+    int compress;
+    unsigned int expected_pc;               // Address the decoder will assume for the next instruction
+    unsigned int* seen[CODE_SDRAM_PAGES + CODE_ROM_PAGES];  // Bitmaps of words already written
+
+    unsigned char* chunks[TRACE_CHUNKS];
+    int length[TRACE_CHUNKS];
+    int full[TRACE_CHUNKS];                 // Waiting for the writer thread
+    int head, tail;                         // Chunk being filled, and next one to write
+    int done;
+
+    unsigned char* packed;                  // Used by the writer thread
+    int* hash;
+
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+    HANDLE thread;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+#endif
+};
+
+// ================================================
+//                  compression
+// ================================================
+// A simple LZ77 scheme. The output is a sequence of
+//    <literal count> <literals> <match length-4> <match offset>
+// ending after the last literals. Counts are varints, offsets are 16 bits.
+
+static int put_varint(unsigned char* out, int op, unsigned int n) {
+    while (n >= 0x80) {
+        out[op++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    out[op++] = n;
+    return op;
+}
+
+static int get_varint(const unsigned char* in, int* ip, int n) {
+    unsigned int value = 0;
+    for (int shift=0; *ip<n && shift<32; shift+=7) {
+        unsigned char c = in[(*ip)++];
+        value |= (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return value;
+    }
+    return -1;
+}
+
+static unsigned int read32(const unsigned char* p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned int)p[3]<<24);
+}
+
+static int compress_chunk(const unsigned char* in, int n, unsigned char* out, int* hash) {
+    memset(hash, 0, sizeof(int) << HASH_BITS);
+    int ip = 0, anchor = 0, op = 0;
+    while (ip+4 <= n) {
+        unsigned int v = read32(in+ip);
+        int h = (v * 2654435761u) >> (32-HASH_BITS);
+        int ref = hash[h] - 1;
+        hash[h] = ip + 1;
+        if (ref<0 || ip-ref>0xffff || read32(in+ref)!=v) {
+            ip++;
+            continue;
+        }
+
+        int len = 4;
+        while (ip+len<n && in[ref+len]==in[ip+len])
+            len++;
+        op = put_varint(out, op, ip-anchor);
+        memcpy(out+op, in+anchor, ip-anchor);
+        op += ip-anchor;
+        op = put_varint(out, op, len-4);
+        out[op++] = (ip-ref) & 0xff;
+        out[op++] = (ip-ref) >> 8;
+        ip += len;
+        anchor = ip;
+    }
+    op = put_varint(out, op, n-anchor);
+    memcpy(out+op, in+anchor, n-anchor);
+    return op + n-anchor;
+}
+
+// Returns the length of the decompressed data, or -1 if it is corrupt
+int trace_decompress(const unsigned char* in, int n, unsigned char* out, int max) {
+    int ip = 0, op = 0;
+    while (1) {
+        int lit = get_varint(in, &ip, n);
+        if (lit<0 || ip+lit>n || op+lit>max)
+            return -1;
+        memcpy(out+op, in+ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip>=n)
+            return op;
+
+        int len = get_varint(in, &ip, n);
+        if (len<0 || ip+2>n)
+            return -1;
+        len += 4;
+        int offset = in[ip] | (in[ip+1]<<8);
+        ip += 2;
+        if (offset==0 || offset>op || op+len>max)
+            return -1;
+        for (int i=0; i<len; i++, op++)
+            out[op] = out[op-offset];
+    }
+}
+
+// ================================================
+//                  writing chunks
+// ================================================
+
+static void put32(unsigned char* p, unsigned int v) {
+    p[0] = v;
+    p[1] = v>>8;
+    p[2] = v>>16;
+    p[3] = v>>24;
+}
+
+// A chunk is written as its length, its stored length, then the data. The stored length
+// equals the length if the data isn't compressed.
+static void write_chunk(Trace* t, unsigned char* data, int length) {
+    unsigned char header[8];
+    int stored = length;
+    if (t->compress) {
+        stored = compress_chunk(data, length, t->packed, t->hash);
+        if (stored < length)
+            data = t->packed;
+        else
+            stored = length;
+    }
+    put32(header, length);
+    put32(header+4, stored);
+    fwrite(header, 1, 8, t->file);
+    fwrite(data, 1, stored, t->file);
+}
+
+#ifdef _WIN32
+#define LOCK(t)     EnterCriticalSection(&t->lock)
+#define UNLOCK(t)   LeaveCriticalSection(&t->lock)
+#define WAIT(t)     SleepConditionVariableCS(&t->changed, &t->lock, INFINITE)
+#define SIGNAL(t)   WakeAllConditionVariable(&t->changed)
+#else
+#define LOCK(t)     pthread_mutex_lock(&t->lock)
+#define UNLOCK(t)   pthread_mutex_unlock(&t->lock)
+#define WAIT(t)     pthread_cond_wait(&t->changed, &t->lock)
+#define SIGNAL(t)   pthread_cond_broadcast(&t->changed)
+#endif
+
+#ifdef _WIN32
+static DWORD WINAPI writer_thread(void* arg) {
+#else
+static void* writer_thread(void* arg) {
+#endif
+    Trace* t = arg;
+    LOCK(t);
+    while (1) {
+        while (!t->full[t->tail] && !t->done)
+            WAIT(t);
+        if (!t->full[t->tail])
+            break;
+        UNLOCK(t);
+        write_chunk(t, t->chunks[t->tail], t->length[t->tail]);
+        LOCK(t);
+        t->full[t->tail] = 0;
+        t->length[t->tail] = 0;
+        t->tail = (t->tail+1) % TRACE_CHUNKS;
+        SIGNAL(t);
+    }
+    UNLOCK(t);
+    return 0;
+}
+
+// Pass the current chunk on to be written, and wait for the next one to be free
+static void submit_chunk(Trace* t) {
+    if (!t->compress) {
+        write_chunk(t, t->chunks[0], t->length[0]);
+        t->length[0] = 0;
+        return;
+    }
+    LOCK(t);
+    t->full[t->head] = 1;
+    t->head = (t->head+1) % TRACE_CHUNKS;
+    SIGNAL(t);
+    while (t->full[t->head])
+        WAIT(t);
+    UNLOCK(t);
+}
+
+// Make room for a record of up to n bytes
+static unsigned char* reserve(Trace* t, int n) {
+    if (t->length[t->head] + n > TRACE_CHUNK_SIZE)
+        submit_chunk(t);
+    unsigned char* p = t->chunks[t->head] + t->length[t->head];
+    t->length[t->head] += n;
+    return p;
+}
+
+// ================================================
+//                  f32_open_trace
+// ================================================
+
+int f32_open_trace(F32Machine* m, const char* filename, int compress) {
+    f32_close_trace(m);
+    FILE* file = fopen(filename, "wb");
+    if (file==NULL)
+        return 0;
+
+    Trace* t = my_malloc(sizeof(Trace));
+    t->file = file;
+    t->compress = compress;
+    t->expected_pc = m->pc;
+    for (int i=0; i<(compress ? TRACE_CHUNKS : 1); i++)
+        t->chunks[i] = my_malloc(TRACE_CHUNK_SIZE);
+
+    unsigned char header[8];
+    put32(header, TRACE_MAGIC);
+    put32(header+4, m->pc);
+    fwrite(header, 1, 8, file);
+
+    if (compress) {
+        t->packed = my_malloc(TRACE_CHUNK_SIZE + TRACE_CHUNK_SIZE/2 + 64);
+        t->hash = my_malloc(sizeof(int) << HASH_BITS);
+#ifdef _WIN32
+        InitializeCriticalSection(&t->lock);
+        InitializeConditionVariable(&t->changed);
+        t->thread = CreateThread(NULL, 0, writer_thread, t, 0, NULL);
+#else
+        pthread_mutex_init(&t->lock, NULL);
+        pthread_cond_init(&t->changed, NULL);
+        pthread_create(&t->thread, NULL, writer_thread, t);
+#endif
+    }
+    m->trace = t;
+    return 1;
+}
+
+void f32_close_trace(F32Machine* m) {
+    Trace* t = m->trace;
+    if (t==0)
+        return;
+
+    if (t->length[t->head])
+        submit_chunk(t);
+    if (t->compress) {
+        LOCK(t);
+        t->done = 1;
+        SIGNAL(t);
+        UNLOCK(t);
+#ifdef _WIN32
+        WaitForSingleObject(t->thread, INFINITE);
+        CloseHandle(t->thread);
+        DeleteCriticalSection(&t->lock);
+#else
+        pthread_join(t->thread, NULL);
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->changed);
+#endif
+    }
+    fclose(t->file);
+
+    for (int i=0; i<TRACE_CHUNKS; i++)
+        free(t->chunks[i]);
+    for (int i=0; i<CODE_SDRAM_PAGES + CODE_ROM_PAGES; i++)
+        free(t->seen[i]);
+    free(t->packed);
+    free(t->hash);
+    free(t);
+    m->trace = 0;
+}
+
+// ================================================
+//                  trace records
+// ================================================
+
+void trace_write_instr(F32Machine* m, unsigned int pc, int instr) {
+    Trace* t = m->trace;
+
+    // Has the instruction word at this address already been written?
+    int new_word = 1;
+    int index = code_page_index(pc);
+    if (index>=0) {
+        if (t->seen[index]==0)
+            t->seen[index] = my_malloc(CODE_PAGE_SIZE/8);
+        int w = (pc>>2) & (CODE_PAGE_SIZE-1);
+        new_word = !(t->seen[index][w>>5] & (1u<<(w&31)));
+        t->seen[index][w>>5] |= 1u<<(w&31);
+    }
+
+    unsigned char* p = reserve(t, 9);
+    int n = 1;
+    if (pc==t->expected_pc)
+        p[0] = new_word ? TR_INSTR_WORD : TR_INSTR;
+    else {
+        p[0] = new_word ? TR_INSTR_PC_WORD : TR_INSTR_PC;
+        put32(p+n, pc);
+        n += 4;
+    }
+    if (new_word) {
+        put32(p+n, instr);
+        n += 4;
+    }
+    t->length[t->head] -= 9-n;
+    t->expected_pc = pc+4;
+}
+
+void trace_write_reg(F32Machine* m, int reg_num, int value) {
+    unsigned char* p = reserve(m->trace, 6);
+    p[0] = TR_REG;
+    p[1] = reg_num;
+    put32(p+2, value);
+}
+
+void trace_write_mem(F32Machine* m, unsigned int addr, int value) {
+    unsigned char* p = reserve(m->trace, 9);
+    p[0] = TR_MEM;
+    put32(p+1, addr);
+    put32(p+5, value);
+}
+
+void trace_write_jump(F32Machine* m, unsigned int target) {
+    unsigned char* p = reserve(m->trace, 5);
+    p[0] = TR_JUMP;
+    put32(p+1, target);
+    m->trace->expected_pc = target;
+}
+
+void trace_write_exception(F32Machine* m, int cause, int value) {
+    unsigned char* p = reserve(m->trace, 6);
+    p[0] = TR_EXCEPTION;
+    p[1] = cause;
+    put32(p+2, value);
+    m->trace->expected_pc = ~0u;
+}
+
+void trace_write_interrupt(F32Machine* m, int cause) {
+    unsigned char* p = reserve(m->trace, 2);
+    p[0] = TR_INTERRUPT;
+    p[1] = cause;
+    m->trace->expected_pc = ~0u;
+}
+
+// Called on every store to SDRAM or ROM, so a changed instruction word gets written again
+void trace_invalidate(F32Machine* m, unsigned int addr) {
+    int index = code_page_index(addr);
+    unsigned int* seen = m->trace->seen[index];
+    if (seen) {
+        int w = (addr>>2) & (CODE_PAGE_SIZE-1);
+        seen[w>>5] &= ~(1u<<(w&31));
+    }
+}
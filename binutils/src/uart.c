@@ -0,0 +1,294 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#endif
+
+// ================================================
+//                  uart
+// ================================================
+//    E0000010  UART_TX  W  Send a byte
+//                       R  Space in the TX fifo - always reported as empty
+//    E0000014  UART_RX  R  Next byte received, or -1 if there is none
+//
+// Received data comes from a file, either the uart_input.hex format (a hex value per line,
+// passed to f32_set_files()) or raw bytes, or from a pseudo-terminal or unix socket that a
+// host program connects to. It is read ahead into a fifo, so reading the RX register doesn't
+// touch the host. Terminals and sockets are polled with an event every UART_POLL_CLOCKS, so
+// between polls the RX register is steady, and a program waiting for input can be skipped
+// over by F32_SKIP_IDLE.
+//
+// Sent bytes go into stdout and the uart log through stdio's buffers, or else are collected
+// in tx[] and passed on in blocks - to the output callback, or to the terminal or socket.
+// The block is passed on when tx[] is full, when the program finds RX empty (as it is
+// probably waiting for a reply), before any other device output, and at the end of f32_run().
+
+#define UART_TX_SIZE      4096
+#define UART_POLL_CLOCKS  10000
+
+struct Uart {
+    F32Machine* m;
+    FILE* raw;                  // Raw input file from f32_set_uart(), or NULL
+    int fd;                     // Terminal or socket, or -1
+    int rx[UART_RX_SIZE];
+    int rx_head, rx_count;
+    char tx[UART_TX_SIZE];
+    int tx_len;
+};
+
+// ================================================
+//                  receive
+// ================================================
+
+static void rx_put(Uart* u, int value) {
+    u->rx[(u->rx_head + u->rx_count++) % UART_RX_SIZE] = value;
+}
+
+// Fill the fifo from a file. Files can be read whenever needed, as they never block.
+static void read_file(Uart* u) {
+    FILE* f = u->raw ? u->raw : u->m->uart_input;
+    int value;
+    if (f==0 || feof(f))
+        return;
+    while (u->rx_count < UART_RX_SIZE) {
+        if (u->raw)
+            value = fgetc(f);
+        else if (fscanf(f, "%x\n", &value) != 1)
+            value = EOF;
+        if (value==EOF)
+            return;
+        rx_put(u, value);
+    }
+}
+
+#ifndef _WIN32
+static void close_fd(Uart* u) {
+    close(u->fd);
+    u->fd = -1;
+}
+
+static void poll_event(F32Machine* m, void* ctx) {
+    Uart* u = ctx;
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(u->fd, &fds);
+    struct timeval zero = {0, 0};
+    if (u->rx_count < UART_RX_SIZE && select(u->fd+1, &fds, 0, 0, &zero) > 0) {
+        unsigned char buf[UART_RX_SIZE];
+        int n = (int)read(u->fd, buf, UART_RX_SIZE - u->rx_count);
+        if (n==0) {
+            close_fd(u);        // The other end has gone
+            return;
+        }
+        for (int i=0; i<n; i++)
+            rx_put(u, buf[i]);
+    }
+    schedule_event(m, machine_time(m) + UART_POLL_CLOCKS, poll_event, u);
+}
+#endif
+
+static int uart_read(void* ctx, unsigned int addr, int* value) {
+    Uart* u = ctx;
+    if (addr==0xE0000010) {
+        *value = 0x3ff;
+        return 1;
+    }
+    if (u->rx_count==0 && u->fd<0)
+        read_file(u);
+    if (u->rx_count==0) {
+        uart_flush(u->m);
+        *value = -1;
+        return 1;
+    }
+    *value = u->rx[u->rx_head];
+    u->rx_head = (u->rx_head+1) % UART_RX_SIZE;
+    u->rx_count--;
+    u->m->device_effect = 1;
+    return 1;
+}
+
+// The hex input file has been replaced, as a batch case does after the fork. Drop anything
+// read ahead from the old one.
+void uart_new_input(F32Machine* m) {
+    Uart* u = m->uart;
+    if (u && u->raw==0 && u->fd<0)
+        u->rx_head = u->rx_count = 0;
+}
+
+// ================================================
+//                  send
+// ================================================
+
+static int uart_write(void* ctx, unsigned int addr, int value, int mask) {
+    Uart* u = ctx;
+    F32Machine* m = u->m;
+    (void)mask;
+    if (addr!=0xE0000010)
+        return 0;
+    if (m->replaying)
+        return 1;
+    if (u->fd<0 && m->output==0) {
+        if (m->uart_log)
+            putc(value, m->uart_log);
+        putchar(value);
+        return 1;
+    }
+    u->tx[u->tx_len++] = (char)value;
+    if (u->tx_len==UART_TX_SIZE)
+        uart_flush(m);
+    return 1;
+}
+
+void uart_flush(F32Machine* m) {
+    Uart* u = m->uart;
+    if (u==0 || u->tx_len==0)
+        return;
+    int len = u->tx_len;
+    u->tx_len = 0;
+    if (m->uart_log)
+        fwrite(u->tx, 1, len, m->uart_log);
+#ifndef _WIN32
+    if (u->fd>=0) {
+        for (int done=0, n; done<len; done+=n)
+            if ((n = (int)write(u->fd, u->tx+done, len-done)) <= 0) {
+                close_fd(u);
+                break;
+            }
+        return;
+    }
+#endif
+    if (m->output)
+        m->output(m->output_ctx, u->tx, len);
+}
+
+// ================================================
+//                  f32_set_uart
+// ================================================
+
+#ifndef _WIN32
+static int open_pty(void) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd<0 || grantpt(fd)!=0 || unlockpt(fd)!=0)
+        return -1;
+    // Keep the terminal open and raw, so it behaves the same before and after a program opens it
+    int slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    struct termios t;
+    if (slave>=0 && tcgetattr(slave, &t)==0) {
+        cfmakeraw(&t);
+        tcsetattr(slave, TCSANOW, &t);
+    }
+    printf("Uart on %s\n", ptsname(fd));
+    fflush(stdout);
+    return fd;
+}
+
+// Wait for a program to connect to the socket
+static int open_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s<0 || bind(s, (struct sockaddr*)&addr, sizeof(addr))!=0 || listen(s, 1)!=0)
+        return -1;
+    printf("Waiting for a uart connection on %s\n", path);
+    fflush(stdout);
+    int fd = accept(s, 0, 0);
+    close(s);
+    return fd;
+}
+#endif
+
+int f32_set_uart(F32Machine* m, const char* spec) {
+    Uart* u = m->uart;
+    if (strncmp(spec, "raw:", 4)==0) {
+        FILE* f = fopen(spec+4, "rb");
+        if (f==0)
+            return 0;
+        if (u->raw)
+            fclose(u->raw);
+        u->raw = f;
+        return 1;
+    }
+#ifndef _WIN32
+    int fd;
+    if (strcmp(spec, "pty")==0)
+        fd = open_pty();
+    else if (strncmp(spec, "unix:", 5)==0)
+        fd = open_socket(spec+5);
+    else
+        return 0;
+    if (fd<0)
+        return 0;
+    if (u->fd>=0)
+        close(u->fd);
+    u->fd = fd;
+    schedule_event(m, machine_time(m) + UART_POLL_CLOCKS, poll_event, u);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// ================================================
+//                  state
+// ================================================
+// Bytes sent have all gone, so only the receive side has state. The position in the input
+// file goes with it, so that record.c's replays read the same input again.
+
+void uart_get_state(Uart* u, UartState* state) {
+    FILE* f = u->raw ? u->raw : u->m->uart_input;
+    uart_flush(u->m);
+    for (int i=0; i<u->rx_count; i++)
+        state->rx[i] = u->rx[(u->rx_head + i) % UART_RX_SIZE];
+    state->rx_head = 0;
+    state->rx_count = u->rx_count;
+    state->input_pos = f ? ftell(f) : -1;
+}
+
+void uart_set_state(Uart* u, const UartState* state) {
+    FILE* f = u->raw ? u->raw : u->m->uart_input;
+    memcpy(u->rx, state->rx, sizeof(u->rx));
+    u->rx_head = state->rx_head % UART_RX_SIZE;
+    u->rx_count = state->rx_count;
+    if (f && state->input_pos >= 0)
+        fseek(f, state->input_pos, SEEK_SET);
+}
+
+// ================================================
+//                  create / destroy
+// ================================================
+
+Uart* uart_create(F32Machine* m) {
+    Uart* u = my_malloc(sizeof(Uart));
+    u->m = m;
+    u->fd = -1;
+    add_device(m, 0xE0000010, 8, uart_read, uart_write, u, 1);
+    return u;
+}
+
+void uart_destroy(F32Machine* m) {
+    Uart* u = m->uart;
+    uart_flush(m);
+    if (u->raw)
+        fclose(u->raw);
+#ifndef _WIN32
+    if (u->fd>=0)
+        close(u->fd);
+#endif
+    free(u);
+}
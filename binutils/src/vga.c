@@ -0,0 +1,364 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  vga
+// ================================================
+// A model of the display, following vga_control.sv and vga_layer.sv. The screen is 640x480,
+// made of up to 8 layers, each a rectangle of 8 bit pixels in SDRAM. Where layers overlap the
+// highest numbered one shows, and where there is no layer the screen shows the byte at address 0.
+// The 8 bit pixels go through a fixed RGB332 palette.
+//
+// The raster runs at one pixel every 4 clocks, with 800 pixel clocks per line and 525 lines
+// per frame (including the blanking). The simulator counts one clock per instruction, so the
+// scan line register follows machine_time().
+//
+// At the start of each frame, if frames are wanted, the visible part of each layer is copied
+// out of SDRAM into an 8 bit frame - a memcpy per layer per row. The frame is handed to a
+// background thread which expands it through the palette and writes it out, so writing
+// frames costs the simulation little more than the copy.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define VGA_WIDTH        640
+#define VGA_HEIGHT       480
+#define VGA_LINE_CLOCKS  (800*4)
+#define VGA_LINES        525
+#define VGA_FRAME_CLOCKS ((long long)VGA_LINE_CLOCKS*VGA_LINES)
+#define VGA_FRAMES       2      // Frames that can be waiting for the writer thread
+
+struct Vga {
+    F32Machine* m;
+    Layer layers[VGA_LAYERS];
+
+    string prefix;                      // Frames are written to <prefix>NNNNN.ppm, if set
+    F32Frame callback;
+    void* callback_ctx;
+    int frame_number;
+
+    unsigned char* frames[VGA_FRAMES];  // 8 bit frames for the writer thread
+    int number[VGA_FRAMES];             // Frame number of each
+    int full[VGA_FRAMES];
+    int head, tail;                     // Next frame to fill, and next one to write
+    int done;
+    int running;                        // The writer thread has been started
+    unsigned char* rgb;                 // Writer thread's RGB frame
+#ifdef _WIN32
+    HANDLE thread;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+#else
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+};
+
+// RGB of each 8 bit pixel, expanded from RGB332 by repeating the bits as vga_palette.sv does.
+// A constant table, as machines can be created on several threads at once.
+#define EXPAND3(x)   (((x)<<5) | ((x)<<2) | ((x)>>1))
+#define RGB332(i)    { EXPAND3((i)>>5), EXPAND3(((i)>>2)&7), ((i)&3) * 0x55 }
+#define RGB332_4(i)  RGB332(i), RGB332(i+1), RGB332(i+2), RGB332(i+3)
+#define RGB332_16(i) RGB332_4(i), RGB332_4(i+4), RGB332_4(i+8), RGB332_4(i+12)
+#define RGB332_64(i) RGB332_16(i), RGB332_16(i+16), RGB332_16(i+32), RGB332_16(i+48)
+
+static const unsigned char palette[256][3] = {
+    RGB332_64(0), RGB332_64(64), RGB332_64(128), RGB332_64(192)
+};
+
+// ================================================
+//                  registers
+// ================================================
+// Layer n has 8 registers at 0xE0001000 + 32*n. They are write only.
+
+static int layer_write(void* ctx, unsigned int addr, int value, int mask) {
+    Vga* v = ctx;
+    Layer* l = &v->layers[(addr>>5) & 7];
+    (void)mask;         // The registers are written whole
+    switch ((addr>>2) & 7) {
+        case 0: l->addr = value & 0x3ffffff; break;
+        case 1: l->x1 = value & 0x7ff; break;
+        case 2: l->y1 = value & 0x7ff; break;
+        case 3: l->x2 = value & 0x7ff; break;
+        case 4: l->y2 = value & 0x7ff; break;
+        case 5: l->bpl = value & 0x7ff; break;
+        case 6: l->bpp = value & 3; break;
+        default: return 0;
+    }
+    return 1;
+}
+
+// The scan line being displayed, counting the blanking lines from 480 to 524. The RTL has it
+// at 0xE0000024, the simulator has always had it at 0xE0000028, so answer at both.
+static int row_read(void* ctx, unsigned int addr, int* value) {
+    Vga* v = ctx;
+    (void)addr;
+    *value = (int)(machine_time(v->m) / VGA_LINE_CLOCKS % VGA_LINES);
+    return 1;
+}
+
+// ================================================
+//                  compose
+// ================================================
+
+// Copy n bytes of SDRAM. Pages never written read as MEM_UNTOUCHED, without creating them.
+static void read_bytes(F32Machine* m, unsigned int addr, unsigned char* dest, int n) {
+    static const unsigned char untouched[4] = {0x0D, 0xF0, 0xAD, 0xBA};
+    while (n > 0) {
+        addr &= MEM_SIZE-1;
+        int offset = addr & (MEM_PAGE_SIZE-1);
+        int len = MEM_PAGE_SIZE - offset;
+        if (len > n)
+            len = n;
+        int* page = m->mem_pages[addr >> MEM_PAGE_BITS];
+        if (page)
+            memcpy(dest, (unsigned char*)page + offset, len);
+        else
+            for (int i=0; i<len; i++)
+                dest[i] = untouched[(addr+i) & 3];
+        addr += len;
+        dest += len;
+        n -= len;
+    }
+}
+
+static void compose(Vga* v, unsigned char* frame) {
+    unsigned char background;
+    read_bytes(v->m, 0, &background, 1);
+    memset(frame, background, VGA_WIDTH*VGA_HEIGHT);
+
+    for (int n=0; n<VGA_LAYERS; n++) {
+        Layer* l = &v->layers[n];
+        int x1 = l->x1, x2 = l->x2 < VGA_WIDTH ? l->x2 : VGA_WIDTH;
+        int y2 = l->y2 < VGA_HEIGHT ? l->y2 : VGA_HEIGHT;
+        if (x1 >= x2)
+            continue;
+        for (int y=l->y1; y<y2; y++) {
+            unsigned int addr = l->addr + (unsigned)(y - l->y1)*l->bpl;
+            unsigned char* dest = frame + y*VGA_WIDTH + x1;
+            if (l->bpp==1)
+                read_bytes(v->m, addr, dest, x2-x1);
+            else
+                for (int x=x1; x<x2; x++)
+                    read_bytes(v->m, addr + (unsigned)(x-x1)*l->bpp, dest + x-x1, 1);
+        }
+    }
+}
+
+// ================================================
+//                  writer thread
+// ================================================
+
+#ifdef _WIN32
+#define LOCK(v)     EnterCriticalSection(&v->lock)
+#define UNLOCK(v)   LeaveCriticalSection(&v->lock)
+#define WAIT(v)     SleepConditionVariableCS(&v->changed, &v->lock, INFINITE)
+#define SIGNAL(v)   WakeAllConditionVariable(&v->changed)
+#else
+#define LOCK(v)     pthread_mutex_lock(&v->lock)
+#define UNLOCK(v)   pthread_mutex_unlock(&v->lock)
+#define WAIT(v)     pthread_cond_wait(&v->changed, &v->lock)
+#define SIGNAL(v)   pthread_cond_broadcast(&v->changed)
+#endif
+
+static void expand(const unsigned char* frame, unsigned char* rgb) {
+    for (int i=0; i<VGA_WIDTH*VGA_HEIGHT; i++) {
+        const unsigned char* c = palette[frame[i]];
+        rgb[3*i] = c[0];
+        rgb[3*i+1] = c[1];
+        rgb[3*i+2] = c[2];
+    }
+}
+
+static int write_ppm(const char* filename, const unsigned char* rgb) {
+    FILE* file = fopen(filename, "wb");
+    if (file==NULL)
+        return 0;
+    fprintf(file, "P6\n%d %d\n255\n", VGA_WIDTH, VGA_HEIGHT);
+    fwrite(rgb, 3, VGA_WIDTH*VGA_HEIGHT, file);
+    fclose(file);
+    return 1;
+}
+
+static void output_frame(Vga* v, const unsigned char* frame, int number) {
+    expand(frame, v->rgb);
+    if (v->prefix) {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s%05d.ppm", v->prefix, number);
+        if (!write_ppm(filename, v->rgb))
+            printf("Can't create '%s'\n", filename);
+    }
+    if (v->callback)
+        v->callback(v->callback_ctx, v->rgb, VGA_WIDTH, VGA_HEIGHT, number);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI writer_thread(void* arg) {
+#else
+static void* writer_thread(void* arg) {
+#endif
+    Vga* v = arg;
+    LOCK(v);
+    while (1) {
+        while (!v->full[v->tail] && !v->done)
+            WAIT(v);
+        if (!v->full[v->tail])
+            break;
+        UNLOCK(v);
+        output_frame(v, v->frames[v->tail], v->number[v->tail]);
+        LOCK(v);
+        v->full[v->tail] = 0;
+        v->tail = (v->tail+1) % VGA_FRAMES;
+        SIGNAL(v);
+    }
+    UNLOCK(v);
+    return 0;
+}
+
+static long long next_frame(F32Machine* m) {
+    return (machine_time(m) / VGA_FRAME_CLOCKS + 1) * VGA_FRAME_CLOCKS;
+}
+
+// The event at the start of each frame, while frames are wanted. Composes the frame and passes
+// it to the writer thread, waiting if the thread is still busy with the earlier frames.
+static void vsync(F32Machine* m, void* ctx) {
+    Vga* v = ctx;
+    schedule_event(m, next_frame(m), vsync, v);
+
+    blitter_update(m);      // Draw anything the blitter has finished by now
+    if (m->replaying)
+        return;             // These frames have already been written
+    LOCK(v);
+    while (v->full[v->head])
+        WAIT(v);
+    UNLOCK(v);
+    compose(v, v->frames[v->head]);
+    LOCK(v);
+    v->number[v->head] = v->frame_number++;
+    v->full[v->head] = 1;
+    v->head = (v->head+1) % VGA_FRAMES;
+    SIGNAL(v);
+    UNLOCK(v);
+}
+
+static void start_writer(Vga* v) {
+    if (v->running)
+        return;
+    for (int i=0; i<VGA_FRAMES; i++)
+        v->frames[i] = my_malloc(VGA_WIDTH*VGA_HEIGHT);
+    v->rgb = my_malloc(3*VGA_WIDTH*VGA_HEIGHT);
+    v->running = 1;
+#ifdef _WIN32
+    InitializeCriticalSection(&v->lock);
+    InitializeConditionVariable(&v->changed);
+    v->thread = CreateThread(NULL, 0, writer_thread, v, 0, NULL);
+#else
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->changed, NULL);
+    pthread_create(&v->thread, NULL, writer_thread, v);
+#endif
+
+    // Frames are taken from the next vertical sync on
+    schedule_event(v->m, next_frame(v->m), vsync, v);
+}
+
+// Wait for the writer thread to finish the frames it has been given
+static void stop_writer(Vga* v) {
+    if (!v->running)
+        return;
+    cancel_event(v->m, vsync, v);
+    LOCK(v);
+    v->done = 1;
+    SIGNAL(v);
+    UNLOCK(v);
+#ifdef _WIN32
+    WaitForSingleObject(v->thread, INFINITE);
+    CloseHandle(v->thread);
+    DeleteCriticalSection(&v->lock);
+#else
+    pthread_join(v->thread, NULL);
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->changed);
+#endif
+    for (int i=0; i<VGA_FRAMES; i++)
+        free(v->frames[i]);
+    free(v->rgb);
+    v->running = 0;
+    v->done = 0;
+}
+
+// The start of the next scan line. Frames start on a line too.
+long long vga_next_row(F32Machine* m) {
+    return (machine_time(m) / VGA_LINE_CLOCKS + 1) * VGA_LINE_CLOCKS;
+}
+
+// ================================================
+//                  vga_create / vga_destroy
+// ================================================
+
+Vga* vga_create(F32Machine* m) {
+    Vga* v = my_malloc(sizeof(Vga));
+    v->m = m;
+    add_device(m, VGA_LAYER_BASE, 32*VGA_LAYERS, 0, layer_write, v, 1);
+    add_device(m, 0xE0000024, 8, row_read, 0, v, 1);
+    return v;
+}
+
+void vga_destroy(Vga* v) {
+    stop_writer(v);
+    free(v);
+}
+
+void vga_get_state(Vga* v, Layer* layers) {
+    memcpy(layers, v->layers, sizeof(v->layers));
+}
+
+void vga_set_state(Vga* v, const Layer* layers) {
+    memcpy(v->layers, layers, sizeof(v->layers));
+}
+
+// ================================================
+//                  f32_set_frames
+// ================================================
+
+void f32_set_frames(F32Machine* m, const char* prefix) {
+    Vga* v = m->vga;
+    stop_writer(v);
+    free((char*)v->prefix);
+    v->prefix = prefix ? strdup(prefix) : 0;
+    if (v->prefix || v->callback)
+        start_writer(v);
+}
+
+void f32_set_frame_callback(F32Machine* m, F32Frame callback, void* ctx) {
+    Vga* v = m->vga;
+    stop_writer(v);
+    v->callback = callback;
+    v->callback_ctx = ctx;
+    if (v->prefix || v->callback)
+        start_writer(v);
+}
+
+// ================================================
+//                  f32_write_screen
+// ================================================
+
+int f32_write_screen(F32Machine* m, const char* filename) {
+    blitter_update(m);
+    unsigned char* frame = my_malloc(VGA_WIDTH*VGA_HEIGHT);
+    unsigned char* rgb = my_malloc(3*VGA_WIDTH*VGA_HEIGHT);
+    compose(m->vga, frame);
+    expand(frame, rgb);
+    int ok = write_ppm(filename, rgb);
+    free(frame);
+    free(rgb);
+    return ok;
+}
@@ -0,0 +1,132 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "f32.h"
+#include "sim.h"
+
+// ================================================
+//                  watchpoints
+// ================================================
+// Watch loads, stores and instruction fetches in ranges of memory. Each hit is printed, or
+// with F32_WATCH_STOP makes f32_run() stop after the instruction.
+//
+// Loads and stores are checked in read_memory_size() and write_memory_size(), only when
+// there are watches. The interpreter's word load and the JIT skip those for SDRAM, so they
+// look pages up in fast_pages, which is mem_pages with the watched pages left out - anything
+// touching a watched page goes the slow way, and everything else runs as it would without
+// watches.
+//
+// Instruction fetches are watched by setting breakpoints on the words, which leaves them to
+// the single step interpreter. Only the CPU's accesses are seen, not those of the devices.
+
+static int overlaps(Watch* w, unsigned int addr, unsigned int last) {
+    return addr <= w->last && last >= w->addr;
+}
+
+int page_watched(F32Machine* m, int page) {
+    unsigned int addr = (unsigned int)page << MEM_PAGE_BITS;
+    for (int i=0; i<m->num_watches; i++)
+        if ((m->watches[i].flags & (F32_WATCH_READ | F32_WATCH_WRITE))
+            && overlaps(&m->watches[i], addr, addr + MEM_PAGE_SIZE - 1))
+            return 1;
+    return 0;
+}
+
+static void update_fast_pages(F32Machine* m) {
+    for (int i=0; i<MEM_NUM_PAGES; i++)
+        m->fast_pages[i] = page_watched(m, i) ? 0 : m->mem_pages[i];
+}
+
+// Set or clear breakpoints on the words of a range
+static void set_exec_watch(F32Machine* m, Watch* w, int set) {
+    for (unsigned int a = w->addr & ~3u; a <= w->last && a >= (w->addr & ~3u); a += 4)
+        f32_set_breakpoint(m, a, set);
+}
+
+// ================================================
+//                  f32_add_watch
+// ================================================
+
+int f32_add_watch(F32Machine* m, unsigned int addr, unsigned int len, int flags) {
+    if (len==0 || addr + (len-1) < addr || m->num_watches==MAX_WATCHES)
+        return 0;
+    Watch* w = &m->watches[m->num_watches++];
+    w->addr = addr;
+    w->last = addr + (len-1);
+    w->flags = flags;
+    if (flags & F32_WATCH_EXEC)
+        set_exec_watch(m, w, 1);
+    update_fast_pages(m);
+    return 1;
+}
+
+void f32_remove_watch(F32Machine* m, unsigned int addr, unsigned int len, int flags) {
+    for (int i=0; i<m->num_watches; i++) {
+        Watch* w = &m->watches[i];
+        if (w->addr!=addr || w->last!=addr + (len-1) || w->flags!=flags)
+            continue;
+        Watch old = *w;
+        m->watches[i] = m->watches[--m->num_watches];
+        if (old.flags & F32_WATCH_EXEC) {
+            set_exec_watch(m, &old, 0);
+            // Put back the breakpoints of any other watches on the same words
+            for (int j=0; j<m->num_watches; j++)
+                if ((m->watches[j].flags & F32_WATCH_EXEC) && overlaps(&m->watches[j], old.addr, old.last))
+                    set_exec_watch(m, &m->watches[j], 1);
+        }
+        update_fast_pages(m);
+        return;
+    }
+}
+
+int f32_watch_hit(F32Machine* m, unsigned int* addr) {
+    *addr = m->watch_addr;
+    return m->watch_kind;
+}
+
+// ================================================
+//                  check_watch
+// ================================================
+// Called after a load or store of len bytes. The pc has already moved past the instruction.
+// Every watch on the bytes sees the access, so each one that prints does, and any that stops
+// does.
+
+void check_watch(F32Machine* m, unsigned int addr, int len, int value, int kind) {
+    if (m->exception)
+        return;
+    for (int i=0; i<m->num_watches; i++) {
+        Watch* w = &m->watches[i];
+        if (!(w->flags & kind) || !overlaps(w, addr, addr + (len-1)))
+            continue;
+        if (w->flags & F32_WATCH_STOP) {
+            m->watch_addr = addr;
+            m->watch_kind = kind;
+            m->stop = F32_WATCHPOINT;
+            m->end_block = 1;
+        } else if (!m->replaying)
+            printf("WATCH %s [%08x] = %08x at pc=%08x\n", kind==F32_WATCH_READ ? "read" : "write", addr, value, m->pc-4);
+    }
+}
+
+// Called at a breakpoint. Returns 0 to stop if a watch that stops is on the instruction and
+// can_stop is set. Otherwise each watch that prints does, and returns 1 if there were any, as
+// the breakpoint is only there for them and the instruction should be run. Stopping leaves
+// the printing until the instruction is run, with can_stop clear.
+int watch_exec(F32Machine* m, int can_stop) {
+    int print = 0;
+    for (int i=0; i<m->num_watches; i++) {
+        Watch* w = &m->watches[i];
+        if ((w->flags & F32_WATCH_EXEC) && overlaps(w, m->pc, m->pc+3)) {
+            if ((w->flags & F32_WATCH_STOP) && can_stop)
+                return 0;
+            print |= !(w->flags & F32_WATCH_STOP);
+        }
+    }
+    for (int i=0; i<m->num_watches && print && !m->replaying; i++) {
+        Watch* w = &m->watches[i];
+        if ((w->flags & F32_WATCH_EXEC) && !(w->flags & F32_WATCH_STOP) && overlaps(w, m->pc, m->pc+3))
+            printf("WATCH exec at pc=%08x\n", m->pc);
+    }
+    return print;
+}
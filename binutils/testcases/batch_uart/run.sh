@@ -0,0 +1,17 @@
+#!/bin/sh
+# usage: run.sh [bin directory]
+bin=${1:-../../../bin}
+cd "$(dirname "$0")"
+rm -f asm.hex
+$bin/f32asm batch_uart.f32 > /dev/null 2>&1
+[ -f asm.hex ] || exit 1
+$bin/f32sim -q --batch batch.txt asm.hex > /dev/null || exit 1
+fail=0
+check() {
+    if [ "$(cat $1)" != "$2" ]; then echo "FAIL $1: '$(cat $1)', expected '$2'"; fail=1; fi
+}
+check sim_uart.log A
+check c1/sim_uart.log XY
+check c2/sim_uart.log Z[
+[ $fail = 0 ] && echo "batch_uart ok"
+exit $fail
@@ -0,0 +1,15 @@
+#!/bin/sh
+# usage: run.sh [bin directory]
+bin=${1:-../../../bin}
+cd "$(dirname "$0")"
+rm -f asm.hex
+$bin/f32asm trace_pages.f32 > /dev/null 2>&1
+[ -f asm.hex ] || exit 1
+$bin/f32sim -q -t asm.hex > /dev/null || exit 1
+$bin/f32sim -q -tb asm.hex > /dev/null || exit 1
+$bin/f32trace sim_trace.bin > trace.txt || exit 1
+if ! cmp -s trace.txt sim_traace.log; then
+    echo "FAIL trace_pages: decoded trace differs from sim_traace.log"
+    exit 1
+fi
+echo "trace_pages ok"